@@ -0,0 +1,301 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "SerialUtil.h"
+#include "Bindings.h"
+
+#if MAX_BINDINGS
+
+static_assert(BINDINGS_OFFSET + MAX_BINDINGS * BINDING_SIZE <= EEPROM_SIZE,
+              "Bindings don't fit in the EEPROM");
+
+typedef struct {
+  WATCH_TYPE mask;
+  uint8_t layer;
+  uint8_t action;
+} binding_t;
+
+static binding_t bindings[MAX_BINDINGS];      // Sorted by layer then mask
+static uint8_t bindingCount = 0;
+
+static WATCH_TYPE chordPins[MAX_LAYERS];      // Pins in a chord on each layer
+static WATCH_TYPE layerKeys = 0;
+static uint8_t activeLayer = 0;
+
+static WATCH_TYPE chordPressed = 0;           // Chord pins waiting for the window
+static unsigned long chordStartMillis = 0;
+
+static inline bool bindingLess(uint8_t layer, WATCH_TYPE mask, const binding_t *b) {
+  return layer < b->layer || (layer == b->layer && mask < b->mask);
+}
+
+/* Index of the binding or where it would go */
+static uint8_t bindingFind(uint8_t layer, WATCH_TYPE mask) {
+  uint8_t low = 0, high = bindingCount;
+  while (low < high) {
+    uint8_t mid = (low + high) / 2;
+    if (bindingLess(layer, mask, &bindings[mid]) || 
+        (bindings[mid].layer == layer && bindings[mid].mask == mask))
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  return low;
+}
+
+static const binding_t *bindingLookup(uint8_t layer, WATCH_TYPE mask) {
+  uint8_t i = bindingFind(layer, mask);
+  if (i < bindingCount && bindings[i].layer == layer && bindings[i].mask == mask)
+    return &bindings[i];
+  return NULL;
+}
+
+static void bindingsIndex() {
+  memset(chordPins, 0, sizeof(chordPins));
+  layerKeys = 0;
+  for (uint8_t i = 0; i < bindingCount; i++) {
+    const binding_t *b = &bindings[i];
+    if (b->layer == BINDING_LAYER_KEYS)
+      layerKeys |= b->mask;
+    else if (b->mask & (b->mask - 1))
+      chordPins[b->layer] |= b->mask;
+  }
+}
+
+static void bindingsSave() {
+  for (uint8_t i = 0; i < MAX_BINDINGS; i++) {
+    uint16_t offset = BINDINGS_OFFSET + i * BINDING_SIZE;
+    binding_t empty = { 0, 0, BINDING_NONE };
+    const binding_t *b = i < bindingCount ? &bindings[i] : &empty;
+
+    for (uint8_t byteIdx = 0; byteIdx < 8; byteIdx++)
+      updateEeprom(offset + byteIdx, (uint64_t) b->mask >> (byteIdx * 8));
+    updateEeprom(offset + 8, b->layer);
+    updateEeprom(offset + 9, b->action);
+  }
+#ifdef ESP32
+  EEPROM.commit();
+#endif
+}
+
+/* The EEPROM may hold a table written for more pins, or be garbage */
+static bool bindingValid(const binding_t *b) {
+  if (b->action == BINDING_NONE || !b->mask)
+    return false;
+
+  for (WATCH_TYPE pins = b->mask; pins; pins &= pins - 1)
+    if (!IS_PIN_INPUT(FIRST_INPUT_PIN + __builtin_ctzll(pins)))
+      return false;
+
+  if (b->layer == BINDING_LAYER_KEYS)
+    return !(b->mask & (b->mask - 1)) && b->action < MAX_LAYERS;
+  return b->layer < MAX_LAYERS && IS_VALID_INPUT(b->action);
+}
+
+void bindingsLoad() {
+  bindingCount = 0;
+
+  for (uint8_t i = 0; i < MAX_BINDINGS; i++) {
+    uint16_t offset = BINDINGS_OFFSET + i * BINDING_SIZE;
+    binding_t b;
+    uint64_t mask = 0;
+
+    for (uint8_t byteIdx = 0; byteIdx < 8; byteIdx++)
+      mask |= (uint64_t) EEPROM.read(offset + byteIdx) << (byteIdx * 8);
+    b.mask = mask;
+    b.layer = EEPROM.read(offset + 8);
+    b.action = EEPROM.read(offset + 9);
+
+    if (!bindingValid(&b))
+      continue;
+
+    // Stored sorted, but insert in order anyway so a hand edited or 
+    // partly written table still works
+    uint8_t at = bindingFind(b.layer, b.mask);
+    if (at < bindingCount && bindings[at].layer == b.layer && bindings[at].mask == b.mask)
+      continue;
+    memmove(&bindings[at + 1], &bindings[at], (bindingCount - at) * sizeof(binding_t));
+    bindings[at] = b;
+    bindingCount++;
+  }
+
+  bindingsIndex();
+  activeLayer = 0;
+  chordPressed = 0;
+}
+
+WATCH_TYPE bindingsPins() {
+  WATCH_TYPE pins = 0;
+  for (uint8_t i = 0; i < bindingCount; i++)
+    pins |= bindings[i].mask;
+  return pins;
+}
+
+void bindingsPrint() {
+  for (uint8_t i = 0; i < bindingCount; i++) {
+    const binding_t *b = &bindings[i];
+    if (b->layer == BINDING_LAYER_KEYS) {
+      Serial.printf("Pin %d: layer key for layer %d\n", FIRST_INPUT_PIN + __builtin_ctzll(b->mask), b->action);
+      continue;
+    }
+    Serial.printf("Layer %d pins", b->layer);
+    for (WATCH_TYPE pins = b->mask; pins; pins &= pins - 1)
+      Serial.printf(" %d", FIRST_INPUT_PIN + __builtin_ctzll(pins));
+    Serial.printf(": input %d\n", b->action);
+  }
+}
+
+bool bindingsSet(uint8_t layer, WATCH_TYPE mask, uint8_t action) {
+  if ((layer >= MAX_LAYERS && layer != BINDING_LAYER_KEYS) || !mask)
+    return false;
+  if (layer == BINDING_LAYER_KEYS && ((mask & (mask - 1)) || action >= MAX_LAYERS))
+    return false;
+
+  uint8_t at = bindingFind(layer, mask);
+  bool exists = at < bindingCount && bindings[at].layer == layer && bindings[at].mask == mask;
+
+  if (action == BINDING_NONE) {
+    if (!exists)
+      return false;
+    memmove(&bindings[at], &bindings[at + 1], (bindingCount - at - 1) * sizeof(binding_t));
+    bindingCount--;
+  } else if (exists) {
+    bindings[at].action = action;
+  } else {
+    if (bindingCount >= MAX_BINDINGS)
+      return false;
+    memmove(&bindings[at + 1], &bindings[at], (bindingCount - at) * sizeof(binding_t));
+    bindings[at].mask = mask;
+    bindings[at].layer = layer;
+    bindings[at].action = action;
+    bindingCount++;
+  }
+
+  bindingsIndex();
+  bindingsSave();
+  return true;
+}
+
+/* A single pin's macro on the active layer, or its own */
+static void sendPin(uint8_t bit, send_key_t sendKey) {
+  const binding_t *b = activeLayer ? bindingLookup(activeLayer, (WATCH_TYPE) 1 << bit) : NULL;
+  if (b && sendInputRepeated(b->action, 1, sendKey))
+    return;
+  processInputChange(FIRST_INPUT_PIN + bit, 0, sendKey);
+}
+
+static void resolveChord(send_key_t sendKey) {
+  WATCH_TYPE pressed = chordPressed;
+  chordPressed = 0;
+
+  const binding_t *b = bindingLookup(activeLayer, pressed);
+  if (b) {
+    Serial.printf("Chord %llx on layer %d\n", (uint64_t) pressed, activeLayer);
+    sendInputRepeated(b->action, 1, sendKey);
+    return;
+  }
+
+  // Not a chord, each pin on its own in pin order
+  while (pressed) {
+    sendPin(__builtin_ctzll(pressed), sendKey);
+    pressed &= pressed - 1;
+  }
+}
+
+static void updateLayer(WATCH_TYPE held) {
+  uint8_t layer = 0;
+  for (WATCH_TYPE keys = held & layerKeys; keys; keys &= keys - 1) {
+    const binding_t *b = bindingLookup(BINDING_LAYER_KEYS, keys & -keys);
+    if (b && b->action > layer)
+      layer = b->action;
+  }
+
+  if (layer != activeLayer)
+    Serial.printf("Layer %d\n", layer);
+  activeLayer = layer;
+}
+
+void bindingsPinChange(uint8_t pin, uint8_t value, WATCH_TYPE held, send_key_t sendKey) {
+  uint8_t bit = pin - FIRST_INPUT_PIN;
+  WATCH_TYPE pinMask = (WATCH_TYPE) 1 << bit;
+
+  if (layerKeys & pinMask) {
+    updateLayer(held);
+    return;
+  }
+
+  if (value) {
+    // A chord pin let go early ends the window
+    if (chordPressed & pinMask)
+      resolveChord(sendKey);
+    processInputChange(pin, value, sendKey);
+    return;
+  }
+
+  if (!(chordPins[activeLayer] & pinMask)) {
+    sendPin(bit, sendKey);
+    return;
+  }
+
+  if (!chordPressed)
+    chordStartMillis = millis();
+  chordPressed |= pinMask;
+}
+
+void bindingsPoll(send_key_t sendKey) {
+  if (chordPressed && millis() - chordStartMillis >= CHORD_WINDOW_MS)
+    resolveChord(sendKey);
+}
+
+int readBindingUpdateFromSerial(bool layerKey) {
+  uint8_t layer, action = BINDING_NONE, pin;
+  char terminator;
+  WATCH_TYPE mask = 0;
+
+  if (layerKey) {
+    if (serialTimedReadNum(&pin, &terminator, false) || terminator != ' ' ||
+        serialTimedReadNum(&layer, &terminator, false) || terminator != ';') {
+      Serial.println("Expected pin and layer");
+      return -1;
+    }
+    if (!IS_PIN_INPUT(pin) || layer >= MAX_LAYERS) {
+      Serial.println("Invalid pin or layer");
+      return -1;
+    }
+    serialInput->read();
+    mask = (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
+    action = layer;
+    layer = BINDING_LAYER_KEYS;
+  } else {
+    if (serialTimedReadNum(&layer, &terminator, false) || terminator != ' ' ||
+        serialTimedReadNum(&action, &terminator, false) || terminator != ' ') {
+      Serial.println("Expected layer and input");
+      return -1;
+    }
+    if (layer >= MAX_LAYERS || (action != BINDING_NONE && !IS_VALID_INPUT(action))) {
+      Serial.println("Invalid layer or input");
+      return -1;
+    }
+
+    while (terminator != ';') {
+      if (serialTimedReadNum(&pin, &terminator, false) || !IS_PIN_INPUT(pin)) {
+        Serial.println("Invalid pin");
+        return -1;
+      }
+      mask |= (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
+      if (terminator != ';' && serialTimedSkipWhitespace(&terminator)) {
+        Serial.println("Timeout reading pins");
+        return -1;
+      }
+    }
+    serialInput->read();
+  }
+
+  if (!bindingsSet(layer, mask, action)) {
+    Serial.println("Binding not updated");
+    return -1;
+  }
+  bindingsPrint();
+  return 0;
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef Bindings_h
+#define Bindings_h
+
+#include <stdint.h>
+#include "eeprom_config.h"
+
+/* Chords and layers for the native pins
+ *
+ * A binding maps a set of pins (a WATCH_TYPE mask) on a layer to the macro
+ * of an input, usually a pool macro. A mask with more than one pin is a
+ * chord, those pins pressed within CHORD_WINDOW_MS send the binding's 
+ * macro instead of their own. A single pin binding on a layer above 0
+ * replaces the pin's own macro while that layer is active. 
+ *
+ * A layer key is a pin that selects a layer while it's held, the highest
+ * held layer wins. Pins with no binding on the active layer fall back to
+ * their own macro.
+ *
+ * Bindings are kept sorted by layer and mask so resolving a press is a
+ * binary search whatever the number of chords. Pins that aren't part of 
+ * any chord on the active layer are sent straight away, only chord pins
+ * wait for the window. */
+
+#define CHORD_WINDOW_MS   50
+#define MAX_LAYERS        8
+#define BINDING_LAYER_KEYS 0xff   // Pseudo layer holding the layer keys, the action is the layer
+#define BINDING_NONE       0
+
+void bindingsLoad();
+void bindingsPrint();
+/* Every pin used in a binding, they need watching even without a macro */
+WATCH_TYPE bindingsPins();
+/* Add, replace or (with action BINDING_NONE) remove a binding, action is
+ * the input whose macro is sent, or for BINDING_LAYER_KEYS the layer */
+bool bindingsSet(uint8_t layer, WATCH_TYPE mask, uint8_t action);
+/* Debounced pin changes, held is the debounced mask of pressed pins */
+void bindingsPinChange(uint8_t pin, uint8_t value, WATCH_TYPE held, send_key_t sendKey);
+/* Resolve chords whose window has run out */
+void bindingsPoll(send_key_t sendKey);
+/* Read "layer input pin [pin...];" (input 0 removes the binding) or, for a
+ * layer key, "pin layer;" (layer 0 removes it) from serial */
+int readBindingUpdateFromSerial(bool layerKey);
+
+#endif
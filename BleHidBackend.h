@@ -0,0 +1,95 @@
+#ifndef BleHidBackend_h
+#define BleHidBackend_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The HID server can run on either the Bluedroid or the NimBLE host stack,
+ * chosen at build time. In ESP-IDF this follows menuconfig, under Arduino
+ * define BLE_KEYBOARD_NIMBLE (and install NimBLE-Arduino) to use NimBLE */
+#ifdef IDF_VER
+#include <sdkconfig.h>
+#endif
+
+#if defined(CONFIG_BT_NIMBLE_ENABLED) || defined(BLE_KEYBOARD_NIMBLE)
+#define BLE_HID_BACKEND_NIMBLE 1
+#define BLE_HID_BACKEND_NAME "NimBLE"
+#else
+#ifdef IDF_VER
+/* If we're being compiled in the ESP IDF environment
+ * make sure bluedroid is enabled */
+#ifndef CONFIG_BLUEDROID_ENABLED
+#error Looks like Bluetooth is not enabled in menuconfig
+#endif
+#endif
+#define BLE_HID_BACKEND_BLUEDROID 1
+#define BLE_HID_BACKEND_NAME "Bluedroid"
+#endif
+
+#define BLE_ADDR_LEN 6
+#define BLE_HID_MAX_INPUT_REPORTS 4
+#define BLE_HID_MAX_CONNECTIONS   4
+
+// Notifications that can be waiting to be sent before a send waits for
+// one to complete (Bluedroid, NimBLE is limited by its msys mbuf pool),
+// then how long to wait
+#define BLE_HID_NOTIFY_IN_FLIGHT   8
+#define BLE_HID_NOTIFY_WAIT_TICKS  20
+
+// Vendor service with a read only characteristic for runtime metrics
+#define BLE_METRICS_SERVICE_UUID   "6e7a0001-6b65-7962-6f61-72646d657472"
+#define BLE_METRICS_CHAR_UUID      "6e7a0002-6b65-7962-6f61-72646d657472"
+#define BLE_METRICS_MAX_LEN        80
+
+/* Peer address, most significant byte first (the same order as
+ * Bluedroid's esp_bd_addr_t and as it is printed) */
+typedef struct {
+  uint8_t val[BLE_ADDR_LEN];
+  uint8_t type;
+} ble_peer_t;
+
+typedef enum {
+  BLE_HID_AUTH_BOND = 0,        // Bond, no MITM protection
+  BLE_HID_AUTH_SC_MITM_BOND     // Secure connections with MITM protection, show passkey
+} ble_hid_auth_t;
+
+/* Events from the stack, called on the stack's task */
+typedef struct {
+  void (*onConnect)(uint16_t connId, const ble_peer_t *peer);
+  void (*onDisconnect)(uint16_t connId, const ble_peer_t *peer);
+  void (*onAuthenticated)(const ble_peer_t *peer);
+  void (*onPassKeyNotify)(uint32_t passKey);
+  void (*onOutputReport)(uint16_t connId, const uint8_t *data, size_t len);
+  // Fill in the metrics characteristic's value, returns its length
+  size_t (*onReadMetrics)(uint8_t *buf, size_t max);
+} ble_hid_events_t;
+
+class BleHidBackend {
+  public:
+    /* Bring up the stack, the HID services and start advertising. There's
+     * an input report characteristic for each of the report map's input 
+     * report IDs, up to BLE_HID_MAX_INPUT_REPORTS, output report 1 is 
+     * the keyboard LEDs. With onReadMetrics there's also the metrics
+     * service */
+    virtual void begin(const char *deviceName, const char *manufacturer, ble_hid_auth_t authMode,
+                       const uint8_t *reportMap, size_t reportMapLen,
+                       const uint8_t *inputReportIds, size_t inputReportCount,
+                       const ble_hid_events_t *events) = 0;
+    /* Notify connected hosts of a new input report */
+    virtual bool notifyInput(uint8_t reportId, const uint8_t *report, size_t len) = 0;
+    virtual void getLocalAddress(uint8_t *addr) = 0;
+    virtual void disconnect(uint16_t connId) = 0;
+    virtual int getBondedPeers(ble_peer_t *out, int max) = 0;
+
+    /* Used by the reconnect policy, intervals are in 0.625ms units. A
+     * directed peer means directed advertising, high duty cycle on
+     * Bluedroid (which stops itself after 1.28s) and low duty cycle on
+     * NimBLE, whose advertising API doesn't expose the high duty flag */
+    virtual bool startAdvertising(uint16_t intervalMin, uint16_t intervalMax, const ble_peer_t *directedPeer) = 0;
+    virtual void stopAdvertising() = 0;
+};
+
+/* Defined by whichever backend is compiled in */
+BleHidBackend *bleHidBackend();
+
+#endif
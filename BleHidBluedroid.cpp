@@ -0,0 +1,374 @@
+/* Bluedroid implementation of the BLE HID server, using the Arduino BLE library */
+
+#include "BleHidBackend.h"
+
+#ifdef BLE_HID_BACKEND_BLUEDROID
+
+#include <Arduino.h>
+#include <new>
+#include <atomic>
+#include <BLEDevice.h>
+#include <BLEUtils.h>
+#include <BLEServer.h>
+#include "BLE2902.h"
+#include "BLEHIDDevice.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "BleReconnect.h"
+
+static const char *LOG_TAG = "blebluedroid";
+
+static BLEHIDDevice* hid;
+static BLECharacteristic* inputs[BLE_HID_MAX_INPUT_REPORTS];
+static uint8_t inputIds[BLE_HID_MAX_INPUT_REPORTS];
+static size_t inputCount = 0;
+static BLECharacteristic* output;
+static BLECharacteristic* metrics = NULL;
+static BLEServer *pKeyServer = NULL;
+static int connectedCount = 0;
+static const ble_hid_events_t *events = NULL;
+
+/* Reports are notified straight to the input report's handle, skipping
+ * the characteristic's std::string value and the attribute table update
+ * that setValue() and notify() do. esp_ble_gatts_send_indicate() still
+ * copies the value into the message it queues for the stack (an
+ * osi_malloc per send), so there's no buffer to hold on to, only a count
+ * of notifications the stack hasn't confirmed yet so a full link makes
+ * the sender wait. Connections are a bit per connection ID */
+static std::atomic<uint32_t> notifyInFlight(0);
+static uint16_t inputHandles[BLE_HID_MAX_INPUT_REPORTS];
+static std::atomic<uint32_t> connMask(0);
+static esp_gatt_if_t gattsIf = ESP_GATT_IF_NONE;
+static esp_ble_bond_dev_t bondList[BLE_MAX_BONDED_PEERS];
+static SemaphoreHandle_t bondListLock = NULL;
+
+/* From the stack's task as notifications are confirmed, or the sender's
+ * for one the stack refused */
+static void notifyDone() {
+  uint32_t n = notifyInFlight.load(std::memory_order_relaxed);
+  while (n && !notifyInFlight.compare_exchange_weak(n, n - 1, std::memory_order_release, std::memory_order_relaxed))
+    ;
+}
+
+static void toPeer(const esp_bd_addr_t addr, esp_ble_addr_type_t type, ble_peer_t *peer) {
+  memcpy(peer->val, addr, BLE_ADDR_LEN);
+  peer->type = type;
+}
+
+class MySecurity : public BLESecurityCallbacks {
+  bool onConfirmPIN(uint32_t pin){
+    return false;
+  }
+
+  uint32_t onPassKeyRequest(){
+    ESP_LOGI(LOG_TAG, "On PassKeyRequest");
+    return 123456;
+  }
+
+  void onPassKeyNotify(uint32_t pass_key){
+    ESP_LOGI(LOG_TAG, "On passkey Notify number:%d", pass_key);
+    if (events->onPassKeyNotify)
+      events->onPassKeyNotify(pass_key);
+  }
+
+  bool onSecurityRequest(){
+    ESP_LOGI(LOG_TAG, "On Security Request");
+    return true;
+  }
+
+  void onAuthenticationComplete(esp_ble_auth_cmpl_t cmpl){
+    ESP_LOGI(LOG_TAG, "Authentication complete, starting BLE work!");
+    if(cmpl.success){
+      uint16_t length;
+      esp_ble_gap_get_whitelist_size(&length);
+      ESP_LOGD(LOG_TAG, "Whitelist size now: %d", length);
+
+      ble_peer_t peer;
+      toPeer(cmpl.bd_addr, cmpl.addr_type, &peer);
+      if (events->onAuthenticated)
+        events->onAuthenticated(&peer);
+    }
+  }
+};
+
+class MyCallbacks : public BLEServerCallbacks {
+};
+
+/* The metrics value is only filled in when a host reads it */
+class MyMetricsCallbacks : public BLECharacteristicCallbacks {
+  void onRead(BLECharacteristic* me){
+    uint8_t value[BLE_METRICS_MAX_LEN];
+    size_t len = events->onReadMetrics(value, sizeof(value));
+    me->setValue(value, len);
+  }
+};
+
+static void handle_gatts_event(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
+  /* NOTE: This assumes that there is only one GATT server running in the ESP32, there is no
+   * way to get the gatts_if from the BLEServer class to check.
+   *
+   * We could also process ESP_GATTS_REG_EVT to get the interface, but this is overkill */
+
+  BLE2902* desc = NULL;
+  ble_peer_t peer;
+
+  profileBegin(SPAN_GATTS_EVENT);
+  switch (event) {
+    case ESP_GATTS_CONNECT_EVT:
+      gattsIf = gatts_if;
+      if (param->connect.conn_id < 32)
+        connMask.fetch_or(1UL << param->connect.conn_id, std::memory_order_release);
+      connectedCount++;
+      for (size_t i = 0; i < inputCount; i++) {
+        desc = (BLE2902*)inputs[i]->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
+        desc->setNotifications(true);
+      }
+
+      toPeer(param->connect.remote_bda, BLE_ADDR_TYPE_PUBLIC, &peer);
+      if (events->onConnect)
+        events->onConnect(param->connect.conn_id, &peer);
+      break;
+    case ESP_GATTS_DISCONNECT_EVT:
+      if (param->disconnect.conn_id < 32)
+        connMask.fetch_and(~(1UL << param->disconnect.conn_id), std::memory_order_release);
+      toPeer(param->disconnect.remote_bda, BLE_ADDR_TYPE_PUBLIC, &peer);
+      if (events->onDisconnect)
+        events->onDisconnect(param->disconnect.conn_id, &peer);
+
+      // BLEServer's own connected count is only updated after this
+      // handler runs so keep our own
+      connectedCount--;
+      if (connectedCount <= 0) {
+        // Notifications still queued for the link won't be confirmed
+        notifyInFlight.store(0, std::memory_order_release);
+        for (size_t i = 0; i < inputCount; i++) {
+          desc = (BLE2902*)inputs[i]->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
+          desc->setNotifications(false);
+        }
+      }
+      break;
+    case ESP_GATTS_WRITE_EVT:
+      /* The output report has the lock key LEDs, bit 0 NUM LOCK, bit 1
+       * CAPS LOCK and bit 2 SCROLL LOCK. It's taken from the event rather
+       * than the characteristic's callback, which doesn't say which
+       * connection wrote it */
+      if (output && param->write.handle == output->getHandle() && !param->write.is_prep &&
+          events->onOutputReport)
+        events->onOutputReport(param->write.conn_id, param->write.value, param->write.len);
+      break;
+    case ESP_GATTS_CONF_EVT:
+      // A notification has been sent
+      for (size_t i = 0; i < inputCount; i++) {
+        if (param->conf.handle == inputHandles[i]) {
+          notifyDone();
+          break;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+  profileEnd(SPAN_GATTS_EVENT);
+}
+
+/* Everything is statically allocated, only the BLE library
+ * itself allocates while the server is being set up */
+static MySecurity securityCallbacks;
+static MyCallbacks serverCallbacks;
+static MyMetricsCallbacks metricsCallbacks;
+static BLESecurity security;
+// BLEHIDDevice creates its services in the constructor so it can
+// only be constructed once the server exists
+alignas(BLEHIDDevice) static uint8_t hidStorage[sizeof(BLEHIDDevice)];
+
+class BleHidBluedroid : public BleHidBackend {
+  public:
+    void begin(const char *deviceName, const char *manufacturer, ble_hid_auth_t authMode,
+               const uint8_t *reportMap, size_t reportMapLen,
+               const uint8_t *inputReportIds, size_t inputReportCount,
+               const ble_hid_events_t *hidEvents) {
+      events = hidEvents;
+      bondListLock = xSemaphoreCreateMutex();
+
+      Serial.println("Init device");
+      BLEDevice::init(deviceName);
+      BLEDevice::setEncryptionLevel(ESP_BLE_SEC_ENCRYPT_MITM);
+      BLEDevice::setSecurityCallbacks(&securityCallbacks);
+
+      Serial.println("Create BLE server");
+      pKeyServer = BLEDevice::createServer();
+
+      // We need a callbacks object even if it's empty because
+      // otherwise we'll get a null pointer dereference for
+      // m_pServerCallbacks->onMtuChanged
+      pKeyServer->setCallbacks(&serverCallbacks);
+
+      // Unfortunately the GATTS handler in BLEServer doesn't
+      // give us the connection id on disconnect, so we register
+      // our own handler too
+      BLEDevice::setCustomGattsHandler(handle_gatts_event);
+
+      Serial.printf("Created BLE server at %p\n", (void *) pKeyServer);
+
+      hid = new (hidStorage) BLEHIDDevice(pKeyServer);
+      // A characteristic per input report ID in the report map
+      inputCount = inputReportCount < BLE_HID_MAX_INPUT_REPORTS ? inputReportCount : BLE_HID_MAX_INPUT_REPORTS;
+      for (size_t i = 0; i < inputCount; i++) {
+        inputIds[i] = inputReportIds[i];
+        inputs[i] = hid->inputReport(inputIds[i]);
+      }
+      // Writes to it are picked up in handle_gatts_event()
+      output = hid->outputReport(1); // <-- output REPORTID from report map
+
+      std::string name = manufacturer;
+      hid->manufacturer()->setValue(name);
+
+      // Plug and Play IDs, Vendor ID source (0x02 = USB Implementers forum),
+      // Vendor ID 0xe502 little endian = 0x2e5 = Unknown,
+      // Product ID 0xa111 little endian = 0x11a1,
+      // Product Version 0x0210 little endian = 0x1002
+      hid->pnp(0x02, 0xe502, 0xa111, 0x0210);
+
+      // Country = 0x00, Flags = 0x02
+      hid->hidInfo(0x00,0x02);
+
+      BLESecurity *pSecurity = &security;
+      // Require authentication, prevent MITM and bond the devices after pairing
+      // During negotiation set this device up to show the passcode
+      if (authMode == BLE_HID_AUTH_SC_MITM_BOND) {
+        pSecurity->setAuthenticationMode(ESP_LE_AUTH_REQ_SC_MITM_BOND);
+        pSecurity->setCapability(ESP_IO_CAP_OUT);
+      } else {
+        pSecurity->setAuthenticationMode(ESP_LE_AUTH_BOND);
+      }
+      pSecurity->setInitEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
+
+      hid->reportMap((uint8_t*)reportMap, reportMapLen);
+      hid->startServices();
+
+      for (size_t i = 0; i < inputCount; i++)
+        inputHandles[i] = inputs[i]->getHandle();
+
+      if (events->onReadMetrics) {
+        BLEService *service = pKeyServer->createService(BLEUUID(BLE_METRICS_SERVICE_UUID));
+        metrics = service->createCharacteristic(BLEUUID(BLE_METRICS_CHAR_UUID), BLECharacteristic::PROPERTY_READ);
+        // Only readable once paired, like the HID reports
+        metrics->setAccessPermissions(ESP_GATT_PERM_READ_ENCRYPTED);
+        metrics->setCallbacks(&metricsCallbacks);
+        service->start();
+      }
+
+      BLEAdvertising *pAdvertising = pKeyServer->getAdvertising();
+      pAdvertising->setAppearance(HID_KEYBOARD);
+      pAdvertising->addServiceUUID(hid->hidService()->getUUID());
+      pAdvertising->start();
+      hid->setBatteryLevel(7);
+    }
+
+    bool notifyInput(uint8_t reportId, const uint8_t *report, size_t len) {
+      size_t input;
+      for (input = 0; input < inputCount && inputIds[input] != reportId; input++)
+        ;
+
+      uint32_t conns = connMask.load(std::memory_order_acquire);
+      if (input == inputCount || !conns || gattsIf == ESP_GATT_IF_NONE)
+        return false;
+
+      // With BLE_HID_NOTIFY_IN_FLIGHT unconfirmed the link is full, wait
+      // for the stack to send some
+      uint32_t sends = __builtin_popcount(conns);
+      bool full = notifyInFlight.load(std::memory_order_acquire) + sends > BLE_HID_NOTIFY_IN_FLIGHT;
+      if (full)
+        metricInc(METRIC_CONGESTION);
+      for (int wait = 0; full && wait < BLE_HID_NOTIFY_WAIT_TICKS; wait++) {
+        vTaskDelay(1);
+        full = notifyInFlight.load(std::memory_order_acquire) + sends > BLE_HID_NOTIFY_IN_FLIGHT;
+      }
+      if (full)
+        return false;
+
+      bool sent = false;
+      while (conns) {
+        uint16_t connId = __builtin_ctz(conns);
+        conns &= conns - 1;
+        // Counted first, the confirm can arrive before this returns
+        notifyInFlight.fetch_add(1, std::memory_order_relaxed);
+        if (esp_ble_gatts_send_indicate(gattsIf, connId, inputHandles[input], len, (uint8_t *) report, false) == ESP_OK)
+          sent = true;
+        else
+          notifyDone();
+      }
+      return sent;
+    }
+
+    void getLocalAddress(uint8_t *addr) {
+      memcpy(addr, *BLEDevice::getAddress().getNative(), BLE_ADDR_LEN);
+    }
+
+    void disconnect(uint16_t connId) {
+      pKeyServer->disconnect(connId);
+    }
+
+    int getBondedPeers(ble_peer_t *out, int max) {
+      int count = esp_ble_get_bond_device_num();
+      if (count > max)
+        count = max;
+      if (count > BLE_MAX_BONDED_PEERS)
+        count = BLE_MAX_BONDED_PEERS;
+      if (count <= 0)
+        return 0;
+
+      // Runs on the BLE task for connects, so nothing is allocated. The
+      // list is too big for a task's stack and the console reads it too
+      xSemaphoreTake(bondListLock, portMAX_DELAY);
+      if (esp_ble_get_bond_device_list(&count, bondList) != ESP_OK) {
+        xSemaphoreGive(bondListLock);
+        return 0;
+      }
+
+      for (int i = 0; i < count; i++) {
+        // Direct at the identity address if the host gave us one
+        toPeer(bondList[i].bd_addr,
+               (bondList[i].bond_key.key_mask & ESP_LE_KEY_PID) ?
+                 bondList[i].bond_key.pid_key.addr_type : BLE_ADDR_TYPE_PUBLIC,
+               &out[i]);
+      }
+      xSemaphoreGive(bondListLock);
+      return count;
+    }
+
+    bool startAdvertising(uint16_t intervalMin, uint16_t intervalMax, const ble_peer_t *directedPeer) {
+      esp_ble_adv_params_t params;
+
+      memset(&params, 0, sizeof(params));
+      params.own_addr_type     = BLE_ADDR_TYPE_PUBLIC;
+      params.channel_map       = ADV_CHNL_ALL;
+      params.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY;
+      params.adv_int_min       = intervalMin;
+      params.adv_int_max       = intervalMax;
+
+      if (directedPeer) {
+        // The advertising interval is ignored for high duty directed advertising
+        params.adv_type       = ADV_TYPE_DIRECT_IND_HIGH;
+        memcpy(params.peer_addr, directedPeer->val, BLE_ADDR_LEN);
+        params.peer_addr_type = (esp_ble_addr_type_t) directedPeer->type;
+      } else {
+        params.adv_type       = ADV_TYPE_IND;
+      }
+
+      // Advertising data was configured by BLEAdvertising when the server
+      // started and stays with the controller, only the parameters change.
+      return esp_ble_gap_start_advertising(&params) == ESP_OK;
+    }
+
+    void stopAdvertising() {
+      esp_ble_gap_stop_advertising();
+    }
+};
+
+BleHidBackend *bleHidBackend() {
+  static BleHidBluedroid backend;
+  return &backend;
+}
+
+#endif
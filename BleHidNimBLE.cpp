@@ -0,0 +1,297 @@
+/* NimBLE implementation of the BLE HID server, using NimBLE-Arduino
+ *
+ * NimBLE needs considerably less RAM and flash than Bluedroid and
+ * initializes faster, the HID behaviour is the same */
+
+#include "BleHidBackend.h"
+
+#ifdef BLE_HID_BACKEND_NIMBLE
+
+#include <Arduino.h>
+#include <new>
+#include <atomic>
+#include <NimBLEDevice.h>
+#include <NimBLEHIDDevice.h>
+#include "Metrics.h"
+
+static const char *LOG_TAG = "blenimble";
+
+static NimBLEHIDDevice* hid;
+static NimBLECharacteristic* inputs[BLE_HID_MAX_INPUT_REPORTS];
+static uint8_t inputIds[BLE_HID_MAX_INPUT_REPORTS];
+static size_t inputCount = 0;
+static NimBLECharacteristic* output;
+static NimBLECharacteristic* metrics = NULL;
+static NimBLEServer *pKeyServer = NULL;
+
+/* Reports are notified straight to the input report's handle in an mbuf
+ * from NimBLE's preallocated msys pool, which the stack frees once it's
+ * sent. This skips the characteristic's std::string value and attribute
+ * update that setValue() and notify() do */
+static uint16_t inputHandles[BLE_HID_MAX_INPUT_REPORTS];
+static uint16_t connHandles[BLE_HID_MAX_CONNECTIONS];
+static std::atomic<int> connCount(0);
+static const ble_hid_events_t *events = NULL;
+
+/* NimBLE keeps addresses least significant byte first */
+static void toPeer(const ble_addr_t &addr, ble_peer_t *peer) {
+  for (int i = 0; i < BLE_ADDR_LEN; i++)
+    peer->val[i] = addr.val[BLE_ADDR_LEN - 1 - i];
+  peer->type = addr.type;
+}
+
+static void fromPeer(const ble_peer_t *peer, ble_addr_t *addr) {
+  for (int i = 0; i < BLE_ADDR_LEN; i++)
+    addr->val[i] = peer->val[BLE_ADDR_LEN - 1 - i];
+  addr->type = peer->type;
+}
+
+class MyServerCallbacks : public NimBLEServerCallbacks {
+  void onConnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+    ble_peer_t peer;
+    toPeer(desc->peer_id_addr, &peer);
+
+    int count = connCount.load(std::memory_order_relaxed);
+    if (count < BLE_HID_MAX_CONNECTIONS) {
+      connHandles[count] = desc->conn_handle;
+      connCount.store(count + 1, std::memory_order_release);
+    }
+
+    if (events->onConnect)
+      events->onConnect(desc->conn_handle, &peer);
+  }
+
+  void onDisconnect(NimBLEServer* pServer, ble_gap_conn_desc* desc) {
+    ble_peer_t peer;
+    toPeer(desc->peer_id_addr, &peer);
+
+    int count = connCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < count; i++) {
+      if (connHandles[i] == desc->conn_handle) {
+        // Move the last handle down before the count drops, a reader
+        // never sees the gone handle inside the count
+        connHandles[i] = connHandles[count - 1];
+        connCount.store(count - 1, std::memory_order_release);
+        break;
+      }
+    }
+
+    if (events->onDisconnect)
+      events->onDisconnect(desc->conn_handle, &peer);
+  }
+
+  uint32_t onPassKeyRequest() {
+    ESP_LOGI(LOG_TAG, "On PassKeyRequest");
+    return 123456;
+  }
+
+  bool onConfirmPIN(uint32_t pin) {
+    return false;
+  }
+
+  void onAuthenticationComplete(ble_gap_conn_desc* desc) {
+    ESP_LOGI(LOG_TAG, "Authentication complete, encrypted %d bonded %d",
+             desc->sec_state.encrypted, desc->sec_state.bonded);
+    if (!desc->sec_state.encrypted)
+      return;
+
+    ble_peer_t peer;
+    toPeer(desc->peer_id_addr, &peer);
+    if (events->onAuthenticated)
+      events->onAuthenticated(&peer);
+  }
+};
+
+/* NimBLE reports the passkey to display through the GAP event rather than a callback */
+static int onGapEvent(ble_gap_event *event, void *arg) {
+  if (event->type == BLE_GAP_EVENT_PASSKEY_ACTION &&
+      event->passkey.params.action == BLE_SM_IOACT_DISP) {
+    ESP_LOGI(LOG_TAG, "On passkey Notify number:%d", NimBLEDevice::getSecurityPasskey());
+    if (events->onPassKeyNotify)
+      events->onPassKeyNotify(NimBLEDevice::getSecurityPasskey());
+  }
+  return 0;
+}
+
+/*
+ * Output report from the host with the lock key LEDs
+ * bit 0 - NUM LOCK
+ * bit 1 - CAPS LOCK
+ * bit 2 - SCROLL LOCK
+ */
+class MyOutputCallbacks : public NimBLECharacteristicCallbacks {
+  // The overload with the connection, so the LEDs are per host
+  void onWrite(NimBLECharacteristic* me, ble_gap_conn_desc* desc) {
+    std::string value = me->getValue();
+    if (events->onOutputReport)
+      events->onOutputReport(desc->conn_handle, (const uint8_t *) value.data(), value.length());
+  }
+};
+
+/* The metrics value is only filled in when a host reads it */
+class MyMetricsCallbacks : public NimBLECharacteristicCallbacks {
+  void onRead(NimBLECharacteristic* me) {
+    uint8_t value[BLE_METRICS_MAX_LEN];
+    size_t len = events->onReadMetrics(value, sizeof(value));
+    me->setValue(value, len);
+  }
+};
+
+static MyServerCallbacks serverCallbacks;
+static MyOutputCallbacks outputCallbacks;
+static MyMetricsCallbacks metricsCallbacks;
+// NimBLEHIDDevice creates its services in the constructor so it can
+// only be constructed once the server exists
+alignas(NimBLEHIDDevice) static uint8_t hidStorage[sizeof(NimBLEHIDDevice)];
+
+class BleHidNimBLE : public BleHidBackend {
+  public:
+    void begin(const char *deviceName, const char *manufacturer, ble_hid_auth_t authMode,
+               const uint8_t *reportMap, size_t reportMapLen,
+               const uint8_t *inputReportIds, size_t inputReportCount,
+               const ble_hid_events_t *hidEvents) {
+      events = hidEvents;
+
+      Serial.println("Init device");
+      NimBLEDevice::init(deviceName);
+      NimBLEDevice::setCustomGapHandler(onGapEvent);
+
+      if (authMode == BLE_HID_AUTH_SC_MITM_BOND) {
+        // Bond, MITM protection, secure connections and show the passkey
+        NimBLEDevice::setSecurityAuth(true, true, true);
+        NimBLEDevice::setSecurityIOCap(BLE_HS_IO_DISPLAY_ONLY);
+      } else {
+        NimBLEDevice::setSecurityAuth(true, false, false);
+        NimBLEDevice::setSecurityIOCap(BLE_HS_IO_NO_INPUT_OUTPUT);
+      }
+      NimBLEDevice::setSecurityInitKey(BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID);
+
+      Serial.println("Create BLE server");
+      pKeyServer = NimBLEDevice::createServer();
+      pKeyServer->setCallbacks(&serverCallbacks, false);
+      // The reconnect policy decides how to advertise after a disconnect
+      pKeyServer->advertiseOnDisconnect(false);
+
+      hid = new (hidStorage) NimBLEHIDDevice(pKeyServer);
+      // A characteristic per input report ID in the report map
+      inputCount = inputReportCount < BLE_HID_MAX_INPUT_REPORTS ? inputReportCount : BLE_HID_MAX_INPUT_REPORTS;
+      for (size_t i = 0; i < inputCount; i++) {
+        inputIds[i] = inputReportIds[i];
+        inputs[i] = hid->inputReport(inputIds[i]);
+      }
+      output = hid->outputReport(1); // <-- output REPORTID from report map
+
+      output->setCallbacks(&outputCallbacks);
+
+      hid->manufacturer()->setValue(std::string(manufacturer));
+
+      // Same Plug and Play IDs and HID info as the Bluedroid backend
+      hid->pnp(0x02, 0xe502, 0xa111, 0x0210);
+      hid->hidInfo(0x00, 0x02);
+
+      hid->reportMap((uint8_t*)reportMap, reportMapLen);
+      hid->startServices();
+
+      for (size_t i = 0; i < inputCount; i++)
+        inputHandles[i] = inputs[i]->getHandle();
+
+      if (events->onReadMetrics) {
+        NimBLEService *service = pKeyServer->createService(BLE_METRICS_SERVICE_UUID);
+        // Only readable once paired, like the HID reports
+        metrics = service->createCharacteristic(BLE_METRICS_CHAR_UUID, NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::READ_ENC);
+        metrics->setCallbacks(&metricsCallbacks);
+        service->start();
+      }
+
+      NimBLEAdvertising *pAdvertising = pKeyServer->getAdvertising();
+      pAdvertising->setAppearance(HID_KEYBOARD);
+      pAdvertising->addServiceUUID(hid->hidService()->getUUID());
+      pAdvertising->start();
+      hid->setBatteryLevel(7);
+    }
+
+    bool notifyInput(uint8_t reportId, const uint8_t *report, size_t len) {
+      size_t input;
+      for (input = 0; input < inputCount && inputIds[input] != reportId; input++)
+        ;
+      if (input == inputCount)
+        return false;
+
+      bool sent = false;
+      int count = connCount.load(std::memory_order_acquire);
+      for (int i = 0; i < count; i++) {
+        // With the msys pool empty the link is full, wait for a send to complete
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(report, len);
+        if (!om)
+          metricInc(METRIC_CONGESTION);
+        for (int wait = 0; !om && wait < BLE_HID_NOTIFY_WAIT_TICKS; wait++) {
+          vTaskDelay(1);
+          om = ble_hs_mbuf_from_flat(report, len);
+        }
+        // The stack takes the mbuf whether or not the notify succeeds
+        if (om && ble_gattc_notify_custom(connHandles[i], inputHandles[input], om) == 0)
+          sent = true;
+      }
+      return sent;
+    }
+
+    void getLocalAddress(uint8_t *addr) {
+      ble_peer_t local;
+      ble_addr_t native;
+      NimBLEAddress address = NimBLEDevice::getAddress();
+      memcpy(native.val, address.getNative(), BLE_ADDR_LEN);
+      native.type = address.getType();
+      toPeer(native, &local);
+      memcpy(addr, local.val, BLE_ADDR_LEN);
+    }
+
+    void disconnect(uint16_t connId) {
+      // Our connection IDs are NimBLE's connection handles
+      pKeyServer->disconnect(connId);
+    }
+
+    int getBondedPeers(ble_peer_t *out, int max) {
+      int count = NimBLEDevice::getNumBonds();
+      if (count > max)
+        count = max;
+      for (int i = 0; i < count; i++) {
+        NimBLEAddress address = NimBLEDevice::getBondedAddress(i);
+        ble_addr_t native;
+        memcpy(native.val, address.getNative(), BLE_ADDR_LEN);
+        native.type = address.getType();
+        toPeer(native, &out[i]);
+      }
+      return count;
+    }
+
+    bool startAdvertising(uint16_t intervalMin, uint16_t intervalMax, const ble_peer_t *directedPeer) {
+      NimBLEAdvertising *pAdvertising = pKeyServer->getAdvertising();
+
+      if (directedPeer) {
+        ble_addr_t native;
+        fromPeer(directedPeer, &native);
+        NimBLEAddress address(native);
+        // NimBLEAdvertising leaves high_duty_cycle at 0 and doesn't expose
+        // it, so this is low duty cycle directed advertising. It doesn't
+        // stop by itself, the reconnect phase timer moves on from it
+        pAdvertising->setAdvertisementType(BLE_GAP_CONN_MODE_DIR);
+        return pAdvertising->start(0, nullptr, &address);
+      }
+
+      pAdvertising->setAdvertisementType(BLE_GAP_CONN_MODE_UND);
+      pAdvertising->setMinInterval(intervalMin);
+      pAdvertising->setMaxInterval(intervalMax);
+      return pAdvertising->start();
+    }
+
+    void stopAdvertising() {
+      pKeyServer->getAdvertising()->stop();
+    }
+};
+
+BleHidBackend *bleHidBackend() {
+  static BleHidNimBLE backend;
+  return &backend;
+}
+
+#endif
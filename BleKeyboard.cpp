@@ -19,248 +19,219 @@
 */
 
 #include <Arduino.h>
-#include <BLEDevice.h>
-#include <BLEUtils.h>
-#include <BLEServer.h>
-#include "BLE2902.h"
-#include "BLEHIDDevice.h"
-#include "HIDTypes.h"
-#include "HIDKeyboardTypes.h"
+#include "HidReports.h"
+#include "KeyboardLayout.h"
 #include "BleKeyboard.h"
-
-const char *deviceName = DEFAULT_KEYBOARD_NAME;
+#include "BleReconnect.h"
+#include "SeqLock.h"
+#include "Metrics.h"
+#include "StallDetector.h"
+#include "Profiler.h"
+#include "TypingRate.h"
+
+static char deviceName[BLE_KEYBOARD_MAX_NAME] = DEFAULT_KEYBOARD_NAME;
 const char *manufacturerName = KEYBOARD_MANUFACTURER;
-esp_ble_auth_req_t mainKeyboardAuthMode = ESP_LE_AUTH_REQ_SC_MITM_BOND;
-
-static BLEHIDDevice* hid;
-static BLECharacteristic* input;
-static BLECharacteristic* output;
+ble_hid_auth_t mainKeyboardAuthMode = BLE_HID_AUTH_SC_MITM_BOND;
 
-static BLEServer *pKeyServer = NULL;
-static int connectedCount = 0;
+static std::atomic<BleHidBackend *> backend(NULL);
 static void (*mainOnInitialized)() = NULL;
 static void (*mainOnConnect)() = NULL;
 static void (*mainOnDisconnect)() = NULL;
 static void (*mainOnPassKeyNotify)(uint32_t pass_key) = NULL;
 static bool mainAllowMultiConnect = false;
-static BLEAddress peerAddress("00:00:00:00:00:00");
-static std::map<uint16_t, conn_info_t> connectedClientsMap;
+
+/* Connection state is only changed by the BLE stack's task and read from
+ * loop() and any other task. The count is an atomic so the send path can 
+ * check it without locking, the peer and connection table are published
+ * through a sequence lock so readers always see a consistent copy */
+typedef struct {
+  ble_peer_t peerAddress;
+  int count;
+  // Flat table of the current connections, the first count entries are in use
+  conn_info_t connections[BLE_KEYBOARD_MAX_CONNECTIONS];
+} conn_state_t;
+
+static std::atomic<int> connectedCount(0);
+static SeqLock<conn_state_t> connState;
+// The BLE task's working copy, only touched by the BLE task
+static conn_state_t bleTaskConnState;
+static unsigned long advertisingStartedMillis = 0;
+// Macs put Command where PCs have Control, swapped for the host's profile
+static std::atomic<bool> swapCtrlGui(false);
+// Also for the host's profile, on a Mac Caps Lock types capitals even with Shift
+static std::atomic<bool> shiftUndoesCaps(true);
+// Between key reports, calibrated per host (TypingRate.h)
+static std::atomic<uint8_t> reportGapMs(TYPING_GAP_DEFAULT_MS);
+
+// Mouse motion waiting for the next report
+static std::atomic<int32_t> mousePendingX(0);
+static std::atomic<int32_t> mousePendingY(0);
+static std::atomic<int32_t> mousePendingWheel(0);
+static uint8_t mouseButtons = 0;
+static unsigned long mouseLastMillis = 0;
 const char *LOG_TAG = "blekeyboard"; 
 
 BleKeyboardHandler BleKeyboard;
 
-class MySecurity : public BLESecurityCallbacks {
-  bool onConfirmPIN(uint32_t pin){
-    return false;
-  }
-  
-  uint32_t onPassKeyRequest(){
-    ESP_LOGI(LOG_TAG, "On PassKeyRequest");
-    return 123456;
-  }
-
-  void onPassKeyNotify(uint32_t pass_key){
-    ESP_LOGI(LOG_TAG, "On passkey Notify number:%d", pass_key);
-    if (mainOnPassKeyNotify)
-      mainOnPassKeyNotify(pass_key);
-  }
-
-  bool onSecurityRequest(){
-    ESP_LOGI(LOG_TAG, "On Security Request");
-    return true;
-  }
-
-  void onAuthenticationComplete(esp_ble_auth_cmpl_t cmpl){
-    ESP_LOGI(LOG_TAG, "Authentication complete, starting BLE work!");
-    if(cmpl.success){
-      uint16_t length;
-      esp_ble_gap_get_whitelist_size(&length);
-      ESP_LOGD(LOG_TAG, "Whitelist size now: %d", length);
-    }
-  }
+// Built from the report lists in HidReports.h, constexpr so it stays in flash
+static constexpr uint8_t report[] = {
+  USAGE_PAGE(1),      HID_PAGE_GENERIC_DESKTOP,
+  USAGE(1),           0x06,       // Keyboard
+  COLLECTION(1),      0x01,       // Application
+  REPORT_ID(1),       KEYBOARD_REPORT_ID,
+  KEYBOARD_INPUT_REPORT(HID_INPUT_FIELD, HID_INPUT_FLAGS, HID_INPUT_PAD)
+  KEYBOARD_OUTPUT_REPORT(HID_OUTPUT_FIELD, HID_OUTPUT_FLAGS, HID_OUTPUT_PAD)
+  END_COLLECTION(0),
+
+  USAGE_PAGE(1),      HID_PAGE_CONSUMER,
+  USAGE(1),           0x01,       // Consumer control
+  COLLECTION(1),      0x01,       // Application
+  REPORT_ID(1),       CONSUMER_REPORT_ID,
+  CONSUMER_INPUT_REPORT(HID_INPUT_FIELD, HID_INPUT_FLAGS, HID_INPUT_PAD)
+  END_COLLECTION(0),
+
+  USAGE_PAGE(1),      HID_PAGE_GENERIC_DESKTOP,
+  USAGE(1),           0x02,       // Mouse
+  COLLECTION(1),      0x01,       // Application
+  USAGE(1),           0x01,       //   Pointer
+  COLLECTION(1),      0x00,       //   Physical
+  REPORT_ID(1),       MOUSE_REPORT_ID,
+  MOUSE_INPUT_REPORT(HID_INPUT_FIELD, HID_INPUT_FLAGS, HID_INPUT_PAD)
+  END_COLLECTION(0),
+  END_COLLECTION(0)
 };
 
-class MyCallbacks : public BLEServerCallbacks {
-};
-
-/*
- * This callback is connect with output report. In keyboard output report report special keys changes, like CAPSLOCK, NUMLOCK
- * We can add digital pins with LED to show status
- * bit 0 - NUM LOCK
- * bit 1 - CAPS LOCK
- * bit 2 - SCROLL LOCK
- */
-class MyOutputCallbacks : public BLECharacteristicCallbacks {
-  void onWrite(BLECharacteristic* me){
-    uint8_t* value = (uint8_t*)(me->getValue().c_str());
-    ESP_LOGI(LOG_TAG, "Special keys in output report: %d", *value);
+static const uint8_t inputReportIds[] = { KEYBOARD_REPORT_ID, CONSUMER_REPORT_ID, MOUSE_REPORT_ID };
+
+static_assert(hidReportBits(report, sizeof(report), HID_MAIN_INPUT, KEYBOARD_REPORT_ID) == sizeof(keyboard_input_report_t) * 8,
+              "Keyboard input report doesn't match its descriptor");
+static_assert(hidReportBits(report, sizeof(report), HID_MAIN_OUTPUT, KEYBOARD_REPORT_ID) == sizeof(keyboard_output_report_t) * 8,
+              "Keyboard output report doesn't match its descriptor");
+static_assert(hidReportBits(report, sizeof(report), HID_MAIN_INPUT, CONSUMER_REPORT_ID) == sizeof(consumer_input_report_t) * 8,
+              "Consumer input report doesn't match its descriptor");
+static_assert(hidReportBits(report, sizeof(report), HID_MAIN_INPUT, MOUSE_REPORT_ID) == sizeof(mouse_input_report_t) * 8,
+              "Mouse input report doesn't match its descriptor");
+static_assert(sizeof(keyboard_input_report_t) == 8, "Keyboard input report should be the boot protocol's 8 bytes");
+
+static void onBleConnect(uint16_t connId, const ble_peer_t *peer) {
+  uint32_t stall = stallEnter(STALL_TASK_BLE, STAGE_BLE_EVENT);
+  conn_state_t *state = &bleTaskConnState;
+
+  if (state->count < BLE_KEYBOARD_MAX_CONNECTIONS) {
+    state->connections[state->count].connId = connId;
+    state->connections[state->count].peer = *peer;
+    state->connections[state->count].leds = 0;
+    state->count++;
   }
-};
-
-static void handle_gatts_event(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param) {
-  /* NOTE: This assumes that there is only one GATT server running in the ESP32, there is no 
-   * way to get the gatts_if from the BLEServer class to check. 
-   * 
-   * We could also process ESP_GATTS_REG_EVT to get the interface, but this is overkill */
-
-  BLE2902* desc = NULL;
-
-  Serial.printf("BLE event %d\n", event);
-
-  switch (event) {
-    case ESP_GATTS_CONNECT_EVT:
-      connectedCount++;
-      
-      conn_info_t conn_info;
-      memcpy(conn_info.peer, param->connect.remote_bda, sizeof(conn_info.peer));
-      connectedClientsMap.insert(std::pair<uint16_t, conn_info_t>(param->connect.conn_id, conn_info));
+  state->peerAddress = *peer;
+  connState.write(*state);
+  connectedCount.store(state->count, std::memory_order_release);
+
+  // Keep log lines short enough that printf doesn't need to allocate
+  Serial.printf("Connect %02x:%02x:%02x:%02x:%02x:%02x id %d count %d\n",
+               peer->val[0], peer->val[1], peer->val[2],
+               peer->val[3], peer->val[4], peer->val[5],
+               connId, state->count);
+
+  bleReconnectOnConnect(peer);
+
+  if (mainOnConnect)
+    mainOnConnect();    
+
+  // Other hosts can't use directed advertising at the host 
+  // we're already connected to
+  if (mainAllowMultiConnect)
+    bleReconnectStart(false);
+  stallLeave(STALL_TASK_BLE, stall);
+}
 
-      Serial.printf("BLE keyboard connected, connection id %d\n", param->connect.conn_id);
+static void onBleDisconnect(uint16_t connId, const ble_peer_t *peer) {
+  uint32_t stall = stallEnter(STALL_TASK_BLE, STAGE_BLE_EVENT);
+  if (mainOnDisconnect)
+    mainOnDisconnect();    
 
-      // Connected count is incremented AFTER this callback is invoked
-      Serial.printf("BLE keyboard connected\n");
+  conn_state_t *state = &bleTaskConnState;
 
-      desc = (BLE2902*)input->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
-      desc->setNotifications(true);
-      
-      Serial.printf("Connection from %02x:%02x:%02x:%02x:%02x:%02x with connection id %d, count now %d\n",
-                   param->connect.remote_bda[0], param->connect.remote_bda[1], param->connect.remote_bda[2],
-                   param->connect.remote_bda[3], param->connect.remote_bda[4], param->connect.remote_bda[5],
-                   param->connect.conn_id,
-                   pKeyServer->getConnectedCount());
+  for (int i = 0; i < state->count; i++) {
+    if (state->connections[i].connId == connId) {
+      state->connections[i] = state->connections[state->count - 1];
+      state->count--;
+      break;
+    }
+  }
+  // Text follows the lock LEDs of a host that's still connected
+  if (state->count > 0 && !memcmp(state->peerAddress.val, peer->val, BLE_ADDR_LEN))
+    state->peerAddress = state->connections[state->count - 1].peer;
+  // Stop senders first, then publish the table
+  connectedCount.store(state->count, std::memory_order_release);
+  connState.write(*state);
+
+  Serial.printf("Disconnect %02x:%02x:%02x:%02x:%02x:%02x id %d count %d\n",
+               peer->val[0], peer->val[1], peer->val[2],
+               peer->val[3], peer->val[4], peer->val[5],
+               connId, state->count);
+
+  if (state->count <= 0)
+    bleReconnectStart(true);
+  stallLeave(STALL_TASK_BLE, stall);
+}
 
-      peerAddress = BLEAddress(param->connect.remote_bda);
-      
-      if (mainOnConnect)
-        mainOnConnect();    
+static void onBleAuthenticated(const ble_peer_t *peer) {
+  uint32_t stall = stallEnter(STALL_TASK_BLE, STAGE_BLE_EVENT);
+  // A new bond may have been created, and the authenticated 
+  // address is the one to direct advertising at on reconnect.
+  // Advertising for other hosts carries on
+  bleReconnectRefreshBonds();
+  bleReconnectSetTarget(peer);
+  stallLeave(STALL_TASK_BLE, stall);
+}
 
-      if (mainAllowMultiConnect)
-        BLEDevice::startAdvertising();      
+static void onBlePassKeyNotify(uint32_t passKey) {
+  if (mainOnPassKeyNotify)
+    mainOnPassKeyNotify(passKey);
+}
 
+/* The output report has the lock key LEDs (LED_ bits), kept per
+ * connection since each host has its own Caps Lock */
+static void onBleOutputReport(uint16_t connId, const uint8_t *data, size_t len) {
+  if (!len)
+    return;
+
+  conn_state_t *state = &bleTaskConnState;
+  for (int i = 0; i < state->count; i++) {
+    if (state->connections[i].connId == connId) {
+      state->connections[i].leds = data[0];
+      connState.write(*state);
       break;
-    case ESP_GATTS_DISCONNECT_EVT:
-      if (mainOnDisconnect)
-        mainOnDisconnect();    
-
-      Serial.printf("Disconnect from %02x:%02x:%02x:%02x:%02x:%02x with connection id %d, count now %d\n",
-                   param->disconnect.remote_bda[0], param->disconnect.remote_bda[1], param->disconnect.remote_bda[2],
-                   param->disconnect.remote_bda[3], param->disconnect.remote_bda[4], param->disconnect.remote_bda[5],
-                   param->disconnect.conn_id,
-                   pKeyServer->getConnectedCount());
-      
-      connectedClientsMap.erase(param->disconnect.conn_id);
-      connectedCount--;
-      if (connectedCount <= 0) {
-        desc = (BLE2902*)input->getDescriptorByUUID(BLEUUID((uint16_t)0x2902));
-        desc->setNotifications(false);
-
-        BLEDevice::startAdvertising();      
-      }
-      
-      
-      break;
-    default:
-      break;
+    }
   }
+  ESP_LOGI(LOG_TAG, "Lock LEDs %d for id %d", data[0], connId);
 }
 
+static const ble_hid_events_t hidEvents = {
+  onBleConnect,
+  onBleDisconnect,
+  onBleAuthenticated,
+  onBlePassKeyNotify,
+  onBleOutputReport,
+  metricsRead
+};
+
 void taskServer(void*){
-  Serial.println("Initialize BLE");
-
-  Serial.println("Init device");
-  BLEDevice::init(deviceName);
-  BLEDevice::setEncryptionLevel(ESP_BLE_SEC_ENCRYPT_MITM);
-  BLEDevice::setSecurityCallbacks(new MySecurity());
-
-  Serial.println("Create BLE server");
-  pKeyServer = BLEDevice::createServer();
-
-  // We need a callbacks object even if it's empty because
-  // otherwise we'll get a null pointer dereference for 
-  // m_pServerCallbacks->onMtuChanged
-  pKeyServer->setCallbacks(new MyCallbacks());
-
-  // Unfortunately the GATTS handler in BLEServer doesn't
-  // give us the connection id on disconnect, so we register
-  // our own handler too 
-  BLEDevice::setCustomGattsHandler(handle_gatts_event);
-
-  Serial.printf("Created BLE server at %p\n", (void *) pKeyServer);
-
-  hid = new BLEHIDDevice(pKeyServer);
-  input = hid->inputReport(1); // <-- input REPORTID from report map
-  output = hid->outputReport(1); // <-- output REPORTID from report map
-
-  output->setCallbacks(new MyOutputCallbacks());
-
-  std::string name = manufacturerName;
-  hid->manufacturer()->setValue(name);
-
-  // Plug and Play IDs, Vendor ID source (0x02 = USB Implementers forum), 
-  // Vendor ID 0xe502 little endian = 0x2e5 = Unknown, 
-  // Product ID 0xa111 little endian = 0x11a1, 
-  // Product Version 0x0210 little endian = 0x1002
-  hid->pnp(0x02, 0xe502, 0xa111, 0x0210);
-
-  // Country = 0x00, Flags = 0x02
-  hid->hidInfo(0x00,0x02);
-
-  BLESecurity *pSecurity = new BLESecurity();
-  // pSecurity->setKeySize();
-  // pSecurity->setAuthenticationMode(ESP_LE_AUTH_BOND);
-  // pSecurity->setAuthenticationMode(ESP_LE_AUTH_REQ_SC_ONLY);
-  // Require authentication, prevent MITM and bond the devices after pairing 
-  // pSecurity->setAuthenticationMode(ESP_LE_AUTH_REQ_SC_MITM_BOND); 
-  // During negotiation set this device up to show the passcode 
-  pSecurity->setAuthenticationMode(mainKeyboardAuthMode); 
-  if (mainKeyboardAuthMode == ESP_LE_AUTH_REQ_SC_MITM_BOND || 
-      mainKeyboardAuthMode == ESP_LE_AUTH_REQ_SC_ONLY) 
-    pSecurity->setCapability(ESP_IO_CAP_OUT);
-  pSecurity->setInitEncryptionKey(ESP_BLE_ENC_KEY_MASK | ESP_BLE_ID_KEY_MASK);
-
-  const uint8_t report[] = {
-    USAGE_PAGE(1),      0x01,       // Generic Desktop Ctrls
-    USAGE(1),           0x06,       // Keyboard
-    COLLECTION(1),      0x01,       // Application
-    REPORT_ID(1),       0x01,        //   Report ID (1)
-    USAGE_PAGE(1),      0x07,       //   Kbrd/Keypad
-    USAGE_MINIMUM(1),   0xE0,
-    USAGE_MAXIMUM(1),   0xE7,
-    LOGICAL_MINIMUM(1), 0x00,
-    LOGICAL_MAXIMUM(1), 0x01,
-    REPORT_SIZE(1),     0x01,       //   1 byte (Modifier)
-    REPORT_COUNT(1),    0x08,
-    HIDINPUT(1),           0x02,       //   Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position
-    REPORT_COUNT(1),    0x01,       //   1 byte (Reserved)
-    REPORT_SIZE(1),     0x08,
-    HIDINPUT(1),           0x01,       //   Const,Array,Abs,No Wrap,Linear,Preferred State,No Null Position
-    REPORT_COUNT(1),    0x06,       //   6 bytes (Keys)
-    REPORT_SIZE(1),     0x08,
-    LOGICAL_MINIMUM(1), 0x00,
-    LOGICAL_MAXIMUM(1), 0x65,       //   101 keys
-    USAGE_MINIMUM(1),   0x00,
-    USAGE_MAXIMUM(1),   0x65,
-    HIDINPUT(1),           0x00,       //   Data,Array,Abs,No Wrap,Linear,Preferred State,No Null Position
-    REPORT_COUNT(1),    0x05,       //   5 bits (Num lock, Caps lock, Scroll lock, Compose, Kana)
-    REPORT_SIZE(1),     0x01,
-    USAGE_PAGE(1),      0x08,       //   LEDs
-    USAGE_MINIMUM(1),   0x01,       //   Num Lock
-    USAGE_MAXIMUM(1),   0x05,       //   Kana
-    HIDOUTPUT(1),          0x02,       //   Data,Var,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile
-    REPORT_COUNT(1),    0x01,       //   3 bits (Padding)
-    REPORT_SIZE(1),     0x03,
-    HIDOUTPUT(1),          0x01,       //   Const,Array,Abs,No Wrap,Linear,Preferred State,No Null Position,Non-volatile
-    END_COLLECTION(0)
-  };
+  Serial.printf("Initialize BLE (%s)\n", BLE_HID_BACKEND_NAME);
 
-  hid->reportMap((uint8_t*)report, sizeof(report));
-  hid->startServices();
+  stallStage(STALL_TASK_BLE, STAGE_BLE_BEGIN);
+  bleHidBackend()->begin(deviceName, manufacturerName, mainKeyboardAuthMode, 
+                         report, sizeof(report), inputReportIds, sizeof(inputReportIds), &hidEvents);
+  stallStage(STALL_TASK_BLE, STAGE_IDLE);
+  // Only publish the backend once the stack is up
+  backend.store(bleHidBackend(), std::memory_order_release);
 
-  BLEAdvertising *pAdvertising = pKeyServer->getAdvertising();
-  pAdvertising->setAppearance(HID_KEYBOARD);
-  pAdvertising->addServiceUUID(hid->hidService()->getUUID());
-  pAdvertising->start();
-  hid->setBatteryLevel(7);
+  // The advertising data is now configured, switch to the reconnect
+  // policy's fast then slow advertising
+  bleReconnectInit();
+  bleReconnectStart(true);
+  advertisingStartedMillis = millis();
 
   ESP_LOGD(LOG_TAG, "Advertising started!");
   
@@ -272,15 +243,47 @@ void taskServer(void*){
 }
 
 BleKeyboardHandler::BleKeyboardHandler() {
-  connectedCount = 0;
 }
 
-BLEAddress BleKeyboardHandler::getPeerAddress() {
-  return peerAddress;
+ble_peer_t BleKeyboardHandler::getPeerAddress() {
+  return connState.read().peerAddress;
+}
+
+/* The lock LEDs of the host that connected last, the one getPeerAddress()
+ * returns. Reports go to every host, so with more than one connected
+ * text can only be typed to suit one of them */
+static uint8_t lockLeds() {
+  conn_state_t state = connState.read();
+  for (int i = 0; i < state.count; i++) {
+    if (!memcmp(state.connections[i].peer.val, state.peerAddress.val, BLE_ADDR_LEN))
+      return state.connections[i].leds;
+  }
+  return 0;
+}
+
+uint8_t BleKeyboardHandler::getLockLeds() {
+  return lockLeds();
+}
+
+void BleKeyboardHandler::getLocalAddress(uint8_t *addr) {
+  BleHidBackend *b = backend.load(std::memory_order_acquire);
+  if (b)
+    b->getLocalAddress(addr);
+  else
+    memset(addr, 0, BLE_ADDR_LEN);
+}
+
+int BleKeyboardHandler::getBondedPeers(ble_peer_t *out, int max) {
+  BleHidBackend *b = backend.load(std::memory_order_acquire);
+  return b ? b->getBondedPeers(out, max) : 0;
+}
+
+unsigned long BleKeyboardHandler::getAdvertisingStartedMillis() {
+  return advertisingStartedMillis;
 }
 
 bool BleKeyboardHandler::keyboardConnected() {
-  return connectedCount > 0;
+  return connectedCount.load(std::memory_order_acquire) > 0;
 }
 
 void BleKeyboardHandler::startKeyboard(void (*onInitialized_p)(),
@@ -289,7 +292,7 @@ void BleKeyboardHandler::startKeyboard(void (*onInitialized_p)(),
                                        bool allowMultiConnect,
                                        void (*onDisconnect_p)(),
                                        const char *keyboardName,
-                                       esp_ble_auth_req_t authMode) {
+                                       ble_hid_auth_t authMode) {
   mainOnInitialized = onInitialized_p;
   mainOnConnect = onConnect_p;
   mainOnPassKeyNotify = onPassKeyNotify_p;
@@ -297,35 +300,263 @@ void BleKeyboardHandler::startKeyboard(void (*onInitialized_p)(),
   mainOnDisconnect = onDisconnect_p;
   mainKeyboardAuthMode = authMode;
   if (keyboardName)
-    deviceName = strdup(keyboardName);
+    strlcpy(deviceName, keyboardName, sizeof(deviceName));
   Serial.printf("Starting keyboard task, on init callback %p on connect callback %p\n", mainOnInitialized, mainOnConnect);
   delay(10);
-  xTaskCreate(taskServer, "server", 20000, NULL, 5, NULL);
+  TaskHandle_t task = NULL;
+  xTaskCreate(taskServer, "server", 20000, NULL, 5, &task);
+  if (task)
+    metricsSetTask(METRIC_TASK_BLE, task);
+}
+
+void BleKeyboardHandler::setReconnectPolicy(const reconnect_policy_t *policy) {
+  bleReconnectSetPolicy(policy);
+}
+
+bool BleKeyboardHandler::switchHost(const ble_peer_t *peer) {
+  return directSwitchHost(peer);
+}
+
+void BleKeyboardHandler::setSwapCtrlGui(bool swap) {
+  swapCtrlGui.store(swap, std::memory_order_relaxed);
+}
+
+void BleKeyboardHandler::setShiftUndoesCaps(bool undoes) {
+  shiftUndoesCaps.store(undoes, std::memory_order_relaxed);
+}
+
+/* Sleeps the whole ticks and spins the rest. pdMS_TO_TICKS() rounds
+ * down, at the IDF build's 100Hz tick every gap here would be no wait */
+static void waitReportMillis(uint32_t ms) {
+  uint32_t ticks = ms / portTICK_PERIOD_MS;
+  if (ticks)
+    vTaskDelay(ticks);
+  delayMicroseconds((ms - ticks * portTICK_PERIOD_MS) * 1000);
+}
+
+void BleKeyboardHandler::setReportGap(uint8_t ms) {
+  reportGapMs.store(ms, std::memory_order_relaxed);
+}
+
+/* Static method. The idle echo time, then a burst of lone Shift and
+ * Control presses at each gap from the shortest before timing the echo
+ * again. The first gap
+ * the host keeps up with, echoing within TYPING_BACKLOG_MS of idle, is
+ * returned. Caps Lock is toggled an even number of times */
+int BleKeyboardHandler::directCalibrateTypingRate() {
+  static const uint8_t gaps[] = { 1, 2, 3, 5, 8, 12, 20, 30, TYPING_GAP_MAX_MS };
+  uint8_t startLeds = lockLeds();
+
+  // Press Caps Lock and time how long the host takes to send back the LED
+  // change, held until then since some hosts only take a held Caps Lock.
+  // Returns ms or -1 if there was no echo
+  auto capsLockEcho = []() -> int {
+    keyboard_input_report_t msg;
+    uint8_t before = lockLeds() & LED_CAPS_LOCK;
+    int echo = -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.keys[0] = 0x39;     // Caps Lock
+    unsigned long start = millis();
+    if (!directSendReport(KEYBOARD_REPORT_ID, (uint8_t *) &msg, sizeof(msg)))
+      return -1;
+
+    while (millis() - start < TYPING_ECHO_TIMEOUT_MS) {
+      if ((lockLeds() & LED_CAPS_LOCK) != before) {
+        echo = millis() - start;
+        break;
+      }
+      delay(1);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    directSendReport(KEYBOARD_REPORT_ID, (uint8_t *) &msg, sizeof(msg));
+    return echo;
+  };
+
+  if (!connectedCount.load(std::memory_order_acquire)) {
+    Serial.println("No host connected");
+    return -1;
+  }
+
+  int idle = capsLockEcho();
+  int idle2 = capsLockEcho();
+  if (idle < 0 || idle2 < 0) {
+    Serial.println("Host didn't echo Caps Lock");
+    if ((lockLeds() ^ startLeds) & LED_CAPS_LOCK)
+      capsLockEcho();
+    return -1;
+  }
+  idle = MIN(idle, idle2);
+  Serial.printf("Idle echo %d ms\n", idle);
+
+  int chosen = TYPING_GAP_MAX_MS;
+  for (uint8_t g = 0; g < sizeof(gaps); g++) {
+    keyboard_input_report_t msg;
+    memset(&msg, 0, sizeof(msg));
+
+    // A modifier on its own types nothing. Shift and Control take turns,
+    // five Shift presses in a row turn on Sticky Keys on Windows and
+    // Linux desktops, and they're never down together
+    for (int i = 0; i < TYPING_PROBE_REPORTS; i++) {
+      msg.modifiers = i & 1 ? 0 : (i & 2 ? 0x01 : 0x02);    // Left Control, Left Shift
+      directSendReport(KEYBOARD_REPORT_ID, (uint8_t *) &msg, sizeof(msg));
+      waitReportMillis(gaps[g]);
+    }
+    int echo = capsLockEcho();
+    capsLockEcho();
+    Serial.printf("Gap %d ms, echo %d ms\n", gaps[g], echo);
+
+    if (echo >= 0 && echo <= idle + TYPING_BACKLOG_MS) {
+      chosen = gaps[g];
+      break;
+    }
+  }
+
+  if ((lockLeds() ^ startLeds) & LED_CAPS_LOCK)
+    capsLockEcho();
+  return chosen;
+}
+
+/* Static method. Drop every other host and advertise directly at a bonded
+ * one, the reconnect policy starts directed advertising once the last
+ * connection has gone */
+bool BleKeyboardHandler::directSwitchHost(const ble_peer_t *peer) {
+  BleHidBackend *b = backend.load(std::memory_order_acquire);
+  if (!b || !bleReconnectSetTarget(peer))
+    return false;
+
+  conn_state_t state = connState.read();
+  int others = 0;
+  for (int i = 0; i < state.count; i++) {
+    if (memcmp(state.connections[i].peer.val, peer->val, BLE_ADDR_LEN)) {
+      b->disconnect(state.connections[i].connId);
+      others++;
+    }
+  }
+
+  if (!state.count)
+    bleReconnectStart(true);
+  Serial.printf("Switching host, disconnecting %d\n", others);
+  return true;
+}
+
+/* Copy up to max of the current connections into out, returns the 
+ * number of connections */
+int BleKeyboardHandler::getConnectedClients(conn_info_t *out, int max) {
+  conn_state_t state = connState.read();
+  for (int i = 0; i < state.count && i < max; i++)
+    out[i] = state.connections[i];
+  return state.count;
+}
+
+/* Static method */
+bool BleKeyboardHandler::directSendReport(uint8_t reportId, const uint8_t *report, size_t len) {
+  if (connectedCount.load(std::memory_order_acquire) <= 0)
+    return false;
+  // begin() starts advertising before the backend is published, so a
+  // host can connect before there's a backend to send with
+  BleHidBackend *b = backend.load(std::memory_order_acquire);
+  if (!b)
+    return false;
+  bool sent = b->notifyInput(reportId, report, len);
+  metricInc(sent ? METRIC_REPORTS_SENT : METRIC_NOTIFY_FAILURES);
+  return sent;
 }
 
-std::map<uint16_t, conn_info_t> BleKeyboardHandler::getConnectedClients() {
-  return connectedClientsMap;
+/* Between reports that were sent, so the host sees each one */
+static void waitReportGap() {
+  waitReportMillis(reportGapMs.load(std::memory_order_relaxed));
 }
 
 /* Static method */
 void BleKeyboardHandler::directSendMsg(uint8_t *msg, int len) {
-  if (connectedCount > 0) {
-    input->setValue(msg, len);
-    input->notify();  
-    vTaskDelay(3);
-  }  
+  profileBegin(SPAN_SEND_MSG);
+  if (directSendReport(KEYBOARD_REPORT_ID, msg, len))
+    waitReportGap();
+  profileEnd(SPAN_SEND_MSG);
+}
+
+/* Static method */
+void BleKeyboardHandler::directSendConsumer(uint16_t usage) {
+  consumer_input_report_t msg;
+  msg.usage = usage;
+  if (directSendReport(CONSUMER_REPORT_ID, (uint8_t *) &msg, sizeof(msg)))
+    waitReportGap();
+
+  msg.usage = 0;
+  if (directSendReport(CONSUMER_REPORT_ID, (uint8_t *) &msg, sizeof(msg)))
+    waitReportGap();
+}
+
+static inline int8_t takeMouseDelta(std::atomic<int32_t> &pending) {
+  // Send what fits in a report and leave the rest for the next one
+  int32_t delta = pending.exchange(0, std::memory_order_relaxed);
+  int32_t sent = delta > 127 ? 127 : delta < -127 ? -127 : delta;
+  if (sent != delta)
+    pending.fetch_add(delta - sent, std::memory_order_relaxed);
+  return sent;
+}
+
+/* Static method, motion is added to what's pending and sent by the next
+ * flushMouse() so a fast source sends one report per interval rather
+ * than a report per step */
+void BleKeyboardHandler::directSendMouse(int16_t dx, int16_t dy, int8_t wheel) {
+  mousePendingX.fetch_add(dx, std::memory_order_relaxed);
+  mousePendingY.fetch_add(dy, std::memory_order_relaxed);
+  mousePendingWheel.fetch_add(wheel, std::memory_order_relaxed);
+}
+
+static bool mouseMotionPending() {
+  return mousePendingX.load(std::memory_order_relaxed) || mousePendingY.load(std::memory_order_relaxed) ||
+         mousePendingWheel.load(std::memory_order_relaxed);
+}
+
+/* Static method, sends the pending motion with the buttons held */
+bool BleKeyboardHandler::directFlushMouse(bool force) {
+  unsigned long now = millis();
+
+  if (!force && (now - mouseLastMillis < MOUSE_REPORT_MILLIS || !mouseMotionPending()))
+    return false;
+
+  mouse_input_report_t msg;
+  msg.buttons = mouseButtons;
+  msg.motion[0] = takeMouseDelta(mousePendingX);
+  msg.motion[1] = takeMouseDelta(mousePendingY);
+  msg.wheel = takeMouseDelta(mousePendingWheel);
+  mouseLastMillis = now;
+  return directSendReport(MOUSE_REPORT_ID, (uint8_t *) &msg, sizeof(msg));
+}
+
+/* Static method, press then release the buttons. Pending motion goes 
+ * first so a click lands where the pointer was moved to */
+void BleKeyboardHandler::directClickMouse(uint8_t buttons) {
+  if (mouseMotionPending() && directFlushMouse(true))
+    waitReportGap();
+  mouseButtons = buttons;
+  if (directFlushMouse(true))
+    waitReportGap();
+  mouseButtons = 0;
+  directFlushMouse(true);
+}
+
+/* Left and right Control are bits 0 and 4, left and right GUI 3 and 7 */
+static uint8_t swapModifiers(uint8_t modifier) {
+  return (modifier & 0x66) | ((modifier & 0x11) << 3) | ((modifier & 0x88) >> 3);
 }
 
 /* Static method */
 void BleKeyboardHandler::directSendKey(uint8_t modifier, uint8_t key, uint8_t key2) {
-  // The HID report descriptor defined above has one byte of modifier, 
-  // a reserved byte then up to 6 key codes
-  uint8_t msg[] = {modifier, 0x0, key, key2, 0x0, 0x0, 0x0, 0x0};
-  directSendMsg(msg, sizeof(msg));
+  keyboard_input_report_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.modifiers = swapCtrlGui.load(std::memory_order_relaxed) ? swapModifiers(modifier) : modifier;
+  msg.keys[0] = key;
+  msg.keys[1] = key2;
+  directSendMsg((uint8_t *) &msg, sizeof(msg));
 
   // Send the matching key up
-  uint8_t blank[] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-  directSendMsg(blank, sizeof(blank));    
+  memset(&msg, 0, sizeof(msg));
+  directSendMsg((uint8_t *) &msg, sizeof(msg));
 }
 
 void BleKeyboardHandler::sendMsg(uint8_t *msg, int len) {
@@ -336,15 +567,40 @@ void BleKeyboardHandler::sendKey(uint8_t modifier, uint8_t key, uint8_t key2) {
   BleKeyboardHandler::directSendKey(modifier, key, key2);
 }
 
+void BleKeyboardHandler::sendConsumer(uint16_t usage) {
+  BleKeyboardHandler::directSendConsumer(usage);
+}
+
+void BleKeyboardHandler::sendMouse(int16_t dx, int16_t dy, int8_t wheel) {
+  BleKeyboardHandler::directSendMouse(dx, dy, wheel);
+}
+
+void BleKeyboardHandler::clickMouse(uint8_t buttons) {
+  BleKeyboardHandler::directClickMouse(buttons);
+}
+
+bool BleKeyboardHandler::flushMouse() {
+  return BleKeyboardHandler::directFlushMouse(false);
+}
+
 int BleKeyboardHandler::getConnectedCount() {
-  return connectedCount;
+  return connectedCount.load(std::memory_order_acquire);
 }
 
 void BleKeyboardHandler::sendString(const char *str) {
+  uint8_t modifiers[LAYOUT_MAX_KEYSTROKES], usages[LAYOUT_MAX_KEYSTROKES];
+  stall_task_t task = stallCurrentTask();
+  uint32_t stall = stallEnter(task, STAGE_SEND_STRING);
+  // Letters are shifted the other way rather than toggling Caps Lock. A
+  // host where Shift doesn't undo it types them all as capitals, shifting
+  // them the other way would make no difference there
+  bool capsLock = shiftUndoesCaps.load(std::memory_order_relaxed) && (getLockLeds() & LED_CAPS_LOCK);
+
   while (*str) {
-    KEYMAP map = keymap[(uint8_t)*str];
-    // Serial.printf("Send %d %d for '%c' %d\n", map.modifier, map.usage, *str, (uint8_t) *str);
-    sendKey(map.modifier, map.usage, 0x0);
+    uint8_t count = keyboardLayoutKeys(*str, modifiers, usages, capsLock);
+    for (uint8_t i = 0; i < count; i++)
+      sendKey(modifiers[i], usages[i], 0x0);
     str++;
   }
+  stallLeave(task, stall);
 }
@@ -1,16 +1,8 @@
 #ifndef BleKeyboard_h
 #define BleKeyboard_h
 
-#ifdef IDF_VER
-/* If we're being compiled in the ESP IDF environment 
- * make sure bluedroid is enabled */
-#ifndef CONFIG_BLUEDROID_ENABLED
-#error Looks like Bluetooth is not enabled in menuconfig
-#endif
-#endif
-
-#include <BLEAddress.h>
-#include <BLEDevice.h>
+#include "BleHidBackend.h"
+#include "BleReconnect.h"
 
 #ifndef DEFAULT_KEYBOARD_NAME
 #define DEFAULT_KEYBOARD_NAME "Custom Keyboard"
@@ -20,8 +12,35 @@
 #define KEYBOARD_MANUFACTURER "SMC"
 #endif
 
+// Matches CONFIG_BTDM_CTRL_BLE_MAX_CONN, the controller won't accept more
+#ifndef BLE_KEYBOARD_MAX_CONNECTIONS
+#define BLE_KEYBOARD_MAX_CONNECTIONS 3
+#endif
+
+#define BLE_KEYBOARD_MAX_NAME 32
+
+// Fastest rate mouse reports are sent, motion in between is added together
+#define MOUSE_REPORT_MILLIS 10
+
+// Consumer control usages
+#define CONSUMER_MUTE        0x00E2
+#define CONSUMER_VOLUME_UP   0x00E9
+#define CONSUMER_VOLUME_DOWN 0x00EA
+#define CONSUMER_PLAY_PAUSE  0x00CD
+
+#define MOUSE_BUTTON_LEFT    0x01
+#define MOUSE_BUTTON_RIGHT   0x02
+#define MOUSE_BUTTON_MIDDLE  0x04
+
+// Lock key LEDs in the host's output report
+#define LED_NUM_LOCK         0x01
+#define LED_CAPS_LOCK        0x02
+#define LED_SCROLL_LOCK      0x04
+
 typedef struct {
-  esp_bd_addr_t peer;
+  uint16_t connId;
+  ble_peer_t peer;
+  uint8_t leds;         // LED_ bits the host last set
 } conn_info_t;
 
 class BleKeyboardHandler {
@@ -33,17 +52,37 @@ class BleKeyboardHandler {
                        bool allowMultiConnect = false, 
                        void (*onDisconnect_p)() = NULL,
                        const char *keyboardName = NULL,
-                       esp_ble_auth_req_t authMode = ESP_LE_AUTH_REQ_SC_MITM_BOND);
+                       ble_hid_auth_t authMode = BLE_HID_AUTH_SC_MITM_BOND);
     bool keyboardConnected();  
     int getConnectedCount();
-    BLEAddress getPeerAddress();
+    ble_peer_t getPeerAddress();
+    uint8_t getLockLeds();
+    void getLocalAddress(uint8_t *addr);
+    int getBondedPeers(ble_peer_t *out, int max);
+    unsigned long getAdvertisingStartedMillis();
     void sendKey(uint8_t modifier, uint8_t key, uint8_t key2);
     void sendString(const char *str);
-    std::map<uint16_t, conn_info_t> getConnectedClients();
+    void sendConsumer(uint16_t usage);
+    void sendMouse(int16_t dx, int16_t dy, int8_t wheel = 0);
+    void clickMouse(uint8_t buttons);
+    bool flushMouse();
+    int getConnectedClients(conn_info_t *out, int max);
+    void setReconnectPolicy(const reconnect_policy_t *policy);
+    bool switchHost(const ble_peer_t *peer);
+    void setSwapCtrlGui(bool swap);
+    void setShiftUndoesCaps(bool undoes);
+    void setReportGap(uint8_t ms);
 
   protected:
     static void directSendKey(uint8_t modifier, uint8_t key, uint8_t key2);
     static void directSendMsg(uint8_t *msg, int len);
+    static bool directSendReport(uint8_t reportId, const uint8_t *report, size_t len);
+    static void directSendConsumer(uint16_t usage);
+    static void directSendMouse(int16_t dx, int16_t dy, int8_t wheel);
+    static bool directFlushMouse(bool force);
+    static void directClickMouse(uint8_t buttons);
+    static bool directSwitchHost(const ble_peer_t *peer);
+    static int directCalibrateTypingRate();
 
   private:
     void sendMsg(uint8_t *msg, int len);
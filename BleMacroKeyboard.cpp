@@ -1,11 +1,124 @@
 #include "Arduino.h"
 #include "BleMacroKeyboard.h"
 #include "eeprom_config.h"
+#include "Bindings.h"
+#include "Gestures.h"
+#include "MacroLibrary.h"
+#include "MacroImage.h"
+#include "HostProfiles.h"
+#include "TypingRate.h"
+
+// Most macros a single read of an encoder will send, a fast spin 
+// shouldn't queue up seconds of keystrokes
+#define ENCODER_MAX_REPEAT 16
 
 BleMacroKeyboardHandler BleMacroKeyboard;
 
+static void applyHostProfile(uint8_t flags, uint8_t typingGapMs) {
+  BleMacroKeyboard.setSwapCtrlGui(flags & HOST_SWAP_CTRL_GUI);
+  BleMacroKeyboard.setShiftUndoesCaps(!(flags & HOST_CAPS_KEEPS_SHIFT));
+  BleMacroKeyboard.setReportGap(typingGapMs);
+}
+
 void BleMacroKeyboardHandler::checkPins() {
+  // The host's profile, with its typing rate, is picked here on the loop
+  // task before its inputs are read
+  if (keyboardConnected()) {
+    ble_peer_t peer = getPeerAddress();
+    hostProfilesConnected(&peer);
+  } else {
+    hostProfilesDisconnected();
+  }
   checkPinsAndCallback(directSendKey);
+  directFlushMouse(false);
+}
+
+/* Static method, the consumer control, mouse and host switching macro operations */
+bool BleMacroKeyboardHandler::directMacroOp(uint8_t op, uint8_t argModifier, uint8_t argCode) {
+  switch (op) {
+    case MACRO_OP_CONSUMER:
+      directSendConsumer((argModifier << 8) | argCode);
+      return true;
+    case MACRO_OP_MOUSE_MOVE:
+      // A step in a macro goes now, in order with the keystrokes around it
+      directSendMouse((int8_t) argModifier, (int8_t) argCode, 0);
+      directFlushMouse(true);
+      return true;
+    case MACRO_OP_MOUSE_WHEEL:
+      directSendMouse(0, 0, (int8_t) argCode);
+      directFlushMouse(true);
+      return true;
+    case MACRO_OP_MOUSE_CLICK:
+      directClickMouse(argCode);
+      return true;
+    case MACRO_OP_HOST: {
+      ble_peer_t peer;
+      if (!hostProfilePeer(argCode, &peer) || !directSwitchHost(&peer))
+        Serial.printf("No bonded host for profile %d\n", argCode);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Matrix keys are inputs MATRIX_FIRST_INPUT + row * cols + col, they
+ * are configured with the 'u' console command like pins */
+bool BleMacroKeyboardHandler::beginKeyMatrix(const uint8_t *rowPins, uint8_t rows,
+                                             const uint8_t *colPins, uint8_t cols,
+                                             bool hasDiodes, uint16_t scanHz) {
+  if (rows * cols > MAX_MATRIX_KEYS) {
+    Serial.printf("Key matrix has more than %d keys\n", MAX_MATRIX_KEYS);
+    return false;
+  }
+  return keyMatrixBegin(rowPins, rows, colPins, cols, hasDiodes, scanHz);
+}
+
+/* Expander inputs are numbered from EXPANDER_FIRST_INPUT, 16 per chip in
+ * the order the chips are added */
+bool BleMacroKeyboardHandler::addExpander(ExpanderBus *bus, uint8_t address, int8_t intPin) {
+#if MAX_EXPANDER_CHIPS
+  static Mcp23017Source expanders[MAX_EXPANDER_CHIPS];
+  static uint8_t expanderCount = 0;
+
+  if (expanderCount >= MAX_EXPANDER_CHIPS) {
+    Serial.printf("No more than %d expanders\n", MAX_EXPANDER_CHIPS);
+    return false;
+  }
+
+  Mcp23017Source *expander = &expanders[expanderCount];
+  expander->configure(bus, address, intPin);
+  if (!addInputSource(expander, EXPANDER_INPUT(expanderCount * EXPANDER_CHIP_INPUTS)))
+    return false;
+
+  expanderCount++;
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool BleMacroKeyboardHandler::beginEncoder(uint8_t encoder, uint8_t pinA, uint8_t pinB, uint8_t countsPerDetent) {
+  if (encoder >= MAX_ENCODERS) {
+    Serial.printf("No more than %d encoders\n", MAX_ENCODERS);
+    return false;
+  }
+  return rotaryEncoderBegin(encoder, pinA, pinB, countsPerDetent);
+}
+
+/* Encoder inputs are ENCODER_FIRST_INPUT + encoder * 2 for clockwise and
+ * one more for anticlockwise. If the direction turned has keystrokes 
+ * configured they are sent once per detent, otherwise the detents are 
+ * returned for the caller to use */
+int BleMacroKeyboardHandler::checkEncoder(uint8_t encoder) {
+  int detents = rotaryEncoderReadDetents(encoder);
+  if (!detents || encoder >= MAX_ENCODERS)
+    return detents;
+
+  uint8_t input = ENCODER_INPUT(encoder, detents < 0);
+  int repeat = abs(detents);
+  if (sendInputRepeated(input, repeat > ENCODER_MAX_REPEAT ? ENCODER_MAX_REPEAT : repeat, directSendKey))
+    return 0;
+  return detents;
 }
 
 void BleMacroKeyboardHandler::readSerialKeysAndSend() {
@@ -17,9 +130,53 @@ void BleMacroKeyboardHandler::resetConfig() {
 }
 
 void BleMacroKeyboardHandler::loadConfig() {
+  setMacroOpHandler(directMacroOp);
   readAndProcessConfig();
 }
 
 void BleMacroKeyboardHandler::readSerialPinConfigUpdate() {
   readPinConfigUpdateFromSerial();
 }
+
+void BleMacroKeyboardHandler::readSerialLayoutUpdate() {
+  readLayoutUpdateFromSerial();
+}
+
+void BleMacroKeyboardHandler::readSerialStallBudgetUpdate() {
+  readStallBudgetUpdateFromSerial();
+}
+
+void BleMacroKeyboardHandler::readSerialBindingUpdate(bool layerKey) {
+#if MAX_BINDINGS
+  if (!readBindingUpdateFromSerial(layerKey))
+    readAndProcessConfig();
+#endif
+}
+
+void BleMacroKeyboardHandler::readSerialGestureUpdate() {
+#if MAX_GESTURES
+  readGestureUpdateFromSerial();
+#endif
+}
+
+bool BleMacroKeyboardHandler::beginMacroLibrary() {
+  macroImageBegin();
+  return macroLibraryBegin();
+}
+
+void BleMacroKeyboardHandler::readSerialMacroLibraryCommand() {
+  readMacroLibraryCommandFromSerial(directSendKey);
+}
+
+bool BleMacroKeyboardHandler::beginHostProfiles() {
+  return hostProfilesBegin(applyHostProfile);
+}
+
+void BleMacroKeyboardHandler::readSerialHostProfileCommand() {
+  readHostProfileCommandFromSerial(directSwitchHost);
+}
+
+void BleMacroKeyboardHandler::readSerialTypingRateCommand() {
+  // A new gap is applied with the host's profile
+  readTypingRateCommandFromSerial(directCalibrateTypingRate);
+}
@@ -2,15 +2,37 @@
 #define BleMacroKeyboard_h
 
 #include "BleKeyboard.h"
+#include "KeyMatrix.h"
+#include "Mcp23017Source.h"
+#include "RotaryEncoder.h"
 
 class BleMacroKeyboardHandler : public BleKeyboardHandler {
   public:
     void loadConfig();
     void resetConfig();
     void checkPins();
+    bool beginKeyMatrix(const uint8_t *rowPins, uint8_t rows,
+                        const uint8_t *colPins, uint8_t cols,
+                        bool hasDiodes, uint16_t scanHz = KEY_MATRIX_DEFAULT_SCAN_HZ);
+    bool addExpander(ExpanderBus *bus, uint8_t address, int8_t intPin = MCP23017_NO_INT);
+    bool beginEncoder(uint8_t encoder, uint8_t pinA, uint8_t pinB,
+                      uint8_t countsPerDetent = ROTARY_ENCODER_COUNTS_PER_DETENT);
+    int checkEncoder(uint8_t encoder);
 
     void readSerialKeysAndSend();
     void readSerialPinConfigUpdate();
+    void readSerialLayoutUpdate();
+    void readSerialStallBudgetUpdate();
+    void readSerialBindingUpdate(bool layerKey);
+    void readSerialGestureUpdate();
+    bool beginMacroLibrary();
+    void readSerialMacroLibraryCommand();
+    bool beginHostProfiles();
+    void readSerialHostProfileCommand();
+    void readSerialTypingRateCommand();
+
+  protected:
+    static bool directMacroOp(uint8_t op, uint8_t argModifier, uint8_t argCode);
 };
 
 extern BleMacroKeyboardHandler BleMacroKeyboard;
@@ -7,11 +7,21 @@
 #endif
 
 #include <WiFi.h>
-#include <StreamString.h>
 #include "HIDKeyboardTypes.h"
 #include "M5Util.h"
+#include "TextBuffer.h"
+#include "HeapStats.h"
+#include "Metrics.h"
+#include "StallDetector.h"
+#include "Profiler.h"
+#include "PinTrace.h"
+#include "ConsoleWcet.h"
+#include "ConsoleUart.h"
+#include "SerialUtil.h"
 #include "BleMacroKeyboard.h"
 #include "GvmLightControl.h"
+#include "LightPipeline.h"
+#include "LightPacket.h"
 
 int lcd_off = 0;
 unsigned long last_button_millis = 0;
@@ -22,6 +32,57 @@ unsigned long last_button_millis = 0;
 #define INACTIVE_SCREEN_OFF_WHEN_PLUGGED_IN 1
 #define INACTIVE_OFF_WHEN_PLUGGED_IN 0
 
+/* Optional row/column key matrix, for example a 4x6 matrix on the
+ * M5Stack's free pins with
+ * -DKEY_MATRIX_ROW_PINS=34,35,36,26 -DKEY_MATRIX_COL_PINS=2,5,12,13,15,16
+ * (rows 34-36 need external pull ups). The LCD has 14, 18, 19, 23, 27,
+ * 32 and 33 and the buttons 37-39, on the M5StickC the LCD has 5, 13,
+ * 15, 18 and 23 and the buttons 37 and 39, so a bigger matrix needs a
+ * bare ESP32 board. Define KEY_MATRIX_DIODES=0 if the keys don't have
+ * diodes */
+#if defined(KEY_MATRIX_ROW_PINS) && defined(KEY_MATRIX_COL_PINS)
+static const uint8_t keyMatrixRows[] = { KEY_MATRIX_ROW_PINS };
+static const uint8_t keyMatrixCols[] = { KEY_MATRIX_COL_PINS };
+#ifndef KEY_MATRIX_DIODES
+#define KEY_MATRIX_DIODES 1
+#endif
+#endif
+
+/* Optional MCP23017 I2C port expanders, 16 inputs each, for example two
+ * chips on the grove port sharing an INT line on pin 26 with
+ * -DEXPANDER_ADDRESSES=0x20,0x21 -DEXPANDER_INT_PIN=26 */
+#ifdef EXPANDER_ADDRESSES
+#ifndef EXPANDER_SDA_PIN
+#ifdef ARDUINO_M5Stack_Core_ESP32
+// Grove port A is the internal bus the power chip is on, 32 and 33 are
+// the LCD's backlight and reset
+#define EXPANDER_SDA_PIN 21
+#define EXPANDER_SCL_PIN 22
+#define EXPANDER_WIRE    Wire
+#else
+// M5StickC grove port
+#define EXPANDER_SDA_PIN 32
+#define EXPANDER_SCL_PIN 33
+#endif
+#endif
+#ifndef EXPANDER_WIRE
+#define EXPANDER_WIRE    Wire1
+#endif
+#ifndef EXPANDER_INT_PIN
+#define EXPANDER_INT_PIN MCP23017_NO_INT
+#endif
+static const uint8_t expanderAddresses[] = { EXPANDER_ADDRESSES };
+static WireExpanderBus expanderBus(&EXPANDER_WIRE);
+#endif
+
+/* Optional rotary encoder, -DENCODER_PIN_A=25 -DENCODER_PIN_B=26. Turning
+ * it changes the value in the current screen mode like the buttons, unless
+ * macros are configured for its inputs (144 clockwise, 145 anticlockwise) */
+#ifdef ENCODER_PIN_A
+#define ENCODER_SAMPLE_MILLIS 50
+unsigned long last_encoder_millis = 0;
+#endif
+
 #define MODE_SUMMARY        -1
 #define MODE_SET_ON_OFF      0
 #define MODE_SET_CHANNEL     1
@@ -48,71 +109,79 @@ static void onWiFiConnectAttempt(uint8_t *bssid, int attempt) {
 void update_screen_status();
 void serialEvent();
 
+char *bda2str(const uint8_t* bda, char *str, size_t size)
+{
+  if (bda == NULL || str == NULL || size < 18)
+    return NULL;
+  sprintf(str, "%02x:%02x:%02x:%02x:%02x:%02x",
+          bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
+  return str;
+}
+
+
 static void onStatusUpdated() {
+  lightPipelineOnStatus();
   update_screen_status();
 }
 
 void onKeyboardConnect() {
-  setScreenText("BLE Keyboard connected\nPeer: %s", BleMacroKeyboard.getPeerAddress().toString().c_str());
+  char bda_str[18];
+  ble_peer_t peer = BleMacroKeyboard.getPeerAddress();
+  setScreenText("BLE Keyboard connected\nPeer: %s", bda2str(peer.val, bda_str, sizeof(bda_str)));
 }
 
 void onKeyboardInitialized() {
-  esp_bd_addr_t *pLocalAddr = BLEDevice::getAddress().getNative();
+  uint8_t localAddr[BLE_ADDR_LEN];
+  BleMacroKeyboard.getLocalAddress(localAddr);
 
   setScreenText("BLE initialized\nLocal %02x:%02x:%02x:%02x:%02x:%02x\nWaiting",
-                (*pLocalAddr)[0], (*pLocalAddr)[1], (*pLocalAddr)[2],
-                (*pLocalAddr)[3], (*pLocalAddr)[4], (*pLocalAddr)[5]);
+                localAddr[0], localAddr[1], localAddr[2],
+                localAddr[3], localAddr[4], localAddr[5]);
 }
 
-void set_screen_text(String newText, int textFont = 2) {
-  static String lastText; 
-  if (newText == lastText)
+#define SCREEN_TEXT_MAX 256
+
+void set_screen_text(const char *newText, int textFont = 2) {
+  static char lastText[SCREEN_TEXT_MAX]; 
+  if (!strcmp(newText, lastText))
     return;
 
   M5.Lcd.fillScreen(BLACK);
   M5.Lcd.setCursor(0, 0, 2);
   M5.Lcd.setTextFont(textFont);
   M5.Lcd.print(newText);
-  lastText = newText;      
+  strlcpy(lastText, newText, sizeof(lastText));
 }
 
 #define PAIR_MAX_DEVICES 20
 
-char *bda2str(const uint8_t* bda, char *str, size_t size)
-{
-  if (bda == NULL || str == NULL || size < 18)
-    return NULL;
-  sprintf(str, "%02x:%02x:%02x:%02x:%02x:%02x",
-          bda[0], bda[1], bda[2], bda[3], bda[4], bda[5]);
-  return str;
-}
-
 void dump_bluetooth_info() {
-  esp_ble_bond_dev_t pairedDeviceBtAddr[PAIR_MAX_DEVICES];
+  ble_peer_t pairedDevices[PAIR_MAX_DEVICES];
   char bda_str[18];
 
-  // Get the numbers of bonded/paired devices in the BT module
-  int count = esp_ble_get_bond_device_num();
+  // Get the bonded/paired devices from the BLE stack
+  int count = BleMacroKeyboard.getBondedPeers(pairedDevices, PAIR_MAX_DEVICES);
   if(!count) {
     Serial.println("No bonded device found.");
   } else {
     Serial.print("Bonded device count: "); Serial.println(count);
-    if(PAIR_MAX_DEVICES < count) {
-      count = PAIR_MAX_DEVICES;
-      Serial.print("Reset bonded device count: "); Serial.println(count);
-    }
-    esp_err_t tError =  esp_ble_get_bond_device_list(&count, pairedDeviceBtAddr);
-    if(ESP_OK == tError) {
-      for(int i = 0; i < count; i++) {
-        Serial.print("Bonded device # "); Serial.print(i); Serial.print(" -> ");
-        Serial.println(bda2str(pairedDeviceBtAddr[i].bd_addr, bda_str, 18));
-      }
+    for(int i = 0; i < count; i++) {
+      Serial.print("Bonded device # "); Serial.print(i); Serial.print(" -> ");
+      Serial.println(bda2str(pairedDevices[i].val, bda_str, 18));
     }
   }
 }
 
+/* Figures for comparing the BLE stack backends */
+void dump_stack_info() {
+  Serial.printf("BLE stack: %s\n", BLE_HID_BACKEND_NAME);
+  Serial.printf("Boot to advertising: %lu ms\n", BleMacroKeyboard.getAdvertisingStartedMillis());
+  Serial.printf("Free heap: %u, minimum free heap: %u\n", ESP.getFreeHeap(), ESP.getMinFreeHeap());
+  Serial.printf("App image size: %u\n", ESP.getSketchSize());
+}
+
 void setup() {
-  Serial.begin(115200);
+  Serial.begin(CONSOLE_BAUD);
   Serial.println("Starting BLE + GVM Light console...\n");
   Serial.printf("Log level set to %d\n", ARDUHAL_LOG_LEVEL);
 
@@ -139,13 +208,33 @@ void setup() {
   Serial.printf("Currently charging %d\n", battery_power());
 #endif
 
+  metricsSetTask(METRIC_TASK_LOOP, NULL);
+  BleMacroKeyboard.beginHostProfiles();
   BleMacroKeyboard.loadConfig();
+  stallBegin();
+  BleMacroKeyboard.beginMacroLibrary();
+
+#if defined(KEY_MATRIX_ROW_PINS) && defined(KEY_MATRIX_COL_PINS)
+  BleMacroKeyboard.beginKeyMatrix(keyMatrixRows, sizeof(keyMatrixRows), 
+                                  keyMatrixCols, sizeof(keyMatrixCols), 
+                                  KEY_MATRIX_DIODES);
+#endif
+
+#ifdef EXPANDER_ADDRESSES
+  EXPANDER_WIRE.begin(EXPANDER_SDA_PIN, EXPANDER_SCL_PIN, 400000);
+  for (uint8_t i = 0; i < sizeof(expanderAddresses); i++)
+    BleMacroKeyboard.addExpander(&expanderBus, expanderAddresses[i], EXPANDER_INT_PIN);
+#endif
+
+#ifdef ENCODER_PIN_A
+  BleMacroKeyboard.beginEncoder(0, ENCODER_PIN_A, ENCODER_PIN_B);
+#endif
 
   // Starting bluetooth will cause a spurious interrupt on PIN 39, 
   // be sure to ignore it
   setScreenText("Initializing BLE Keyboard...");
   BleMacroKeyboard.startKeyboard(onKeyboardInitialized, onKeyboardConnect, NULL, false, NULL, 
-                                 "Meeting Keyboard", ESP_LE_AUTH_BOND);
+                                 "Meeting Keyboard", BLE_HID_AUTH_BOND);
 
   GVM.debugOn();
 
@@ -184,26 +273,47 @@ void setup() {
   last_button_millis = millis();
 
   dump_bluetooth_info();
+
+#ifdef CONSOLE_UART_IDF
+  // Commands run on the console task from here, woken as bytes arrive
+  if (!Console.startTask(serialEvent))
+    Serial.println("Console task failed to start");
+#endif
   Serial.printf("Setup complete\n");
 }
 
 int screen_mode = 0;
 
 void update_screen_status() {
-  StreamString o;
+  // Only runs on loop(), from setup(), the input handlers and the GVM
+  // status callback that process_messages() calls, not from the BLE task
+  stall_task_t stall_task = stallCurrentTask();
+  uint32_t stall = stallEnter(stall_task, STAGE_SCREEN_STATUS);
+  profileBegin(SPAN_SCREEN_STATUS);
+  // Static so redrawing doesn't need heap or a large stack frame
+  static TextBuffer<SCREEN_TEXT_MAX> o;
+  char bda_str[18];
+  o.clear();
   LightStatus light_status = GVM.getLightStatus();
+  // Show where the light is going rather than where it was
+  lightPipelineShowTargets(&light_status);
 
   switch (mode_set[screen_mode]) {
     case MODE_SUMMARY:
       o.printf("BLE: ");
       if (BleMacroKeyboard.keyboardConnected()) {
-        o.printf("%s", BleMacroKeyboard.getPeerAddress().toString().c_str());
+        ble_peer_t peer = BleMacroKeyboard.getPeerAddress();
+        uint8_t leds = BleMacroKeyboard.getLockLeds();
+        o.printf("%s", bda2str(peer.val, bda_str, sizeof(bda_str)));
+        if (leds & (LED_NUM_LOCK | LED_CAPS_LOCK | LED_SCROLL_LOCK))
+          o.printf("\n%s%s%s", leds & LED_CAPS_LOCK ? "CAPS " : "", leds & LED_NUM_LOCK ? "NUM " : "",
+                   leds & LED_SCROLL_LOCK ? "SCROLL" : "");
       }
       else 
         o.printf("Waiting");
       o.printf("\n");
         
-      o.printf("Light: %s\n", WiFi.BSSIDstr().c_str());
+      o.printf("Light: %s\n", WiFi.BSSID() ? bda2str(WiFi.BSSID(), bda_str, sizeof(bda_str)) : "");
       if (light_status.on_off != -1) 
         o.printf("On %d ", light_status.on_off);
       if (light_status.hue != -1) 
@@ -250,16 +360,18 @@ void update_screen_status() {
       break;    
     case MODE_KEYBOARD_TEST: {
       o.printf("BLE Keyboard\n");
-      esp_bd_addr_t *pLocalAddr = BLEDevice::getAddress().getNative();
+      uint8_t localAddr[BLE_ADDR_LEN];
+      BleMacroKeyboard.getLocalAddress(localAddr);
     
       o.printf("Local:  %02x:%02x:%02x:%02x:%02x:%02x\n",
-               (*pLocalAddr)[0], (*pLocalAddr)[1], (*pLocalAddr)[2],
-               (*pLocalAddr)[3], (*pLocalAddr)[4], (*pLocalAddr)[5]);
+               localAddr[0], localAddr[1], localAddr[2],
+               localAddr[3], localAddr[4], localAddr[5]);
 
       o.printf("Connected #: %d\n", BleMacroKeyboard.getConnectedCount());
       o.printf("Remote: ");
       if (BleMacroKeyboard.keyboardConnected()) {
-        o.printf("%s", BleMacroKeyboard.getPeerAddress().toString().c_str());
+        ble_peer_t peer = BleMacroKeyboard.getPeerAddress();
+        o.printf("%s", bda2str(peer.val, bda_str, sizeof(bda_str)));
       }
       else 
         o.printf("Waiting");
@@ -267,7 +379,9 @@ void update_screen_status() {
     }
   }
 
-  set_screen_text(o, mode_set[screen_mode] == MODE_SUMMARY || mode_set[screen_mode] == MODE_KEYBOARD_TEST ? 2 : 4); 
+  set_screen_text(o.c_str(), mode_set[screen_mode] == MODE_SUMMARY || mode_set[screen_mode] == MODE_KEYBOARD_TEST ? 2 : 4); 
+  profileEnd(SPAN_SCREEN_STATUS);
+  stallLeave(stall_task, stall);
 }
 
 void test_screen_idle_off() {
@@ -295,19 +409,79 @@ int button_screen_on() {
   return 0;
 }
 
+/* Change the value shown in the current screen mode, by a step per 
+ * button press or a detent per encoder click. Light changes are only 
+ * queued here, loop() flushes them */
+void adjust_mode_value(int change) {
+  switch (mode_set[screen_mode]) {
+    case MODE_SET_ON_OFF:  
+      lightPipelineAdjust(LIGHT_PARAM_ON_OFF, change); 
+      break;
+    case MODE_SET_CHANNEL:   
+      lightPipelineAdjust(LIGHT_PARAM_CHANNEL, change); 
+      break;
+    case MODE_SET_BRIGHTNESS:
+      lightPipelineAdjust(LIGHT_PARAM_BRIGHTNESS, change); 
+      break;    
+    case MODE_SET_CCT:
+      lightPipelineAdjust(LIGHT_PARAM_CCT, change); 
+      break;    
+    case MODE_SET_HUE:
+      lightPipelineAdjust(LIGHT_PARAM_HUE, change);
+      break;    
+    case MODE_SET_SATURATION: 
+      lightPipelineAdjust(LIGHT_PARAM_SATURATION, change);
+      break;          
+    case MODE_KEYBOARD_TEST:             
+      if (change < 0) {
+        // Send 'Hello'
+        BleMacroKeyboard.sendString("Hello");
+      } else if (change > 0) {
+        BleMacroKeyboard.sendString("World");
+      }
+      break;          
+  }
+  update_screen_status();
+}
+
+/* Redraw the summary when the host's lock LEDs change */
+void check_lock_leds() {
+  static uint8_t shown_leds = 0;
+  uint8_t leds = BleMacroKeyboard.getLockLeds();
+  if (leds == shown_leds)
+    return;
+
+  shown_leds = leds;
+  if (mode_set[screen_mode] == MODE_SUMMARY)
+    update_screen_status();
+}
+
 void loop() {
+#ifdef CONSOLE_UART_IDF
+  // A console command holds loop() here until it finishes
+  stallStage(STALL_TASK_LOOP, STAGE_SERIAL);
+  Console.lock();
+#endif
+  unsigned long loop_start_micros = micros();
+
   /* Check if any pins should trigger keys to be sent */
+  stallStage(STALL_TASK_LOOP, STAGE_CHECK_PINS);
   BleMacroKeyboard.checkPins();
 
+  stallStage(STALL_TASK_LOOP, STAGE_LIGHT_MESSAGES);
   GVM.process_messages();
 
   int button_pressed = 0xff;
 
+  stallStage(STALL_TASK_LOOP, STAGE_SCREEN_IDLE);
   test_screen_idle_off();
+  check_lock_leds();
 
   // Read buttons before processing state
+  stallStage(STALL_TASK_LOOP, STAGE_M5_UPDATE);
   M5.update();
   
+  stallStage(STALL_TASK_LOOP, STAGE_BUTTONS);
   if (home_pressed()) {
     button_pressed = 0;
     Serial.println("Home button pressed");
@@ -335,44 +509,43 @@ void loop() {
         Serial.printf("New mode %d == %d\n", screen_mode, mode_set[screen_mode]);
         update_screen_status();          
       } else if (change && mode_set[screen_mode] != MODE_SUMMARY) {
-        switch (mode_set[screen_mode]) {
-          case MODE_SET_ON_OFF:  
-            GVM.setOnOff(GVM.getOnOff() + change); 
-            break;
-          case MODE_SET_CHANNEL:   
-            GVM.setChannel(GVM.getChannel() + change); 
-            break;
-          case MODE_SET_BRIGHTNESS:
-            GVM.setBrightness(GVM.getBrightness() + change); 
-            break;    
-          case MODE_SET_CCT:
-            GVM.setCct(GVM.getCct() + change); 
-            break;    
-          case MODE_SET_HUE:
-            GVM.setHue(GVM.getHue() + change);
-            break;    
-          case MODE_SET_SATURATION: 
-            GVM.setSaturation(GVM.getSaturation() + change);
-            break;          
-          case MODE_KEYBOARD_TEST:             
-            if (change == -1) {
-              // Send 'Hello'
-              BleMacroKeyboard.sendString("Hello");
-            } else if (change == 1) {
-              BleMacroKeyboard.sendString("World");
-            }
-            break;          
-        }
-        update_screen_status();
+        adjust_mode_value(change);
       }
     }
   }
 
-#ifdef ESP32
+#ifdef ENCODER_PIN_A
+  // The encoder counts in hardware, reading it at a fixed rate turns a 
+  // fast spin into one change rather than one per detent
+  stallStage(STALL_TASK_LOOP, STAGE_ENCODER);
+  if (millis() - last_encoder_millis >= ENCODER_SAMPLE_MILLIS) {
+    last_encoder_millis = millis();
+    int detents = BleMacroKeyboard.checkEncoder(0);
+    if (detents) {
+      last_button_millis = millis();
+      if (!button_screen_on() && mode_set[screen_mode] != MODE_SUMMARY)
+        adjust_mode_value(detents);
+    }
+  }
+#endif
+
+  stallStage(STALL_TASK_LOOP, STAGE_LIGHT_FLUSH);
+  lightPipelineFlush();
+
+#if defined(ESP32) && !defined(CONSOLE_UART_IDF)
+  stallStage(STALL_TASK_LOOP, STAGE_SERIAL);
   if (Serial.available()) 
     serialEvent();
 #endif
 
+  // Only the work, not the wait for the next message
+  metricsLoopTime(micros() - loop_start_micros);
+
+#ifdef CONSOLE_UART_IDF
+  Console.unlock();
+#endif
+
+  stallStage(STALL_TASK_LOOP, STAGE_LIGHT_WAIT);
   GVM.wait_msg_or_timeout();
 }
 
@@ -380,9 +553,64 @@ IRAM_ATTR void clickHome(){
   Serial.println("CLK");
 }
 
+#define LIGHT_HEX_MAX            128
+#define LIGHT_CRC_BYTES          2
+#define LIGHT_BENCH_ITERATIONS   1000
+#define LIGHT_BENCH_PACKET       "4C5409000053000001000B"
+
+static char hexIn[LIGHT_HEX_MAX + 1];
+// Room for the most hex 'R' reads plus the CRC it adds
+static uint8_t packetBuf[LIGHT_HEX_MAX / 2 + LIGHT_CRC_BYTES];
+static char hexOut[sizeof(packetBuf) * 2 + 1];
+static LightPacket packet(packetBuf, sizeof(packetBuf));
+
+/* How long adding the CRC to a packet takes with hex Strings compared to
+ * the binary builder, run on the device as the light library only exists
+ * here */
+void benchmark_light_packets() {
+  const char *hex = LIGHT_BENCH_PACKET;
+  size_t hexLen = strlen(hex);
+  uint32_t heapBefore = heapAllocCount();
+
+  unsigned long start = micros();
+  for (int i = 0; i < LIGHT_BENCH_ITERATIONS; i++) {
+    String toSend = hex;
+    unsigned short crc = calcCrcFromHexStr(toSend.c_str(), toSend.length());
+    char crc_str[5];
+    shortToHex(crc, crc_str);
+    crc_str[4] = '\0';
+    toSend += crc_str;
+  }
+  unsigned long stringMicros = micros() - start;
+  uint32_t stringAllocs = heapAllocCount() - heapBefore;
+
+  start = micros();
+  for (int i = 0; i < LIGHT_BENCH_ITERATIONS; i++) {
+    packet.clear();
+    packet.appendHex(hex, hexLen);
+    packet.appendCrc();
+    packet.toHex(hexOut, sizeof(hexOut));
+  }
+  unsigned long packetMicros = micros() - start;
+  uint32_t packetAllocs = heapAllocCount() - heapBefore - stringAllocs;
+
+  Serial.printf("%d packets of %u bytes\n", LIGHT_BENCH_ITERATIONS, hexLen / 2);
+  Serial.printf("String + hex CRC: %lu us, %u allocations\n", stringMicros, stringAllocs);
+  Serial.printf("LightPacket:      %lu us, %u allocations\n", packetMicros, packetAllocs);
+  Serial.printf("CRC %s: library %04x table %04x\n",
+                calcCrcFromHexStr(hex, hexLen) == crc16Xmodem(packet.data(), packet.length() - 2) ? "matches" : "MISMATCH",
+                calcCrcFromHexStr(hex, hexLen), crc16Xmodem(packet.data(), packet.length() - 2));
+}
+
 void serialEvent() {
-  if (Serial.available()) {         
-    char inChar = Serial.read();         
+  // The rest of a command that ran out of time isn't run as commands
+  if (serialDiscarding())
+    return;
+
+  if (serialInput->available()) {         
+    profileBegin(SPAN_SERIAL);
+    serialCommandBegin();
+    char inChar = serialInput->read();         
 
     Serial.print("Received: ");  
     Serial.println(inChar);         
@@ -396,6 +624,10 @@ void serialEvent() {
         Serial.println(""); 
         break;
       }
+      case 'm':
+        // Send mute as a consumer control report
+        BleMacroKeyboard.sendConsumer(CONSUMER_MUTE);
+        break;
       case 'S': {
         // Send keystrokes, reads a string of hex pairs (modifier, 
         // code) and sends them via HID
@@ -413,6 +645,29 @@ void serialEvent() {
         // Update a pin to trigger some keystrokes
         BleMacroKeyboard.readSerialPinConfigUpdate();
         break;        
+      case 'k':
+        // Bind a chord, or a pin on a layer, to an input's keystrokes: 
+        // layer input pin [pin...];
+        BleMacroKeyboard.readSerialBindingUpdate(false);
+        break;
+      case 'K':
+        // Make a pin a layer key: pin layer;
+        BleMacroKeyboard.readSerialBindingUpdate(true);
+        break;
+      case 'g':
+        // Give an input a gesture: input gesture action [param];
+        BleMacroKeyboard.readSerialGestureUpdate();
+        break;
+      case 'y':
+        // Host keyboard layout for typing text: layout; 0 US, 1 UK, 2 DE, 3 FR
+        BleMacroKeyboard.readSerialLayoutUpdate();
+        break;
+      case 'L':
+        // Macro library: Ll list, Lp id; play, Ld id; delete,
+        // Lw id name keystrokes...; or Lt id name text; to save,
+        // Lc compile the library into the flash image, Li image info
+        BleMacroKeyboard.readSerialMacroLibraryCommand();
+        break;
       case '\n':
       case '\r':
       case ' ':
@@ -437,28 +692,58 @@ void serialEvent() {
         break;   
       }
       case 'r': {
-        String toSend = Serial.readStringUntil(';');
-        int rc = GVM.broadcast_udp(toSend.c_str(), toSend.length());
-        Serial.printf("Send %d '%s' %d\n", toSend.length(), toSend.c_str(), rc);
+        int len = serialTimedReadUntil(';', hexIn, sizeof(hexIn) - 1);
+        if (len < 0) {
+          Serial.println("Invalid light message");
+          break;
+        }
+        hexIn[len] = '\0';
+        int rc = GVM.broadcast_udp(hexIn, len);
+        Serial.printf("Send %d '%s' %d\n", len, hexIn, rc);
         break;   
       }
       case 'R': {
-        String toSend = Serial.readStringUntil(';');
-        Serial.printf("Send with CRC length %d\n", toSend.length());
-        unsigned short crc = calcCrcFromHexStr(toSend.c_str(), toSend.length());
-        char crc_str[5];
-        shortToHex(crc, crc_str);
-        crc_str[4] = '\0';
-        toSend += crc_str;
-        int rc = GVM.broadcast_udp(toSend.c_str(), toSend.length());
-        Serial.printf("Send %d '%s' %d\n", toSend.length(), toSend.c_str(), rc);
+        // Hex bytes in, CRC added to the binary packet, hex out
+        int len = serialTimedReadUntil(';', hexIn, sizeof(hexIn) - 1);
+        if (len < 0) {
+          Serial.println("Invalid light message");
+          break;
+        }
+        Serial.printf("Send with CRC length %d\n", len);
+        packet.clear();
+        if (!packet.appendHex(hexIn, len)) {
+          Serial.println("Invalid hex");
+          break;
+        }
+        packet.appendCrc();
+        len = packet.ok() ? packet.toHex(hexOut, sizeof(hexOut)) : 0;
+        if (!len) {
+          Serial.println("Light message too long");
+          break;
+        }
+        int rc = GVM.broadcast_udp(hexOut, len);
+        Serial.printf("Send %d '%s' %d\n", len, hexOut, rc);
         break;   
       }      
       case 'c': {
-        String toCalc = Serial.readStringUntil(';');
-        Serial.printf("Calc %d %s %d\n", toCalc.length(), toCalc.c_str(), calcCrcFromHexStr(toCalc.c_str(), toCalc.length()));
+        int len = serialTimedReadUntil(';', hexIn, sizeof(hexIn) - 1);
+        if (len < 0) {
+          Serial.println("Invalid light message");
+          break;
+        }
+        hexIn[len] = '\0';
+        packet.clear();
+        packet.appendHex(hexIn, len);
+        // The table CRC should always agree with the light library's
+        Serial.printf("Calc %d %s %d table %d\n", len, hexIn, calcCrcFromHexStr(hexIn, len),
+                      packet.ok() ? crc16Xmodem(packet.data(), packet.length()) : -1);
         break;   
       }      
+      case 'C': {
+        // Time building light packets the old String way and with LightPacket
+        benchmark_light_packets();
+        break;
+      }
       case 'X': {
         Serial.println("Restarting");
         ESP.restart();
@@ -467,10 +752,69 @@ void serialEvent() {
         Serial.printf("Battery on is %d\n", battery_power());
         break;
       }
+      case 'i': {
+        // BLE stack, heap and image size
+        dump_stack_info();
+        break;
+      }
+      case 'h': {
+        // Heap allocation count, should stay still while typing and redrawing
+        printHeapStats();
+        break;
+      }
+      case 'M': {
+        // Report and edge counters, loop timing, heap and task stacks
+        metricsPrint();
+        break;
+      }
+      case 't':
+        // Stages of loop() or the BLE task that ran over budget
+        stallPrint();
+        break;
+      case 'T':
+        // Stall budget: ms; 0 for the default
+        BleMacroKeyboard.readSerialStallBudgetUpdate();
+        break;
+      case 'P':
+        // Sampling profiler: Ps <hundreds of Hz>; starts, Px stops,
+        // Pd dumps for tools/profile_trace.py
+        readProfilerCommandFromSerial();
+        break;
+      case 'H':
+        // Host profiles: Hl list, Ha profile name; for the connected host,
+        // Hy profile layout;, Hc profile 0|1; swaps Ctrl and GUI,
+        // Hm profile 0|1; for a Mac's Caps Lock, Hr profile input from;
+        // remaps an input, Hd profile; deletes, Hs profile; switches host
+        BleMacroKeyboard.readSerialHostProfileCommand();
+        break;
+      case 'I':
+        // Pin traces: Ir records, Ip replays, Ix stops, Id dumps, Ii info,
+        // Ic clears, Iw hex; uploads, see tools/pin_trace.py
+        readPinTraceCommandFromSerial();
+        break;
+      case 'D':
+        // Typing rate for the connected host: Dc calibrates from its
+        // Caps Lock echo, Ds ms; sets the gap between reports, Dp prints
+        BleMacroKeyboard.readSerialTypingRateCommand();
+        break;
+      case 'W':
+        // Worst case timing of the console parsers against hostile input
+        consoleWcetRun();
+        break;
+      case 'U':
+        // Console UART rate, buffers and lost bytes
+#ifdef CONSOLE_UART_IDF
+        Console.printStats();
+#else
+        Serial.printf("Console on Arduino Serial at %d baud\n", CONSOLE_BAUD);
+#endif
+        break;
       default:
         Serial.print(F("Unknown command '"));
         Serial.print(inChar);
         Serial.println("'");
     }
+    serialCommandEnd();
+    profileEnd(SPAN_SERIAL);
   }
 }
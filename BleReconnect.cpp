@@ -0,0 +1,225 @@
+/* Reconnect policy for the BLE keyboard
+ *
+ * After a disconnect a host that has just woken from sleep wants to find
+ * us as quickly as possible. If we know which bonded host we were last
+ * connected to we first do a short burst of directed advertising at it
+ * (high duty cycle on Bluedroid, where the host connects within a few ms
+ * of waking, low duty cycle on NimBLE), then fall back to fast undirected
+ * advertising for any other bonded host and finally slow undirected
+ * advertising to save power. */
+
+#include <Arduino.h>
+#include <freertos/timers.h>
+#include <freertos/semphr.h>
+#include "BleReconnect.h"
+
+static const char *LOG_TAG = "blereconnect";
+
+static reconnect_policy_t policy = {
+  RECONNECT_DIRECTED_MAX_MILLIS,
+  30000,
+  ADV_INTERVAL_MS(20), ADV_INTERVAL_MS(30),
+  ADV_INTERVAL_MS(500), ADV_INTERVAL_MS(1000)
+};
+
+static ble_peer_t bondedPeers[BLE_MAX_BONDED_PEERS];
+static int bondedPeerCount = 0;
+static int lastPeerIdx = -1;
+
+static volatile reconnect_phase_t phase = RECONNECT_IDLE;
+static TimerHandle_t phaseTimer = NULL;
+
+/* The phase timer runs on the timer task and connects arrive on the BLE
+ * task. Every phase change happens holding phaseLock, and each one moves
+ * the generation on so a timer that expired just before a connect or a
+ * restart sees it's stale rather than advertising again. The bond cache
+ * and last peer are also only touched holding it, the console switches
+ * hosts from its own task */
+static SemaphoreHandle_t phaseLock = NULL;
+static uint32_t phaseGeneration = 0;
+
+static void enterPhase(reconnect_phase_t newPhase);
+
+/* Called holding phaseLock */
+static int findBondedPeer(const ble_peer_t *peer) {
+  for (int i = 0; i < bondedPeerCount; i++)
+    if (!memcmp(bondedPeers[i].val, peer->val, BLE_ADDR_LEN))
+      return i;
+  return -1;
+}
+
+/* Nothing else runs before bleReconnectInit() creates the lock */
+static void lockPhase() {
+  if (phaseLock)
+    xSemaphoreTake(phaseLock, portMAX_DELAY);
+}
+
+static void unlockPhase() {
+  if (phaseLock)
+    xSemaphoreGive(phaseLock);
+}
+
+/* Called holding phaseLock */
+static void stopPhaseTimer() {
+  phaseGeneration++;
+  xTimerStop(phaseTimer, 0);
+}
+
+static void onPhaseTimer(TimerHandle_t timer) {
+  lockPhase();
+  if ((uintptr_t) pvTimerGetTimerID(timer) == phaseGeneration) {
+    if (phase == RECONNECT_DIRECTED)
+      enterPhase(policy.fastMillis ? RECONNECT_FAST : RECONNECT_SLOW);
+    else if (phase == RECONNECT_FAST)
+      enterPhase(RECONNECT_SLOW);
+  }
+  unlockPhase();
+}
+
+static void startPhaseTimer(uint32_t millis) {
+  vTimerSetTimerID(phaseTimer, (void *) (uintptr_t) phaseGeneration);
+  xTimerChangePeriod(phaseTimer, pdMS_TO_TICKS(millis) ? pdMS_TO_TICKS(millis) : 1, 0);
+  xTimerStart(phaseTimer, 0);
+}
+
+/* Called holding phaseLock */
+static void enterPhase(reconnect_phase_t newPhase) {
+  BleHidBackend *backend = bleHidBackend();
+
+  // Stopping when we aren't advertising is harmless
+  backend->stopAdvertising();
+  phase = newPhase;
+  phaseGeneration++;
+
+  bool rc = false;
+  switch (newPhase) {
+    case RECONNECT_DIRECTED:
+      rc = backend->startAdvertising(ADV_INTERVAL_MS(20), ADV_INTERVAL_MS(20), &bondedPeers[lastPeerIdx]);
+      startPhaseTimer(MIN(policy.directedMillis, RECONNECT_DIRECTED_MAX_MILLIS));
+      break;
+    case RECONNECT_FAST:
+      rc = backend->startAdvertising(policy.fastIntervalMin, policy.fastIntervalMax, NULL);
+      startPhaseTimer(policy.fastMillis);
+      break;
+    case RECONNECT_SLOW:
+      rc = backend->startAdvertising(policy.slowIntervalMin, policy.slowIntervalMax, NULL);
+      break;
+    default:
+      break;
+  }
+
+  ESP_LOGI(LOG_TAG, "Reconnect phase %d, advertising started %d", newPhase, rc);
+}
+
+void bleReconnectInit() {
+  if (!phaseLock)
+    phaseLock = xSemaphoreCreateMutex();
+  if (!phaseTimer)
+    phaseTimer = xTimerCreate("reconnect", 1, pdFALSE, NULL, onPhaseTimer);
+  bleReconnectRefreshBonds();
+}
+
+void bleReconnectRefreshBonds() {
+  ble_peer_t peers[BLE_MAX_BONDED_PEERS];
+  ble_peer_t lastPeer;
+
+  // Read from the stack outside the lock, only the copy is under it
+  int count = bleHidBackend()->getBondedPeers(peers, BLE_MAX_BONDED_PEERS);
+
+  lockPhase();
+  bool haveLastPeer = lastPeerIdx >= 0;
+  if (haveLastPeer)
+    lastPeer = bondedPeers[lastPeerIdx];
+
+  memcpy(bondedPeers, peers, count * sizeof(ble_peer_t));
+  bondedPeerCount = count;
+
+  lastPeerIdx = haveLastPeer ? findBondedPeer(&lastPeer) : -1;
+  ESP_LOGD(LOG_TAG, "Bond cache has %d peers, last peer index %d", bondedPeerCount, lastPeerIdx);
+  unlockPhase();
+}
+
+void bleReconnectSetPolicy(const reconnect_policy_t *newPolicy) {
+  policy = *newPolicy;
+}
+
+void bleReconnectGetPolicy(reconnect_policy_t *out) {
+  *out = policy;
+}
+
+void bleReconnectOnConnect(const ble_peer_t *peer) {
+  if (phaseTimer) {
+    lockPhase();
+    stopPhaseTimer();
+    // The controller stops advertising when the connection is made, but
+    // a phase timer that expired just before may have started it again
+    if (phase != RECONNECT_IDLE)
+      bleHidBackend()->stopAdvertising();
+    phase = RECONNECT_IDLE;
+    unlockPhase();
+  }
+
+  lockPhase();
+  int idx = findBondedPeer(peer);
+  if (idx >= 0)
+    lastPeerIdx = idx;
+  unlockPhase();
+}
+
+/* Make a bonded host the one directed advertising goes to next, for
+ * switching hosts. False if it isn't bonded */
+bool bleReconnectSetTarget(const ble_peer_t *peer) {
+  lockPhase();
+  int idx = findBondedPeer(peer);
+  if (idx >= 0)
+    lastPeerIdx = idx;
+  unlockPhase();
+  return idx >= 0;
+}
+
+void bleReconnectStart(bool allowDirected) {
+  if (!phaseTimer)
+    return;
+
+  lockPhase();
+  stopPhaseTimer();
+  if (allowDirected && lastPeerIdx >= 0 && policy.directedMillis)
+    enterPhase(RECONNECT_DIRECTED);
+  else if (policy.fastMillis)
+    enterPhase(RECONNECT_FAST);
+  else
+    enterPhase(RECONNECT_SLOW);
+  unlockPhase();
+}
+
+void bleReconnectStop() {
+  if (!phaseTimer)
+    return;
+
+  lockPhase();
+  stopPhaseTimer();
+  // The controller stops advertising by itself when a connection is made
+  phase = RECONNECT_IDLE;
+  unlockPhase();
+}
+
+reconnect_phase_t bleReconnectPhase() {
+  return phase;
+}
+
+int bleReconnectBondedPeers(ble_peer_t *out, int max) {
+  lockPhase();
+  int count = MIN(max, bondedPeerCount);
+  memcpy(out, bondedPeers, count * sizeof(ble_peer_t));
+  unlockPhase();
+  return count;
+}
+
+bool bleReconnectLastPeer(ble_peer_t *out) {
+  lockPhase();
+  bool found = lastPeerIdx >= 0;
+  if (found)
+    *out = bondedPeers[lastPeerIdx];
+  unlockPhase();
+  return found;
+}
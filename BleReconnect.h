@@ -0,0 +1,49 @@
+#ifndef BleReconnect_h
+#define BleReconnect_h
+
+#include "BleHidBackend.h"
+
+#ifndef BLE_MAX_BONDED_PEERS
+#define BLE_MAX_BONDED_PEERS 20
+#endif
+
+#ifndef MIN
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+/* Advertising intervals are in units of 0.625ms */
+#define ADV_INTERVAL_MS(ms) ((uint16_t) (((ms) * 1000) / 625))
+
+/* High duty cycle directed advertising is limited to 1.28s by the
+ * Bluetooth spec, the controller stops it by itself after that */
+#define RECONNECT_DIRECTED_MAX_MILLIS 1280
+
+typedef struct {
+  uint32_t directedMillis;     // Directed burst at the last host, 0 to skip
+  uint32_t fastMillis;         // Fast undirected advertising, 0 to skip
+  uint16_t fastIntervalMin;    // Fast advertising interval (0.625ms units)
+  uint16_t fastIntervalMax;
+  uint16_t slowIntervalMin;    // Slow advertising interval (0.625ms units), runs until connected
+  uint16_t slowIntervalMax;
+} reconnect_policy_t;
+
+typedef enum {
+  RECONNECT_IDLE = 0,
+  RECONNECT_DIRECTED,
+  RECONNECT_FAST,
+  RECONNECT_SLOW
+} reconnect_phase_t;
+
+void bleReconnectInit();
+void bleReconnectRefreshBonds();
+void bleReconnectSetPolicy(const reconnect_policy_t *policy);
+void bleReconnectGetPolicy(reconnect_policy_t *policy);
+void bleReconnectOnConnect(const ble_peer_t *peer);
+bool bleReconnectSetTarget(const ble_peer_t *peer);
+void bleReconnectStart(bool allowDirected);
+void bleReconnectStop();
+reconnect_phase_t bleReconnectPhase();
+int bleReconnectBondedPeers(ble_peer_t *out, int max);
+bool bleReconnectLastPeer(ble_peer_t *out);
+
+#endif
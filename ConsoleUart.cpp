@@ -0,0 +1,241 @@
+#include <Arduino.h>
+#include "ConsoleUart.h"
+
+#ifdef CONSOLE_UART_IDF
+
+#include <string.h>
+#include <sys/param.h>
+#include <esp_vfs_dev.h>
+#include <soc/uart_reg.h>
+#include <freertos/task.h>
+#include "Metrics.h"
+#include "StallDetector.h"
+
+ConsoleUart Console;
+
+ConsoleUart::ConsoleUart() : peeked(-1), installed(false), events(NULL), mutex(NULL), handler(NULL) {
+  memset(&stats, 0, sizeof(stats));
+}
+
+bool ConsoleUart::begin(unsigned long baud) {
+  if (baud > CONSOLE_BAUD_MAX)
+    return false;
+
+  if (installed) {
+    // Let what's queued go out at the rate the other end expects
+    uart_wait_tx_done(CONSOLE_UART, portMAX_DELAY);
+    return uart_set_baudrate(CONSOLE_UART, baud) == ESP_OK;
+  }
+
+  uart_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.baud_rate = baud;
+  config.data_bits = UART_DATA_8_BITS;
+  config.parity = UART_PARITY_DISABLE;
+  config.stop_bits = UART_STOP_BITS_1;
+  config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+
+  if (uart_param_config(CONSOLE_UART, &config) != ESP_OK ||
+      uart_set_pin(CONSOLE_UART, CONSOLE_TX_PIN, CONSOLE_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK ||
+      uart_driver_install(CONSOLE_UART, CONSOLE_RX_BUFFER, CONSOLE_TX_BUFFER, CONSOLE_EVENT_QUEUE, &events, 0) != ESP_OK)
+    return false;
+
+  // The driver hands bytes over when the FIFO is nearly full, which at
+  // 2 Mbaud leaves too little time before it overflows
+  uart_intr_config_t intr;
+  memset(&intr, 0, sizeof(intr));
+  intr.intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_TOUT_INT_ENA_M;
+  intr.rxfifo_full_thresh = CONSOLE_RX_FIFO_FULL;
+  intr.rx_timeout_thresh = CONSOLE_RX_TIMEOUT;
+  intr.txfifo_empty_intr_thresh = 10;
+  uart_intr_config(CONSOLE_UART, &intr);
+
+  uart_enable_pattern_det_baud_intr(CONSOLE_UART, CONSOLE_PATTERN, 1, 9, 0, 0);
+  uart_pattern_queue_reset(CONSOLE_UART, CONSOLE_PATTERN_QUEUE);
+
+  // printf and IDF logging would otherwise write the FIFO directly and
+  // land in the middle of whatever the ring buffer is sending
+  esp_vfs_dev_uart_use_driver(CONSOLE_UART);
+
+  mutex = xSemaphoreCreateMutex();
+  installed = true;
+  return true;
+}
+
+int ConsoleUart::available() {
+  size_t len = 0;
+
+  if (!installed)
+    return 0;
+  uart_get_buffered_data_len(CONSOLE_UART, &len);
+  return len + (peeked >= 0);
+}
+
+int ConsoleUart::peek() {
+  uint8_t c;
+
+  if (peeked < 0 && installed && uart_read_bytes(CONSOLE_UART, &c, 1, 0) == 1)
+    peeked = c;
+  return peeked;
+}
+
+int ConsoleUart::read() {
+  int c = peek();
+  peeked = -1;
+  return c;
+}
+
+bool ConsoleUart::waitAvailable(unsigned long ms) {
+  uint8_t c;
+
+  if (peeked >= 0)
+    return true;
+  if (!installed)
+    return false;
+
+  // Round up, a wait shorter than a tick would otherwise spin
+  TickType_t ticks = (ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;
+  if (uart_read_bytes(CONSOLE_UART, &c, 1, ticks) != 1)
+    return false;
+  peeked = c;
+  return true;
+}
+
+/* Each byte gets the Stream timeout, as Arduino's timed reads do */
+int ConsoleUart::timedRead() {
+  if (!waitAvailable(_timeout))
+    return -1;
+  return read();
+}
+
+size_t ConsoleUart::readBytes(char *buffer, size_t length) {
+  size_t count = 0;
+  int c;
+
+  while (count < length && (c = timedRead()) >= 0)
+    buffer[count++] = c;
+  return count;
+}
+
+size_t ConsoleUart::readBytesUntil(char terminator, char *buffer, size_t length) {
+  size_t count = 0;
+  int c;
+
+  while (count < length && (c = timedRead()) >= 0 && c != terminator)
+    buffer[count++] = c;
+  return count;
+}
+
+size_t ConsoleUart::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+/* Copies into the TX ring and returns, only waiting when it's full */
+size_t ConsoleUart::write(const uint8_t *buffer, size_t size) {
+  if (!installed)
+    return 0;
+  int written = uart_write_bytes(CONSOLE_UART, (const char *) buffer, size);
+  return written < 0 ? 0 : written;
+}
+
+void ConsoleUart::flush() {
+  if (installed)
+    uart_wait_tx_done(CONSOLE_UART, portMAX_DELAY);
+}
+
+void ConsoleUart::lock() {
+  if (mutex)
+    xSemaphoreTake(mutex, portMAX_DELAY);
+}
+
+void ConsoleUart::unlock() {
+  if (mutex)
+    xSemaphoreGive(mutex);
+}
+
+void ConsoleUart::task(void *arg) {
+  ConsoleUart *console = (ConsoleUart *) arg;
+  uart_event_t event;
+
+  // Commands are stalls and stack use of their own, not loop()'s or the
+  // BLE task's
+  stallStage(STALL_TASK_CONSOLE, STAGE_IDLE);
+  metricsSetTask(METRIC_TASK_CONSOLE, NULL);
+
+  while (true) {
+    if (xQueueReceive(console->events, &event, portMAX_DELAY) != pdTRUE)
+      continue;
+
+    switch (event.type) {
+      case UART_PATTERN_DET:
+        // Only the wake matters, not where the ';' was
+        uart_pattern_pop_pos(CONSOLE_UART);
+        console->stats.patterns++;
+        break;
+      case UART_FIFO_OVF:
+        console->stats.fifoOverflows++;
+        break;
+      case UART_FRAME_ERR:
+        console->stats.frameErrors++;
+        break;
+      case UART_BUFFER_FULL:
+        // Reading makes room and the driver moves the held bytes over
+        console->stats.bufferFull++;
+        break;
+      default:
+        break;
+    }
+
+    // Events for bytes an earlier command already read wake for nothing
+    uint32_t waiting = console->available();
+    if (!waiting)
+      continue;
+    console->stats.wakes++;
+    console->stats.rxPeak = MAX(console->stats.rxPeak, waiting);
+
+    // Each command reads the bytes it needs, anything left is the next
+    // one. loop() gets a turn between commands so a stream of them can't
+    // keep it from the keys
+    while (console->available()) {
+      console->lock();
+      stallStage(STALL_TASK_CONSOLE, STAGE_SERIAL);
+      console->handler();
+      stallStage(STALL_TASK_CONSOLE, STAGE_IDLE);
+      console->unlock();
+      taskYIELD();
+    }
+  }
+}
+
+bool ConsoleUart::startTask(void (*commandHandler)()) {
+  if (!installed || handler)
+    return false;
+
+  handler = commandHandler;
+  if (xTaskCreatePinnedToCore(task, "console", CONSOLE_TASK_STACK, this, CONSOLE_TASK_PRIORITY,
+                              NULL, xPortGetCoreID()) != pdPASS) {
+    handler = NULL;
+    return false;
+  }
+  return true;
+}
+
+void ConsoleUart::printStats() {
+  uint32_t baud = 0;
+  size_t rx = 0;
+
+  uart_get_baudrate(CONSOLE_UART, &baud);
+  uart_get_buffered_data_len(CONSOLE_UART, &rx);
+
+  Serial.printf("Console %u baud, %u of %d RX bytes waiting, %d byte TX buffer\n",
+                baud, rx, CONSOLE_RX_BUFFER, CONSOLE_TX_BUFFER);
+  Serial.printf("Wakes %u, ';' %u, most waiting %u\n", stats.wakes, stats.patterns, stats.rxPeak);
+  Serial.printf("FIFO overflows %u, frame errors %u, RX buffer full %u\n",
+                stats.fifoOverflows, stats.frameErrors, stats.bufferFull);
+}
+
+bool consoleUartWait(unsigned long ms) {
+  return Console.waitAvailable(ms);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef ConsoleUart_h
+#define ConsoleUart_h
+
+#include <Arduino.h>
+
+/* Console on the ESP-IDF UART driver
+ *
+ * Arduino's Serial writes straight into the 128 byte hardware FIFO and
+ * spins while it's full, and the parsers poll it a byte at a time. With
+ * CONSOLE_UART_IDF (set by idf_build) the console is instead a Stream
+ * over the IDF driver: bytes in and out go through large ring buffers
+ * filled and drained by the UART interrupt, a print only waits when the
+ * TX ring is full, and a timed read blocks in the driver rather than
+ * spinning on available().
+ *
+ * The driver's event queue wakes a console task when bytes arrive or a
+ * ';' (the end of most commands) is seen, and the task runs the command
+ * handler while holding the console lock. loop() holds the same lock
+ * for everything but its wait for light messages, so commands still
+ * never run alongside loop().
+ *
+ * The build force includes this header and sets NO_GLOBAL_SERIAL, so
+ * Serial everywhere is this console, and printf and IDF logging are
+ * moved onto the driver too. Arduino IDE builds keep HardwareSerial */
+
+// Up to 2000000, both ends need the same rate
+#ifndef CONSOLE_BAUD
+#define CONSOLE_BAUD            115200
+#endif
+#define CONSOLE_BAUD_MAX        2000000
+
+#ifdef CONSOLE_UART_IDF
+
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#define CONSOLE_UART            UART_NUM_0
+#define CONSOLE_TX_PIN          1
+#define CONSOLE_RX_PIN          3
+#ifndef CONSOLE_RX_BUFFER
+#define CONSOLE_RX_BUFFER       8192    // A bulk config upload without waiting on the parser
+#endif
+#ifndef CONSOLE_TX_BUFFER
+#define CONSOLE_TX_BUFFER       4096
+#endif
+#define CONSOLE_EVENT_QUEUE     16
+#define CONSOLE_PATTERN         ';'
+#define CONSOLE_PATTERN_QUEUE   16
+#define CONSOLE_RX_FIFO_FULL    64      // Half the FIFO, room for interrupt latency at 2 Mbaud
+#define CONSOLE_RX_TIMEOUT      10      // Symbols idle before a short command is handed over
+#define CONSOLE_TASK_STACK      8192
+#define CONSOLE_TASK_PRIORITY   1       // The same as loop()
+
+typedef struct {
+  uint32_t wakes;
+  uint32_t patterns;            // ';' seen
+  uint32_t fifoOverflows;       // Bytes lost before the interrupt ran
+  uint32_t frameErrors;         // Usually the two ends at different rates
+  uint32_t bufferFull;          // RX ring full, the driver held bytes in the FIFO
+  uint32_t rxPeak;              // Most bytes waiting at a wake
+} console_uart_stats_t;
+
+class ConsoleUart : public Stream {
+  public:
+    ConsoleUart();
+
+    /* Installs the driver, or just changes the rate once it is */
+    bool begin(unsigned long baud = CONSOLE_BAUD);
+
+    int available();
+    int peek();
+    int read();
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    void flush();
+
+    /* Blocks in the driver until a byte arrives, false after ms */
+    bool waitAvailable(unsigned long ms);
+
+    /* Stream's timed reads poll read() until the timeout, these wait in
+     * waitAvailable() instead */
+    size_t readBytes(char *buffer, size_t length);
+    using Stream::readBytes;
+    size_t readBytesUntil(char terminator, char *buffer, size_t length);
+
+    /* Runs handler on the console task whenever bytes are waiting */
+    bool startTask(void (*handler)());
+    void lock();
+    void unlock();
+
+    void printStats();
+
+  private:
+    static void task(void *arg);
+    int timedRead();
+
+    int peeked;
+    bool installed;
+    QueueHandle_t events;
+    SemaphoreHandle_t mutex;
+    void (*handler)();
+    console_uart_stats_t stats;
+};
+
+extern ConsoleUart Console;
+
+/* serialWait for the timed reads (SerialUtil.h) */
+bool consoleUartWait(unsigned long ms);
+
+#define Serial Console
+
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+#include <Arduino.h>
+#include <sys/param.h>
+#include "SerialUtil.h"
+#include "eeprom_config.h"
+#include "ConsoleWcet.h"
+
+// How long after the byte before each byte arrives
+#define GAP_LINE      0     // Back to back at 115200 baud
+#define GAP_TYPED     1     // Someone typing
+#define GAP_JUST_IN   2     // Just inside the per read timeout
+#define GAP_LATE      3     // Just past it
+
+static const uint32_t gapMicros[] = {
+  87, 10000, (SERIAL_TIMEOUT_MS - 50) * 1000UL, (SERIAL_TIMEOUT_MS + 100) * 1000UL
+};
+
+static uint32_t fakeMicros;
+static unsigned long budgetMillis;     // Longest a single command budget was in use
+static uint8_t *bytes = NULL;
+static uint8_t *gaps = NULL;
+
+/* Bytes arrive at their scripted times on the fake clock, and the clock
+ * only moves while the parser is waiting for one */
+class ScriptedStream : public Stream {
+  public:
+    void start(uint16_t len) {
+      length = len;
+      pos = 0;
+      nextArrival = fakeMicros + (len ? gapMicros[gaps[0]] : 0);
+    }
+
+    int available() {
+      return pos < length && (int32_t) (fakeMicros - nextArrival) >= 0;
+    }
+
+    int peek() {
+      return available() ? bytes[pos] : -1;
+    }
+
+    int read() {
+      if (!available())
+        return -1;
+      uint8_t c = bytes[pos++];
+      if (pos < length)
+        nextArrival += gapMicros[gaps[pos]];
+      return c;
+    }
+
+    size_t write(uint8_t c) {
+      return 1;
+    }
+
+    void flush() {
+    }
+
+    /* How far to move the clock for a parser that's waiting */
+    uint32_t waitMicros() {
+      if (pos >= length)
+        return 1000;
+      return (int32_t) (nextArrival - fakeMicros) > 0 ? MIN(nextArrival - fakeMicros, 1000) : 0;
+    }
+
+    uint16_t consumed() {
+      return pos;
+    }
+
+  private:
+    uint16_t length;
+    uint16_t pos;
+    uint32_t nextArrival;
+};
+
+static ScriptedStream stream;
+
+static unsigned long fakeMillis() {
+  fakeMicros += stream.waitMicros();
+  unsigned long now = fakeMicros / 1000;
+  budgetMillis = MAX(budgetMillis, now - serialCommandStartMillis());
+  return now;
+}
+
+static uint16_t putText(uint16_t at, const char *text, uint8_t gap) {
+  for (; *text && at < WCET_STREAM_BYTES; text++, at++) {
+    bytes[at] = *text;
+    gaps[at] = gap;
+  }
+  return at;
+}
+
+static uint16_t putRepeat(uint16_t at, const char *text, uint16_t end, uint8_t gap) {
+  while (at + strlen(text) <= end)
+    at = putText(at, text, gap);
+  return at;
+}
+
+static uint16_t fillValid() {
+  return putText(0, "2 00 04 02 05 00 06;", GAP_LINE);
+}
+
+static uint16_t fillTyped() {
+  return putText(0, "2 00 04 02 05 00 06;", GAP_TYPED);
+}
+
+static uint16_t fillSpaceFlood() {
+  return putRepeat(0, " ", WCET_STREAM_BYTES, GAP_LINE);
+}
+
+static uint16_t fillSpaceTrickle() {
+  return putRepeat(0, " ", WCET_STREAM_BYTES, GAP_JUST_IN);
+}
+
+static uint16_t fillDigitTrickle() {
+  return putRepeat(putText(0, "2 ", GAP_LINE), "0", WCET_STREAM_BYTES, GAP_JUST_IN);
+}
+
+static uint16_t fillNoTerminator() {
+  return putText(0, "2 00 04 00 05 00 06", GAP_LINE);
+}
+
+static uint16_t fillLateTerminator() {
+  return putText(putText(0, "2 00 04 00 05 00 06", GAP_LINE), ";", GAP_LATE);
+}
+
+static uint16_t fillBadByte() {
+  return putText(0, "2 zz;", GAP_LINE);
+}
+
+static uint16_t fillManyKeys() {
+  uint16_t at = putRepeat(putText(0, "2", GAP_LINE), " 00 04", WCET_STREAM_BYTES - 1, GAP_LINE);
+  return putText(at, ";", GAP_LINE);
+}
+
+static uint16_t fillSlowKeys() {
+  uint16_t at = putRepeat(putText(0, "2", GAP_LINE), " 00 04", WCET_STREAM_BYTES - 1, GAP_TYPED);
+  return putText(at, ";", GAP_TYPED);
+}
+
+static const struct {
+  const char *name;
+  uint16_t (*fill)();
+} streams[] = {
+  { "valid", fillValid },
+  { "typed", fillTyped },
+  { "space flood", fillSpaceFlood },
+  { "space trickle", fillSpaceTrickle },
+  { "digit trickle", fillDigitTrickle },
+  { "no terminator", fillNoTerminator },
+  { "late terminator", fillLateTerminator },
+  { "bad byte", fillBadByte },
+  { "many keys", fillManyKeys },
+  { "slow keys", fillSlowKeys },
+};
+
+static uint32_t nextRandom(uint32_t *seed) {
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+/* Mostly bytes the parsers take, mostly back to back */
+static uint16_t fillFuzz(uint32_t *seed) {
+  static const char alphabet[] = "0123456789abcdefAFxz ;\t\n-";
+  uint16_t len = 1 + nextRandom(seed) % WCET_FUZZ_MAX_BYTES;
+
+  for (uint16_t i = 0; i < len; i++) {
+    uint32_t r = nextRandom(seed);
+    bytes[i] = alphabet[r % (sizeof(alphabet) - 1)];
+    r = (r >> 16) % 8;
+    gaps[i] = r < 5 ? GAP_LINE : r - 4;
+  }
+  return len;
+}
+
+static int parseNum() {
+  uint8_t value;
+  char terminator;
+  return serialTimedReadNum(&value, &terminator, true);
+}
+
+static void ignoreKey(uint8_t modifier, uint8_t key, uint8_t key2) {
+}
+
+static int parseKeys() {
+  return readSerialKeysAndCallback(ignoreKey);
+}
+
+static int parsePinConfig() {
+  uint8_t pin, keys[MAX_KEYSTROKES - 1][2];
+  return readPinConfigFromSerial(&pin, keys);
+}
+
+/* The light message, host name and pin trace chunk reads */
+static int parseUntil() {
+  char buffer[64];
+  return serialTimedReadUntil(';', buffer, sizeof(buffer));
+}
+
+typedef struct {
+  const char *name;
+  int (*parse)();
+  uint32_t heldMicros;          // Longest one call held loop() on the fake clock
+  uint32_t budgetMillis;        // Longest one budget lasted, less than held for uploads
+  const char *heldStream;
+  uint32_t byteMicros;          // Longest held per byte read
+  uint32_t realMicros;          // Longest one call actually took here
+} wcet_parser_t;
+
+static void runStream(wcet_parser_t *parser, const char *name, uint16_t len) {
+  fakeMicros = 0;
+  stream.start(len);
+  serialCommandBegin();
+  budgetMillis = 0;
+
+  uint32_t realStart = micros();
+  parser->parse();
+  uint32_t real = micros() - realStart;
+
+  uint32_t perByte = fakeMicros / MAX(stream.consumed(), 1);
+  if (fakeMicros > parser->heldMicros) {
+    parser->heldMicros = fakeMicros;
+    parser->heldStream = name;
+  }
+  parser->budgetMillis = MAX(parser->budgetMillis, budgetMillis);
+  parser->byteMicros = MAX(parser->byteMicros, perByte);
+  parser->realMicros = MAX(parser->realMicros, real);
+}
+
+int consoleWcetRun() {
+  wcet_parser_t parsers[] = {
+    { "readNum", parseNum, 0, 0, "", 0, 0 },
+    { "readUntil", parseUntil, 0, 0, "", 0, 0 },
+    { "keys", parseKeys, 0, 0, "", 0, 0 },
+    { "pinConfig", parsePinConfig, 0, 0, "", 0, 0 },
+  };
+
+  bytes = (uint8_t *) malloc(WCET_STREAM_BYTES);
+  gaps = (uint8_t *) malloc(WCET_STREAM_BYTES);
+  if (!bytes || !gaps) {
+    Serial.println("No memory for the parser harness");
+    free(bytes);
+    free(gaps);
+    return -1;
+  }
+
+  bool (*wait)(unsigned long ms) = serialWait;
+  serialInput = &stream;
+  serialMillis = fakeMillis;
+  serialWait = NULL;
+  for (wcet_parser_t &parser : parsers) {
+    for (size_t s = 0; s < sizeof(streams) / sizeof(streams[0]); s++)
+      runStream(&parser, streams[s].name, streams[s].fill());
+
+    uint32_t seed = WCET_SEED;
+    for (int f = 0; f < WCET_FUZZ_STREAMS; f++)
+      runStream(&parser, "fuzz", fillFuzz(&seed));
+  }
+  serialInput = &Serial;
+  serialMillis = millis;
+  serialWait = wait;
+  // Nothing the harness ran out of time on is this command's
+  serialCommandBegin();
+
+  free(bytes);
+  free(gaps);
+  bytes = gaps = NULL;
+
+  // One 1ms tick past the budget is the clock's resolution
+  int over = 0;
+  Serial.printf("%-10s %8s %9s %8s %8s  %s\n", "parser", "held ms", "budget ms", "us/byte", "real us",
+                "worst stream");
+  for (wcet_parser_t &parser : parsers) {
+    bool ok = parser.budgetMillis <= SERIAL_COMMAND_BUDGET_MS + 1;
+    over += !ok;
+    Serial.printf("%-10s %8u %9u %8u %8u  %s%s\n", parser.name, parser.heldMicros / 1000, parser.budgetMillis,
+                  parser.byteMicros, parser.realMicros, parser.heldStream, ok ? "" : ", OVER BUDGET");
+  }
+  Serial.printf("Budget %d ms, %d over\n", SERIAL_COMMAND_BUDGET_MS, over);
+  return over;
+}
@@ -0,0 +1,29 @@
+#ifndef ConsoleWcet_h
+#define ConsoleWcet_h
+
+#include <stdint.h>
+
+/* Worst case timing harness for the console parsers
+ *
+ * serialTimedReadNum(), serialTimedReadUntil(), readSerialKeysAndCallback()
+ * and the pin config parser are run against scripted byte streams: a valid command, floods
+ * and trickles of whitespace or digits, missing terminators, bad bytes
+ * and fuzzed streams from a fixed seed. The bytes come through a fake
+ * Stream on a fake clock (SerialUtil.h), so a stream trickled over
+ * minutes runs in moments and nothing reaches the EEPROM or the host.
+ *
+ * For each parser it reports the longest a single call would have held
+ * loop(), the longest any one budget lasted (the pin config parser has a
+ * budget per keystroke), the time per byte read and the real time the
+ * parsing took, and fails any parser that could run a budget past
+ * SERIAL_COMMAND_BUDGET_MS */
+
+#define WCET_STREAM_BYTES     2048
+#define WCET_FUZZ_STREAMS     32
+#define WCET_FUZZ_MAX_BYTES   256
+#define WCET_SEED             0x2545f491
+
+/* Returns how many parsers went over budget */
+int consoleWcetRun();
+
+#endif
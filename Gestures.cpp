@@ -0,0 +1,240 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include "SerialUtil.h"
+#include "TimerWheel.h"
+#include "Gestures.h"
+
+#if MAX_GESTURES
+
+#define STATE_IDLE        0
+#define STATE_DOWN        1     // Pressed, hold or repeat timer running
+#define STATE_HELD        2     // Hold fired, waiting for release
+#define STATE_WAIT_SECOND 3     // Tapped once, waiting for a second tap
+#define STATE_DOWN_SECOND 4     // Second tap, waiting for release
+
+typedef struct {
+  uint8_t input;
+  uint8_t state;
+  uint8_t action[GESTURE_TYPES];
+  uint16_t millis[GESTURE_TYPES];
+  WheelTimer timer;
+} gesture_input_t;
+
+static gesture_input_t inputs[MAX_GESTURE_INPUTS];
+static uint8_t inputCount = 0;
+
+static TimerWheel wheel;
+static send_key_t timerSendKey = NULL;
+
+static const uint16_t defaultMillis[GESTURE_TYPES] = {
+  0, 0, 0, GESTURE_HOLD_MS, GESTURE_DOUBLE_TAP_MS, GESTURE_REPEAT_MS
+};
+
+static const char *gestureNames[GESTURE_TYPES] = {
+  "", "press", "release", "hold", "double tap", "repeat"
+};
+
+static void sendAction(gesture_input_t *g, uint8_t gesture, send_key_t sendKey) {
+  uint8_t action = g->action[gesture];
+  // The input's own macro is the press if nothing else is configured
+  if (!action && gesture == GESTURE_PRESS)
+    action = g->input;
+  if (action)
+    sendInputRepeated(action, 1, sendKey);
+}
+
+/* A tap only waits if something else could still happen */
+static inline bool deferPress(const gesture_input_t *g) {
+  return (g->action[GESTURE_HOLD] && !g->action[GESTURE_REPEAT]) || g->action[GESTURE_DOUBLE_TAP];
+}
+
+static void onTimer(WheelTimer *timer) {
+  gesture_input_t *g = (gesture_input_t *) timer->arg;
+
+  switch (g->state) {
+    case STATE_DOWN:
+      if (g->action[GESTURE_REPEAT]) {
+        sendAction(g, GESTURE_REPEAT, timerSendKey);
+        wheel.schedule(&g->timer, g->millis[GESTURE_REPEAT]);
+      } else {
+        sendAction(g, GESTURE_HOLD, timerSendKey);
+        g->state = STATE_HELD;
+      }
+      break;
+    case STATE_WAIT_SECOND:
+      // No second tap, it was a single press after all
+      sendAction(g, GESTURE_PRESS, timerSendKey);
+      g->state = STATE_IDLE;
+      break;
+  }
+}
+
+static gesture_input_t *findInput(uint8_t input) {
+  for (uint8_t i = 0; i < inputCount; i++) {
+    if (inputs[i].input == input)
+      return &inputs[i];
+  }
+  return NULL;
+}
+
+void gesturesLoad() {
+  for (uint8_t i = 0; i < inputCount; i++)
+    wheel.cancel(&inputs[i].timer);
+  inputCount = 0;
+  wheel.begin(millis());
+
+  for (uint8_t i = 0; i < MAX_GESTURES; i++) {
+    uint16_t offset = GESTURES_OFFSET + i * GESTURE_SIZE;
+    uint8_t input   = EEPROM.read(offset);
+    uint8_t gesture = EEPROM.read(offset + 1);
+    uint8_t action  = EEPROM.read(offset + 2);
+    uint8_t param   = EEPROM.read(offset + 3);
+
+    if (!action || !IS_VALID_INPUT(input) || !gesture || gesture >= GESTURE_TYPES)
+      continue;
+
+    gesture_input_t *g = findInput(input);
+    if (!g) {
+      if (inputCount >= MAX_GESTURE_INPUTS)
+        continue;
+      g = &inputs[inputCount++];
+      memset(g, 0, sizeof(*g));
+      g->input = input;
+      g->timer.callback = onTimer;
+      g->timer.arg = g;
+      memcpy(g->millis, defaultMillis, sizeof(g->millis));
+    }
+    g->action[gesture] = action;
+    if (param)
+      g->millis[gesture] = param * 10;
+  }
+}
+
+void gesturesPrint() {
+  for (uint8_t i = 0; i < inputCount; i++) {
+    const gesture_input_t *g = &inputs[i];
+    for (uint8_t gesture = 1; gesture < GESTURE_TYPES; gesture++) {
+      if (!g->action[gesture])
+        continue;
+      Serial.printf("Input %d %s: input %d", g->input, gestureNames[gesture], g->action[gesture]);
+      if (g->millis[gesture])
+        Serial.printf(" after %d ms", g->millis[gesture]);
+      Serial.println();
+    }
+  }
+}
+
+bool gesturesSet(uint8_t input, uint8_t gesture, uint8_t action, uint8_t param) {
+  int16_t freeOffset = -1;
+
+  if (!IS_VALID_INPUT(input) || !gesture || gesture >= GESTURE_TYPES)
+    return false;
+
+  for (uint8_t i = 0; i < MAX_GESTURES; i++) {
+    uint16_t offset = GESTURES_OFFSET + i * GESTURE_SIZE;
+    if (!EEPROM.read(offset + 2)) {
+      if (freeOffset < 0)
+        freeOffset = offset;
+      continue;
+    }
+    if (EEPROM.read(offset) == input && EEPROM.read(offset + 1) == gesture) {
+      freeOffset = offset;
+      break;
+    }
+  }
+
+  if (freeOffset < 0)
+    return false;
+
+  updateEeprom(freeOffset, input);
+  updateEeprom(freeOffset + 1, gesture);
+  updateEeprom(freeOffset + 2, action);
+  updateEeprom(freeOffset + 3, param);
+#ifdef ESP32
+  EEPROM.commit();
+#endif
+
+  gesturesLoad();
+  return true;
+}
+
+bool gesturesInputChange(uint8_t input, uint8_t value, send_key_t sendKey) {
+  gesture_input_t *g = findInput(input);
+  if (!g)
+    return false;
+
+  if (!value) {
+    switch (g->state) {
+      case STATE_WAIT_SECOND:
+        wheel.cancel(&g->timer);
+        sendAction(g, GESTURE_DOUBLE_TAP, sendKey);
+        g->state = STATE_DOWN_SECOND;
+        break;
+      case STATE_IDLE:
+        g->state = STATE_DOWN;
+        if (g->action[GESTURE_REPEAT]) {
+          sendAction(g, GESTURE_REPEAT, sendKey);
+          wheel.schedule(&g->timer, GESTURE_REPEAT_DELAY_MS);
+        } else if (g->action[GESTURE_HOLD]) {
+          wheel.schedule(&g->timer, g->millis[GESTURE_HOLD]);
+        }
+        if (!deferPress(g) && (g->action[GESTURE_PRESS] || !g->action[GESTURE_REPEAT]))
+          sendAction(g, GESTURE_PRESS, sendKey);
+        break;
+    }
+    return true;
+  }
+
+  sendAction(g, GESTURE_RELEASE, sendKey);
+
+  if (g->state == STATE_DOWN) {
+    wheel.cancel(&g->timer);
+    if (deferPress(g) && g->action[GESTURE_DOUBLE_TAP]) {
+      g->state = STATE_WAIT_SECOND;
+      wheel.schedule(&g->timer, g->millis[GESTURE_DOUBLE_TAP]);
+      return true;
+    }
+    // Let go before the hold time, a tap
+    if (deferPress(g))
+      sendAction(g, GESTURE_PRESS, sendKey);
+  }
+  g->state = STATE_IDLE;
+  return true;
+}
+
+void gesturesPoll(send_key_t sendKey) {
+  timerSendKey = sendKey;
+  wheel.advance(millis());
+}
+
+int readGestureUpdateFromSerial() {
+  uint8_t input, gesture, action, param = 0;
+  char terminator;
+
+  if (serialTimedReadNum(&input, &terminator, false) || terminator != ' ' ||
+      serialTimedReadNum(&gesture, &terminator, false) || terminator != ' ' ||
+      serialTimedReadNum(&action, &terminator, false)) {
+    Serial.println("Expected input, gesture and action");
+    return -1;
+  }
+
+  if (terminator != ';' && serialTimedReadNum(&param, &terminator, false)) {
+    Serial.println("Invalid parameter");
+    return -1;
+  }
+
+  if (terminator != ';') {
+    Serial.println("No terminator");
+    return -1;
+  }
+  serialInput->read();
+
+  if ((action && !IS_VALID_INPUT(action)) || !gesturesSet(input, gesture, action, param)) {
+    Serial.println("Gesture not updated");
+    return -1;
+  }
+  gesturesPrint();
+  return 0;
+}
+
+#endif
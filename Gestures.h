@@ -0,0 +1,48 @@
+#ifndef Gestures_h
+#define Gestures_h
+
+#include <stdint.h>
+#include "eeprom_config.h"
+
+/* Per input gestures
+ *
+ * An input with gestures configured can do more than send its macro when
+ * pressed. Each gesture sends the macro of another input (usually a pool
+ * macro):
+ *
+ *   GESTURE_PRESS       on press, in place of the input's own macro
+ *   GESTURE_RELEASE     on release
+ *   GESTURE_HOLD        held for the parameter's time
+ *   GESTURE_DOUBLE_TAP  pressed again within the parameter's time
+ *   GESTURE_REPEAT      on press and then repeatedly at the parameter's
+ *                       interval while held, after GESTURE_REPEAT_DELAY_MS
+ *
+ * With a hold or double tap configured the press macro waits until it's
+ * clear the input was only tapped. Repeat takes the place of hold. The
+ * parameter is in 10ms units, 0 for the default. Timeouts run on a timer
+ * wheel, so any number of them can be pending for the same cost. */
+
+#define GESTURE_PRESS         1
+#define GESTURE_RELEASE       2
+#define GESTURE_HOLD          3
+#define GESTURE_DOUBLE_TAP    4
+#define GESTURE_REPEAT        5
+#define GESTURE_TYPES         6
+
+#define GESTURE_HOLD_MS         500
+#define GESTURE_DOUBLE_TAP_MS   250
+#define GESTURE_REPEAT_DELAY_MS 400
+#define GESTURE_REPEAT_MS       50
+#define MAX_GESTURE_INPUTS      16      // Inputs that can have gestures at once
+
+void gesturesLoad();
+void gesturesPrint();
+/* Add, replace or (with action 0) remove an input's gesture */
+bool gesturesSet(uint8_t input, uint8_t gesture, uint8_t action, uint8_t param);
+/* Returns false if the input has no gestures and should be handled as usual */
+bool gesturesInputChange(uint8_t input, uint8_t value, send_key_t sendKey);
+void gesturesPoll(send_key_t sendKey);
+/* Read "input gesture action [param];" from serial */
+int readGestureUpdateFromSerial();
+
+#endif
@@ -0,0 +1,69 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include "HeapStats.h"
+
+static volatile uint32_t allocCount = 0;
+
+#ifdef HEAP_ALLOC_COUNTER
+static inline void countAlloc() {
+  __atomic_fetch_add(&allocCount, 1, __ATOMIC_RELAXED);
+}
+
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real__malloc_r(struct _reent *r, size_t size);
+void *__real__calloc_r(struct _reent *r, size_t n, size_t size);
+void *__real__realloc_r(struct _reent *r, void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  countAlloc();
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  countAlloc();
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  countAlloc();
+  return __real_realloc(ptr, size);
+}
+
+// newlib calls the reentrant versions directly
+void *__wrap__malloc_r(struct _reent *r, size_t size) {
+  countAlloc();
+  return __real__malloc_r(r, size);
+}
+
+void *__wrap__calloc_r(struct _reent *r, size_t n, size_t size) {
+  countAlloc();
+  return __real__calloc_r(r, n, size);
+}
+
+void *__wrap__realloc_r(struct _reent *r, void *ptr, size_t size) {
+  countAlloc();
+  return __real__realloc_r(r, ptr, size);
+}
+}
+#endif
+
+uint32_t heapAllocCount() {
+  return allocCount;
+}
+
+void printHeapStats() {
+  static uint32_t lastCount = 0;
+  uint32_t count = heapAllocCount();
+
+#ifndef HEAP_ALLOC_COUNTER
+  Serial.println("Heap allocation counter not built in");
+#endif
+  Serial.printf("Heap allocations %u, %u since last check\n", count, count - lastCount);
+  Serial.printf("Free heap %u, largest free block %u\n",
+                heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  lastCount = heapAllocCount();
+}
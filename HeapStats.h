@@ -0,0 +1,12 @@
+#ifndef HeapStats_h
+#define HeapStats_h
+
+#include <stdint.h>
+
+/* Counts heap allocations when the link wraps malloc and friends 
+ * (-Wl,--wrap=malloc etc, see idf_build/main/CMakeLists.txt) and 
+ * HEAP_ALLOC_COUNTER is defined. Without that the count stays 0 */
+uint32_t heapAllocCount();
+void printHeapStats();
+
+#endif
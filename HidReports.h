@@ -0,0 +1,146 @@
+#ifndef HidReports_h
+#define HidReports_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "HIDTypes.h"
+
+/* HID reports defined once and built at compile time
+ *
+ * Each report is an X-macro list of its fields, expanded once into the
+ * report descriptor's bytes and once into a packed struct for sending it.
+ * hidReportBits() walks a finished descriptor at compile time so a
+ * static_assert can check the descriptor and the struct agree.
+ *
+ * A list takes three macros:
+ *   FIELD(name, page, usageMin, usageMax, logicalMin, logicalMax, size, count, flags)
+ *         a whole number of bytes, an int8/16_t or an array of them
+ *   FLAGS(name, page, usageMin, count)
+ *         up to 8 one bit usages, a bit field
+ *   PAD(bits)
+ *         up to 8 constant bits */
+
+#define HID_PAGE_GENERIC_DESKTOP  0x01
+#define HID_PAGE_KEYBOARD         0x07
+#define HID_PAGE_LEDS             0x08
+#define HID_PAGE_BUTTON           0x09
+#define HID_PAGE_CONSUMER         0x0C
+
+// Main item flags
+#define HID_ARRAY                 0x00
+#define HID_CONSTANT              0x01
+#define HID_VARIABLE              0x02
+#define HID_RELATIVE              0x04
+
+// Main item prefixes with the size bits masked off
+#define HID_MAIN_INPUT            0x80
+#define HID_MAIN_OUTPUT           0x90
+
+#define KEYBOARD_REPORT_ID        1
+#define CONSUMER_REPORT_ID        2
+#define MOUSE_REPORT_ID           3
+
+#define KEYBOARD_INPUT_REPORT(FIELD, FLAGS, PAD) \
+  FLAGS(modifiers, HID_PAGE_KEYBOARD, 0xE0, 8) \
+  PAD(8) \
+  FIELD(keys, HID_PAGE_KEYBOARD, 0x00, 0x65, 0x00, 0x65, 8, 6, HID_ARRAY)
+
+// Num lock, caps lock, scroll lock, compose and kana
+#define KEYBOARD_OUTPUT_REPORT(FIELD, FLAGS, PAD) \
+  FLAGS(leds, HID_PAGE_LEDS, 0x01, 5) \
+  PAD(3)
+
+// One consumer control usage at a time, like mute or volume up
+#define CONSUMER_INPUT_REPORT(FIELD, FLAGS, PAD) \
+  FIELD(usage, HID_PAGE_CONSUMER, 0x000, 0x3FF, 0x000, 0x3FF, 16, 1, HID_ARRAY)
+
+// Five buttons, relative X and Y then the wheel
+#define MOUSE_INPUT_REPORT(FIELD, FLAGS, PAD) \
+  FLAGS(buttons, HID_PAGE_BUTTON, 0x01, 5) \
+  PAD(3) \
+  FIELD(motion, HID_PAGE_GENERIC_DESKTOP, 0x30, 0x31, -127, 127, 8, 2, HID_VARIABLE | HID_RELATIVE) \
+  FIELD(wheel, HID_PAGE_GENERIC_DESKTOP, 0x38, 0x38, -127, 127, 8, 1, HID_VARIABLE | HID_RELATIVE)
+
+/* Descriptor bytes. Usages and logical ranges are always 2 byte items so
+ * any value fits */
+#define HID_LE16(v) (uint8_t) ((v) & 0xff), (uint8_t) (((v) >> 8) & 0xff)
+
+#define HID_FIELD_ITEMS(page, usageMin, usageMax, logicalMin, logicalMax, size, count) \
+  USAGE_PAGE(1), page, USAGE_MINIMUM(2), HID_LE16(usageMin), USAGE_MAXIMUM(2), HID_LE16(usageMax), \
+  LOGICAL_MINIMUM(2), HID_LE16(logicalMin), LOGICAL_MAXIMUM(2), HID_LE16(logicalMax), \
+  REPORT_SIZE(1), size, REPORT_COUNT(1), count,
+
+#define HID_INPUT_FIELD(name, page, usageMin, usageMax, logicalMin, logicalMax, size, count, flags) \
+  HID_FIELD_ITEMS(page, usageMin, usageMax, logicalMin, logicalMax, size, count) HIDINPUT(1), flags,
+#define HID_INPUT_FLAGS(name, page, usageMin, count) \
+  HID_FIELD_ITEMS(page, usageMin, (usageMin) + (count) - 1, 0, 1, 1, count) HIDINPUT(1), HID_VARIABLE,
+#define HID_INPUT_PAD(bits) \
+  REPORT_SIZE(1), 1, REPORT_COUNT(1), bits, HIDINPUT(1), HID_CONSTANT,
+
+#define HID_OUTPUT_FIELD(name, page, usageMin, usageMax, logicalMin, logicalMax, size, count, flags) \
+  HID_FIELD_ITEMS(page, usageMin, usageMax, logicalMin, logicalMax, size, count) HIDOUTPUT(1), flags,
+#define HID_OUTPUT_FLAGS(name, page, usageMin, count) \
+  HID_FIELD_ITEMS(page, usageMin, (usageMin) + (count) - 1, 0, 1, 1, count) HIDOUTPUT(1), HID_VARIABLE,
+#define HID_OUTPUT_PAD(bits) \
+  REPORT_SIZE(1), 1, REPORT_COUNT(1), bits, HIDOUTPUT(1), HID_CONSTANT,
+
+/* Struct members */
+template<unsigned size, bool isSigned> struct hid_int;
+template<> struct hid_int<8, false>  { typedef uint8_t type; };
+template<> struct hid_int<8, true>   { typedef int8_t type; };
+template<> struct hid_int<16, false> { typedef uint16_t type; };
+template<> struct hid_int<16, true>  { typedef int16_t type; };
+
+template<unsigned size, unsigned count, bool isSigned> struct hid_field {
+  typedef typename hid_int<size, isSigned>::type type[count];
+};
+template<unsigned size, bool isSigned> struct hid_field<size, 1, isSigned> {
+  typedef typename hid_int<size, isSigned>::type type;
+};
+
+#define HID_STRUCT_FIELD(name, page, usageMin, usageMax, logicalMin, logicalMax, size, count, flags) \
+  hid_field<size, count, ((logicalMin) < 0)>::type name;
+#define HID_STRUCT_FLAGS(name, page, usageMin, count) \
+  uint8_t name : count;
+#define HID_STRUCT_PAD(bits) \
+  uint8_t : bits;
+
+#define HID_REPORT_STRUCT(name, REPORT) \
+  typedef struct __attribute__((packed)) { \
+    REPORT(HID_STRUCT_FIELD, HID_STRUCT_FLAGS, HID_STRUCT_PAD) \
+  } name
+
+HID_REPORT_STRUCT(keyboard_input_report_t, KEYBOARD_INPUT_REPORT);
+HID_REPORT_STRUCT(keyboard_output_report_t, KEYBOARD_OUTPUT_REPORT);
+HID_REPORT_STRUCT(consumer_input_report_t, CONSUMER_INPUT_REPORT);
+HID_REPORT_STRUCT(mouse_input_report_t, MOUSE_INPUT_REPORT);
+
+/* Compile time descriptor walking, C++11 constexpr so one expression each */
+constexpr uint32_t hidItemData(const uint8_t *d, size_t i) {
+  return (d[i] & 3) == 0 ? 0 :
+         (d[i] & 3) == 1 ? d[i + 1] :
+         (d[i] & 3) == 2 ? d[i + 1] | (d[i + 2] << 8) :
+         d[i + 1] | (d[i + 2] << 8) | ((uint32_t) d[i + 3] << 16) | ((uint32_t) d[i + 4] << 24);
+}
+
+constexpr size_t hidItemLength(const uint8_t *d, size_t i) {
+  return 1 + ((d[i] & 3) == 3 ? 4 : (d[i] & 3));
+}
+
+/* The number of bits in a report, the sum of REPORT_SIZE * REPORT_COUNT
+ * over the main items of one kind (HID_MAIN_INPUT or HID_MAIN_OUTPUT)
+ * after the report's REPORT_ID */
+constexpr uint32_t hidReportBits(const uint8_t *d, size_t len, uint8_t main, uint8_t reportId,
+                                 size_t i = 0, uint32_t size = 0, uint32_t count = 0, uint32_t id = 0) {
+  return i >= len ? 0 :
+         (d[i] & 0xfc) == (REPORT_SIZE(0) & 0xfc) ?
+           hidReportBits(d, len, main, reportId, i + hidItemLength(d, i), hidItemData(d, i), count, id) :
+         (d[i] & 0xfc) == (REPORT_COUNT(0) & 0xfc) ?
+           hidReportBits(d, len, main, reportId, i + hidItemLength(d, i), size, hidItemData(d, i), id) :
+         (d[i] & 0xfc) == (REPORT_ID(0) & 0xfc) ?
+           hidReportBits(d, len, main, reportId, i + hidItemLength(d, i), size, count, hidItemData(d, i)) :
+         ((d[i] & 0xfc) == main && id == reportId ? size * count : 0) +
+           hidReportBits(d, len, main, reportId, i + hidItemLength(d, i), size, count, id);
+}
+
+#endif
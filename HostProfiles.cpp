@@ -0,0 +1,297 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <Preferences.h>
+#include "SerialUtil.h"
+#include "eeprom_config.h"
+#include "KeyboardLayout.h"
+#include "TypingRate.h"
+#include "HostProfiles.h"
+
+#define HOST_PREFS_NAMESPACE  "hosts"
+#define HOST_PREFS_KEY        "profiles"
+
+static host_profile_t profiles[HOST_PROFILES];
+static uint8_t active = HOST_NONE;
+static ble_peer_t activePeer;
+static bool haveActivePeer = false;
+static apply_host_profile_t applyHostProfile = NULL;
+
+static bool saveProfiles() {
+  Preferences prefs;
+  if (!prefs.begin(HOST_PREFS_NAMESPACE, false))
+    return false;
+  bool ok = prefs.putBytes(HOST_PREFS_KEY, profiles, sizeof(profiles)) == sizeof(profiles);
+  prefs.end();
+  return ok;
+}
+
+static int findProfile(const ble_peer_t *peer) {
+  for (int i = 0; i < HOST_PROFILES; i++) {
+    if (profiles[i].used && !memcmp(profiles[i].peer.val, peer->val, BLE_ADDR_LEN))
+      return i;
+  }
+  return HOST_NONE;
+}
+
+bool hostProfilesBegin(apply_host_profile_t applyProfile) {
+  Preferences prefs;
+  applyHostProfile = applyProfile;
+  memset(profiles, 0, sizeof(profiles));
+  if (!prefs.begin(HOST_PREFS_NAMESPACE, true))
+    return false;
+
+  // Anything saved by a build with a different profile layout is dropped
+  if (prefs.getBytesLength(HOST_PREFS_KEY) == sizeof(profiles))
+    prefs.getBytes(HOST_PREFS_KEY, profiles, sizeof(profiles));
+  prefs.end();
+
+  int count = 0;
+  for (int i = 0; i < HOST_PROFILES; i++)
+    count += profiles[i].used;
+  Serial.printf("%d host profiles\n", count);
+  return true;
+}
+
+bool hostProfilesConnected(const ble_peer_t *peer) {
+  if (haveActivePeer && !memcmp(activePeer.val, peer->val, BLE_ADDR_LEN))
+    return false;
+
+  activePeer = *peer;
+  haveActivePeer = true;
+  uint8_t profile = findProfile(peer);
+  bool changed = profile != active;
+  active = profile;
+  hostProfilesApply();
+  if (changed)
+    Serial.printf("Host profile %s, typing gap %d ms\n", active != HOST_NONE ? profiles[active].name : "none",
+                  hostProfileTypingGap());
+  return changed;
+}
+
+void hostProfilesDisconnected() {
+  haveActivePeer = false;
+}
+
+void hostProfilesApply() {
+  if (active != HOST_NONE && profiles[active].layout != HOST_LAYOUT_DEFAULT)
+    keyboardLayoutSet(profiles[active].layout);
+  else
+    keyboardLayoutSet(EEPROM.read(SETTING_LAYOUT));
+  if (applyHostProfile)
+    applyHostProfile(hostProfileFlags(), hostProfileTypingGap());
+}
+
+uint8_t hostProfileActive() {
+  return active;
+}
+
+uint8_t hostProfileConnected() {
+  return haveActivePeer ? active : HOST_NONE;
+}
+
+uint8_t hostProfileFlags() {
+  return active != HOST_NONE ? profiles[active].flags : 0;
+}
+
+uint8_t hostProfileTypingGap() {
+  if (active == HOST_NONE || !profiles[active].typingGap)
+    return TYPING_GAP_DEFAULT_MS;
+  return profiles[active].typingGap;
+}
+
+bool hostProfileSetTypingGap(uint8_t gapMs) {
+  if (hostProfileConnected() == HOST_NONE)
+    return false;
+
+  profiles[active].typingGap = gapMs;
+  if (!saveProfiles())
+    Serial.println("Saving host profiles failed");
+  hostProfilesApply();
+  return true;
+}
+
+uint8_t hostProfileInput(uint8_t input) {
+  if (active == HOST_NONE)
+    return input;
+
+  const host_profile_t *profile = &profiles[active];
+  for (uint8_t i = 0; i < profile->remapCount; i++) {
+    if (profile->remaps[i][0] == input)
+      return profile->remaps[i][1];
+  }
+  return input;
+}
+
+bool hostProfilePeer(uint8_t profile, ble_peer_t *peer) {
+  if (profile >= HOST_PROFILES || !profiles[profile].used)
+    return false;
+  *peer = profiles[profile].peer;
+  return true;
+}
+
+static void listProfiles() {
+  for (int i = 0; i < HOST_PROFILES; i++) {
+    const host_profile_t *profile = &profiles[i];
+    if (!profile->used)
+      continue;
+
+    Serial.printf("%d%s %s %02x:%02x:%02x:%02x:%02x:%02x layout %s%s%s gap %d ms", i, i == active ? "*" : "", profile->name,
+                  profile->peer.val[0], profile->peer.val[1], profile->peer.val[2],
+                  profile->peer.val[3], profile->peer.val[4], profile->peer.val[5],
+                  profile->layout == HOST_LAYOUT_DEFAULT ? "default" : keyboardLayoutName(profile->layout),
+                  (profile->flags & HOST_SWAP_CTRL_GUI) ? " swap ctrl/gui" : "",
+                  (profile->flags & HOST_CAPS_KEEPS_SHIFT) ? " caps keeps shift" : "",
+                  profile->typingGap ? profile->typingGap : TYPING_GAP_DEFAULT_MS);
+    for (uint8_t r = 0; r < profile->remapCount; r++)
+      Serial.printf(" %d>%d", profile->remaps[r][0], profile->remaps[r][1]);
+    Serial.println();
+  }
+}
+
+/* Remap input to play from's keystrokes, from 0 or the input itself removes it */
+static bool remapInput(host_profile_t *profile, uint8_t input, uint8_t from) {
+  uint8_t r;
+  for (r = 0; r < profile->remapCount && profile->remaps[r][0] != input; r++)
+    ;
+
+  if (!from || from == input) {
+    if (r < profile->remapCount) {
+      profile->remapCount--;
+      memcpy(profile->remaps[r], profile->remaps[profile->remapCount], 2);
+    }
+    return true;
+  }
+
+  if (r == HOST_REMAPS)
+    return false;
+  profile->remaps[r][0] = input;
+  profile->remaps[r][1] = from;
+  if (r == profile->remapCount)
+    profile->remapCount++;
+  return true;
+}
+
+static int readNumber(uint8_t *value, bool last) {
+  char terminator;
+  if (serialTimedReadNum(value, &terminator, false) || terminator != (last ? ';' : ' '))
+    return -1;
+  if (last)
+    serialInput->read();
+  return 0;
+}
+
+/* Hl lists the profiles, Ha profile name; makes the connected host a
+ * profile, Hy profile layout; sets its layout (past the last for the
+ * default), Hc profile 0|1; swaps Control and GUI, Hm profile 0|1; is for
+ * a host where Shift doesn't undo Caps Lock, Hr profile input from;
+ * remaps an input (from 0 removes it), Hd profile; deletes one and
+ * Hs profile; switches to that host */
+int readHostProfileCommandFromSerial(switch_host_t switchHost) {
+  int op = serialTimedPeek();
+  uint8_t index, value, from;
+
+  if (op == -1) {
+    Serial.println("No host profile command");
+    return -1;
+  }
+  serialInput->read();
+
+  if (op == 'l') {
+    listProfiles();
+    return 0;
+  }
+
+  if (readNumber(&index, op == 'd' || op == 's') || index >= HOST_PROFILES) {
+    Serial.println("Invalid host profile");
+    return -1;
+  }
+  host_profile_t *profile = &profiles[index];
+
+  // Only a bonded host's profile has settings to change
+  if ((op == 'y' || op == 'c' || op == 'm' || op == 'r') && !profile->used) {
+    Serial.printf("No host profile %d, add it with Ha\n", index);
+    return -1;
+  }
+
+  switch (op) {
+    case 'a': {
+      if (!haveActivePeer) {
+        Serial.println("No host connected");
+        return -1;
+      }
+      char name[HOST_NAME_MAX];
+      serialTimedSkipWhitespace(NULL);
+      int len = serialTimedReadUntil(';', name, sizeof(name) - 1);
+      if (len <= 0) {
+        Serial.printf("Invalid name, up to %d characters\n", HOST_NAME_MAX - 1);
+        return -1;
+      }
+      name[len] = '\0';
+
+      // A host only has one profile
+      uint8_t existing = findProfile(&activePeer);
+      if (existing != HOST_NONE && existing != index)
+        profiles[existing].used = 0;
+
+      memset(profile, 0, sizeof(*profile));
+      profile->used = 1;
+      profile->layout = HOST_LAYOUT_DEFAULT;
+      profile->peer = activePeer;
+      strlcpy(profile->name, name, sizeof(profile->name));
+      active = index;
+      break;
+    }
+    case 'y':
+      if (readNumber(&value, true)) {
+        Serial.println("Invalid layout");
+        return -1;
+      }
+      profile->layout = value < LAYOUT_COUNT ? value : HOST_LAYOUT_DEFAULT;
+      break;
+    case 'c':
+      if (readNumber(&value, true) || value > 1) {
+        Serial.println("Invalid setting, 0 or 1");
+        return -1;
+      }
+      profile->flags = value ? profile->flags | HOST_SWAP_CTRL_GUI : profile->flags & ~HOST_SWAP_CTRL_GUI;
+      break;
+    case 'm':
+      if (readNumber(&value, true) || value > 1) {
+        Serial.println("Invalid setting, 0 or 1");
+        return -1;
+      }
+      profile->flags = value ? profile->flags | HOST_CAPS_KEEPS_SHIFT : profile->flags & ~HOST_CAPS_KEEPS_SHIFT;
+      break;
+    case 'r':
+      if (readNumber(&value, false) || readNumber(&from, true) || !IS_VALID_INPUT(value) ||
+          (from && !IS_VALID_INPUT(from))) {
+        Serial.println("Invalid input");
+        return -1;
+      }
+      if (!remapInput(profile, value, from)) {
+        Serial.printf("A host can remap %d inputs\n", HOST_REMAPS);
+        return -1;
+      }
+      break;
+    case 'd':
+      profile->used = 0;
+      if (active == index)
+        active = HOST_NONE;
+      break;
+    case 's':
+      if (!profile->used || !switchHost(&profile->peer)) {
+        Serial.println("Not a bonded host's profile");
+        return -1;
+      }
+      return 0;
+    default:
+      Serial.printf("Unknown host profile command '%c'\n", op);
+      return -1;
+  }
+
+  if (!saveProfiles())
+    Serial.println("Saving host profiles failed");
+  hostProfilesApply();
+  listProfiles();
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef HostProfiles_h
+#define HostProfiles_h
+
+#include <stdint.h>
+#include "BleHidBackend.h"
+
+/* Per host profiles
+ *
+ * A profile is a bonded host's address and name with the keyboard layout
+ * it's set to, whether Control and GUI (Command) are swapped for it,
+ * whether Shift still types capitals under Caps Lock (macOS), the gap
+ * between key reports it keeps up with (TypingRate.h), and
+ * inputs remapped to play another input's keystrokes on that host, a pool
+ * input for instance. Whichever host connects has its profile made active.
+ * Profiles are kept in NVS, apart from the EEPROM configuration.
+ *
+ * Switching hosts drops the current connection and sends directed
+ * advertising at the new host, from the console or the macro escape
+ * (MACRO_ESCAPE, MACRO_OP_HOST) followed by (0, profile) */
+
+#define HOST_PROFILES         4
+#define HOST_NAME_MAX         16
+#define HOST_REMAPS           16
+#define HOST_NONE             0xff
+#define HOST_LAYOUT_DEFAULT   0xff      // The layout configured with 'y'
+
+#define HOST_SWAP_CTRL_GUI    0x01
+#define HOST_CAPS_KEEPS_SHIFT 0x02      // macOS, Shift doesn't undo Caps Lock
+
+typedef struct {
+  uint8_t used;
+  uint8_t layout;
+  uint8_t flags;
+  uint8_t remapCount;
+  uint8_t typingGap;                    // ms, 0 for the default
+  ble_peer_t peer;
+  char name[HOST_NAME_MAX];
+  uint8_t remaps[HOST_REMAPS][2];       // An input then the input whose keystrokes it plays
+} host_profile_t;
+
+/* Disconnect and advertise directly at a bonded host */
+typedef bool (*switch_host_t)(const ble_peer_t *peer);
+/* Set the keyboard up for the active profile's HOST_ flags and typing gap */
+typedef void (*apply_host_profile_t)(uint8_t flags, uint8_t typingGapMs);
+
+bool hostProfilesBegin(apply_host_profile_t applyProfile);
+/* A host is connected, returns true if that changed the active profile */
+bool hostProfilesConnected(const ble_peer_t *peer);
+/* No host is connected, the next one to connect is looked up again */
+void hostProfilesDisconnected();
+/* Apply the active profile's layout and flags again, after the
+ * configuration is reloaded or a profile changes */
+void hostProfilesApply();
+uint8_t hostProfileActive();
+/* The connected host's profile, HOST_NONE if no host is connected or it has none */
+uint8_t hostProfileConnected();
+uint8_t hostProfileFlags();
+uint8_t hostProfileTypingGap();
+/* Save the connected host's gap, 0 for the default, false if it has no profile */
+bool hostProfileSetTypingGap(uint8_t gapMs);
+/* The input whose keystrokes to send for input on the active host */
+uint8_t hostProfileInput(uint8_t input);
+bool hostProfilePeer(uint8_t profile, ble_peer_t *peer);
+
+/* Console 'H' commands, the letter after the H picks the operation */
+int readHostProfileCommandFromSerial(switch_host_t switchHost);
+
+#endif
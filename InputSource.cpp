@@ -0,0 +1,91 @@
+#include <Arduino.h>
+#include "eeprom_config.h"
+#include "InputSource.h"
+#ifdef ESP32
+#include "Metrics.h"
+#endif
+
+#if MAX_EXPANDER_CHIPS
+typedef struct {
+  InputSource *source;
+  uint8_t firstInput;
+  input_debounce_t debounce;
+} source_entry_t;
+
+static source_entry_t sources[MAX_EXPANDER_CHIPS];
+static uint8_t sourceCount = 0;
+#endif
+
+/* Feed in newly sampled levels and return the inputs whose debounced level
+ * changed. An input only changes once its raw level has held for 
+ * INPUT_DEBOUNCE_MS, so this also needs calling when nothing was sampled */
+WATCH_TYPE debounceInputs(input_debounce_t *state, WATCH_TYPE raw, unsigned long now) {
+  WATCH_TYPE rawChanged = raw ^ state->raw;
+#ifdef ESP32
+  if (rawChanged)
+    metricAdd(METRIC_PIN_EDGES, __builtin_popcountll(rawChanged));
+#endif
+  while (rawChanged) {
+    state->changedMillis[__builtin_ctzll(rawChanged)] = now;
+    rawChanged &= rawChanged - 1;
+  }
+  state->raw = raw;
+
+  WATCH_TYPE waiting = raw ^ state->debounced;
+  WATCH_TYPE flipped = 0;
+  while (waiting) {
+    uint8_t bit = __builtin_ctzll(waiting);
+    waiting &= waiting - 1;
+    if (now - state->changedMillis[bit] >= INPUT_DEBOUNCE_MS)
+      flipped |= (WATCH_TYPE) 1 << bit;
+  }
+
+  state->debounced ^= flipped;
+#ifdef ESP32
+  if (flipped)
+    metricAdd(METRIC_DEBOUNCED_EDGES, __builtin_popcountll(flipped));
+#endif
+  return flipped;
+}
+
+bool addInputSource(InputSource *source, uint8_t firstInput) {
+#if MAX_EXPANDER_CHIPS
+  if (sourceCount >= MAX_EXPANDER_CHIPS)
+    return false;
+
+  uint32_t levels = 0xffffffff;   // Everything released until the first sample
+  if (!source->begin())
+    return false;
+  source->sample(&levels);
+
+  source_entry_t *entry = &sources[sourceCount++];
+  entry->source = source;
+  entry->firstInput = firstInput;
+  entry->debounce.raw = entry->debounce.debounced = levels;
+  return true;
+#else
+  return false;
+#endif
+}
+
+/* Sources only touch their bus when something changed, the debounce runs
+ * on the last levels either way */
+void pollInputSources(unsigned long now, input_change_t change, send_key_t sendKey) {
+#if MAX_EXPANDER_CHIPS
+  for (uint8_t s = 0; s < sourceCount; s++) {
+    source_entry_t *entry = &sources[s];
+    uint32_t levels;
+    WATCH_TYPE raw = entry->debounce.raw;
+
+    if (entry->source->sample(&levels))
+      raw = levels;
+
+    WATCH_TYPE changed = debounceInputs(&entry->debounce, raw, now);
+    while (changed) {
+      uint8_t bit = __builtin_ctzll(changed);
+      changed &= changed - 1;
+      change(entry->firstInput + bit, (entry->debounce.debounced >> bit) & 1, sendKey);
+    }
+  }
+#endif
+}
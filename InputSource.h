@@ -0,0 +1,21 @@
+#ifndef InputSource_h
+#define InputSource_h
+
+#include <stdint.h>
+
+/* A group of up to 32 digital inputs that aren't native pins, for
+ * example an I2C port expander. Inputs are active low like the native
+ * pins. Sources are registered with addInputSource() and their samples
+ * go through the same debounce and trigger path as the native pins,
+ * pollInputSources() (both in eeprom_config.h) samples them all */
+class InputSource {
+  public:
+    virtual bool begin() = 0;
+    virtual uint8_t inputCount() = 0;
+    /* Read the inputs into levels, a bit per input with 1 = high. Return
+     * false without touching levels if nothing can have changed since the
+     * last call, so interrupt driven sources can skip the bus */
+    virtual bool sample(uint32_t *levels) = 0;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <soc/gpio_reg.h>
+#include <freertos/queue.h>
+#include "KeyMatrix.h"
+
+static uint8_t rowPins[KEY_MATRIX_MAX_ROWS];
+static uint8_t colPins[KEY_MATRIX_MAX_COLS];
+static uint8_t rowCount = 0;
+static uint8_t colCount = 0;
+static bool diodes = false;
+static uint8_t debounceScans = 1;
+
+static uint64_t debounced = 0;        // Debounced state, bit per key, 1 = pressed
+static uint64_t pending = 0;          // Keys whose raw state differs from debounced
+static uint8_t stableCount[KEY_MATRIX_MAX_KEYS];
+
+static esp_timer_handle_t scanTimer = NULL;
+
+static StaticQueue_t eventQueueBuf;
+static uint8_t eventQueueStorage[KEY_MATRIX_EVENT_QUEUE * sizeof(key_event_t)];
+static QueueHandle_t eventQueue = NULL;
+
+static inline void driveColumn(uint8_t pin, bool low) {
+  // Columns are open drain, writing 1 releases the line
+  if (pin < 32)
+    REG_WRITE(low ? GPIO_OUT_W1TC_REG : GPIO_OUT_W1TS_REG, 1UL << pin);
+  else
+    REG_WRITE(low ? GPIO_OUT1_W1TC_REG : GPIO_OUT1_W1TS_REG, 1UL << (pin - 32));
+}
+
+static inline bool ghostPossible(const uint8_t *colRows) {
+  // Without diodes three keys on the corners of a rectangle make the
+  // fourth corner look pressed, that needs two columns sharing two rows
+  for (uint8_t c1 = 0; c1 < colCount; c1++) {
+    if (!(colRows[c1] & (colRows[c1] - 1)))
+      continue;
+    for (uint8_t c2 = c1 + 1; c2 < colCount; c2++) {
+      uint8_t common = colRows[c1] & colRows[c2];
+      if (common & (common - 1))
+        return true;
+    }
+  }
+  return false;
+}
+
+static void scanMatrix(void *arg) {
+  uint8_t colRows[KEY_MATRIX_MAX_COLS];
+  uint64_t raw = 0;
+
+  for (uint8_t c = 0; c < colCount; c++) {
+    driveColumn(colPins[c], true);
+    delayMicroseconds(KEY_MATRIX_SETTLE_US);
+    // All rows in two register reads rather than a digitalRead() each
+    uint32_t in0 = REG_READ(GPIO_IN_REG);
+    uint32_t in1 = REG_READ(GPIO_IN1_REG);
+    driveColumn(colPins[c], false);
+
+    uint8_t rowsDown = 0;
+    for (uint8_t r = 0; r < rowCount; r++) {
+      uint8_t pin = rowPins[r];
+      uint32_t level = pin < 32 ? (in0 >> pin) & 1 : (in1 >> (pin - 32)) & 1;
+      if (!level) {
+        rowsDown |= 1 << r;
+        raw |= (uint64_t) 1 << (r * colCount + c);
+      }
+    }
+    colRows[c] = rowsDown;
+  }
+
+  // Hold back new presses while the pattern is ambiguous, releases still count
+  if (!diodes && ghostPossible(colRows))
+    raw &= debounced;
+
+  uint64_t changed = raw ^ debounced;
+
+  // Keys that bounced back to their debounced state start again
+  uint64_t settled = pending & ~changed;
+  while (settled) {
+    uint8_t key = __builtin_ctzll(settled);
+    stableCount[key] = 0;
+    settled &= settled - 1;
+  }
+  pending = changed;
+
+  while (changed) {
+    uint8_t key = __builtin_ctzll(changed);
+    uint64_t bit = (uint64_t) 1 << key;
+    changed &= changed - 1;
+
+    if (++stableCount[key] < debounceScans)
+      continue;
+
+    stableCount[key] = 0;
+    pending &= ~bit;
+    debounced ^= bit;
+
+    key_event_t event = { key, (uint8_t) ((debounced & bit) != 0) };
+    xQueueSend(eventQueue, &event, 0);
+  }
+}
+
+bool keyMatrixBegin(const uint8_t *rows, uint8_t nRows,
+                    const uint8_t *cols, uint8_t nCols,
+                    bool hasDiodes, uint16_t scanHz) {
+  if (nRows > KEY_MATRIX_MAX_ROWS || nCols > KEY_MATRIX_MAX_COLS || !nRows || !nCols) {
+    Serial.printf("Invalid key matrix %d x %d\n", nRows, nCols);
+    return false;
+  }
+
+  for (uint8_t c = 0; c < nCols; c++) {
+    if (cols[c] >= 34) {
+      Serial.printf("Key matrix column pin %d can't be an output\n", cols[c]);
+      return false;
+    }
+  }
+
+  memcpy(rowPins, rows, nRows);
+  memcpy(colPins, cols, nCols);
+  rowCount = nRows;
+  colCount = nCols;
+  diodes = hasDiodes;
+
+  for (uint8_t r = 0; r < rowCount; r++)
+    pinMode(rowPins[r], rowPins[r] >= 34 ? INPUT : INPUT_PULLUP);
+
+  for (uint8_t c = 0; c < colCount; c++) {
+    pinMode(colPins[c], OUTPUT_OPEN_DRAIN);
+    digitalWrite(colPins[c], HIGH);
+  }
+
+  if (!eventQueue)
+    eventQueue = xQueueCreateStatic(KEY_MATRIX_EVENT_QUEUE, sizeof(key_event_t),
+                                    eventQueueStorage, &eventQueueBuf);
+
+  if (!scanTimer) {
+    esp_timer_create_args_t timerArgs;
+    memset(&timerArgs, 0, sizeof(timerArgs));
+    timerArgs.callback = scanMatrix;
+    timerArgs.name = "keymatrix";
+    esp_timer_create(&timerArgs, &scanTimer);
+  }
+
+  Serial.printf("Key matrix %d x %d, diodes %d\n", rowCount, colCount, diodes);
+  keyMatrixSetScanRate(scanHz);
+  return true;
+}
+
+void keyMatrixSetScanRate(uint16_t scanHz) {
+  if (!scanTimer || !scanHz)
+    return;
+
+  esp_timer_stop(scanTimer);
+  debounceScans = (KEY_MATRIX_DEBOUNCE_MS * scanHz) / 1000;
+  if (!debounceScans)
+    debounceScans = 1;
+  esp_timer_start_periodic(scanTimer, 1000000UL / scanHz);
+  Serial.printf("Key matrix scanning at %d Hz, debounce %d scans\n", scanHz, debounceScans);
+}
+
+uint8_t keyMatrixKeyCount() {
+  return rowCount * colCount;
+}
+
+bool keyMatrixNextEvent(key_event_t *event) {
+  if (!eventQueue)
+    return false;
+  return xQueueReceive(eventQueue, event, 0) == pdTRUE;
+}
@@ -0,0 +1,40 @@
+#ifndef KeyMatrix_h
+#define KeyMatrix_h
+
+#include <stdint.h>
+
+/* Row/column key matrix scanner
+ *
+ * Columns are driven low one at a time (open drain) and the rows, which
+ * are pulled up, are read back in a single GPIO register read. Keys are
+ * numbered row * columns + column. Scanning runs from an esp_timer at a
+ * configurable rate, debounced key changes are queued for loop() to pick
+ * up with keyMatrixNextEvent().
+ *
+ * Pins 34-39 are input only and have no internal pull ups, they can be
+ * used as rows with external pull up resistors. Columns must be output
+ * capable pins */
+
+#define KEY_MATRIX_MAX_ROWS        8
+#define KEY_MATRIX_MAX_COLS        8
+#define KEY_MATRIX_MAX_KEYS        (KEY_MATRIX_MAX_ROWS * KEY_MATRIX_MAX_COLS)
+#define KEY_MATRIX_DEFAULT_SCAN_HZ 1000
+#define KEY_MATRIX_DEBOUNCE_MS     5    // A key must be stable this long before a change is reported
+#define KEY_MATRIX_SETTLE_US       2    // Delay after driving a column before reading the rows
+#define KEY_MATRIX_EVENT_QUEUE     32
+
+typedef struct {
+  uint8_t key;
+  uint8_t pressed;
+} key_event_t;
+
+/* If the matrix has a diode per key any combination of keys can be
+ * pressed, without diodes presses that could be ghosts are held back */
+bool keyMatrixBegin(const uint8_t *rowPins, uint8_t rows,
+                    const uint8_t *colPins, uint8_t cols,
+                    bool hasDiodes, uint16_t scanHz = KEY_MATRIX_DEFAULT_SCAN_HZ);
+void keyMatrixSetScanRate(uint16_t scanHz);
+uint8_t keyMatrixKeyCount();
+bool keyMatrixNextEvent(key_event_t *event);
+
+#endif
@@ -0,0 +1,173 @@
+#include <Arduino.h>
+#include "KeyboardLayout.h"
+
+#define SHIFT  0x02
+#define ALTGR  0x40     // Right alt
+
+static uint8_t currentLayout = LAYOUT_US;
+
+static const char *layoutNames[LAYOUT_COUNT] = { "US", "UK", "DE", "FR" };
+
+constexpr layout_key_t key(uint8_t modifier, uint8_t usage, uint8_t dead = 0) {
+  return { modifier, usage, dead };
+}
+
+constexpr bool isLower(uint8_t c) {
+  return c >= 'a' && c <= 'z';
+}
+
+constexpr bool isUpper(uint8_t c) {
+  return c >= 'A' && c <= 'Z';
+}
+
+/* Keys that are the same on every layout */
+constexpr layout_key_t controlKey(uint8_t c) {
+  return c == '\n' ? key(0, 0x28) :   // Enter
+         c == 0x1b ? key(0, 0x29) :   // Escape
+         c == '\b' ? key(0, 0x2a) :
+         c == '\t' ? key(0, 0x2b) :
+         c == ' '  ? key(0, 0x2c) :
+         c == 0x7f ? key(0, 0x4c) :   // Delete
+         key(0, 0);
+}
+
+/* US */
+constexpr layout_key_t usSymbol(uint8_t c) {
+  return c == '!' ? key(SHIFT, 0x1e) : c == '"' ? key(SHIFT, 0x34) : c == '#' ? key(SHIFT, 0x20) :
+         c == '$' ? key(SHIFT, 0x21) : c == '%' ? key(SHIFT, 0x22) : c == '&' ? key(SHIFT, 0x24) :
+         c == '\''? key(0, 0x34)     : c == '(' ? key(SHIFT, 0x26) : c == ')' ? key(SHIFT, 0x27) :
+         c == '*' ? key(SHIFT, 0x25) : c == '+' ? key(SHIFT, 0x2e) : c == ',' ? key(0, 0x36) :
+         c == '-' ? key(0, 0x2d)     : c == '.' ? key(0, 0x37)     : c == '/' ? key(0, 0x38) :
+         c == ':' ? key(SHIFT, 0x33) : c == ';' ? key(0, 0x33)     : c == '<' ? key(SHIFT, 0x36) :
+         c == '=' ? key(0, 0x2e)     : c == '>' ? key(SHIFT, 0x37) : c == '?' ? key(SHIFT, 0x38) :
+         c == '@' ? key(SHIFT, 0x1f) : c == '[' ? key(0, 0x2f)     : c == '\\'? key(0, 0x31) :
+         c == ']' ? key(0, 0x30)     : c == '^' ? key(SHIFT, 0x23) : c == '_' ? key(SHIFT, 0x2d) :
+         c == '`' ? key(0, 0x35)     : c == '{' ? key(SHIFT, 0x2f) : c == '|' ? key(SHIFT, 0x31) :
+         c == '}' ? key(SHIFT, 0x30) : c == '~' ? key(SHIFT, 0x35) :
+         controlKey(c);
+}
+
+constexpr layout_key_t usKey(uint8_t c) {
+  return isLower(c) ? key(0, 0x04 + c - 'a') :
+         isUpper(c) ? key(SHIFT, 0x04 + c - 'A') :
+         c >= '1' && c <= '9' ? key(0, 0x1e + c - '1') :
+         c == '0' ? key(0, 0x27) :
+         usSymbol(c);
+}
+
+/* UK, US with the ISO keys and " and @ swapped */
+constexpr layout_key_t ukKey(uint8_t c) {
+  return c == '"' ? key(SHIFT, 0x1f) : c == '@' ? key(SHIFT, 0x34) :
+         c == '#' ? key(0, 0x32)     : c == '~' ? key(SHIFT, 0x32) :
+         c == '\\'? key(0, 0x64)     : c == '|' ? key(SHIFT, 0x64) :
+         usKey(c);
+}
+
+/* DE, QWERTZ */
+constexpr uint8_t deLetter(uint8_t c) {
+  return c == 'y' ? 0x1d : c == 'z' ? 0x1c : 0x04 + c - 'a';
+}
+
+constexpr layout_key_t deSymbol(uint8_t c) {
+  return c == '!' ? key(SHIFT, 0x1e) : c == '"' ? key(SHIFT, 0x1f) : c == '#' ? key(0, 0x32) :
+         c == '$' ? key(SHIFT, 0x21) : c == '%' ? key(SHIFT, 0x22) : c == '&' ? key(SHIFT, 0x23) :
+         c == '\''? key(SHIFT, 0x32) : c == '(' ? key(SHIFT, 0x25) : c == ')' ? key(SHIFT, 0x26) :
+         c == '*' ? key(SHIFT, 0x30) : c == '+' ? key(0, 0x30)     : c == ',' ? key(0, 0x36) :
+         c == '-' ? key(0, 0x38)     : c == '.' ? key(0, 0x37)     : c == '/' ? key(SHIFT, 0x24) :
+         c == ':' ? key(SHIFT, 0x37) : c == ';' ? key(SHIFT, 0x36) : c == '<' ? key(0, 0x64) :
+         c == '=' ? key(SHIFT, 0x27) : c == '>' ? key(SHIFT, 0x64) : c == '?' ? key(SHIFT, 0x2d) :
+         c == '@' ? key(ALTGR, 0x14) : c == '[' ? key(ALTGR, 0x25) : c == '\\'? key(ALTGR, 0x2d) :
+         c == ']' ? key(ALTGR, 0x26) : c == '^' ? key(0, 0x35, 1)  : c == '_' ? key(SHIFT, 0x38) :
+         c == '`' ? key(SHIFT, 0x2e, 1) : c == '{' ? key(ALTGR, 0x24) : c == '|' ? key(ALTGR, 0x64) :
+         c == '}' ? key(ALTGR, 0x27) : c == '~' ? key(ALTGR, 0x30) :
+         controlKey(c);
+}
+
+constexpr layout_key_t deKey(uint8_t c) {
+  return isLower(c) ? key(0, deLetter(c)) :
+         isUpper(c) ? key(SHIFT, deLetter(c - 'A' + 'a')) :
+         c >= '1' && c <= '9' ? key(0, 0x1e + c - '1') :
+         c == '0' ? key(0, 0x27) :
+         deSymbol(c);
+}
+
+/* FR, AZERTY, the digits are shifted */
+constexpr uint8_t frLetter(uint8_t c) {
+  return c == 'a' ? 0x14 : c == 'q' ? 0x04 : c == 'z' ? 0x1a : c == 'w' ? 0x1d : c == 'm' ? 0x33 :
+         0x04 + c - 'a';
+}
+
+constexpr layout_key_t frSymbol(uint8_t c) {
+  return c == '!' ? key(0, 0x38)     : c == '"' ? key(0, 0x20)     : c == '#' ? key(ALTGR, 0x20) :
+         c == '$' ? key(0, 0x30)     : c == '%' ? key(SHIFT, 0x34) : c == '&' ? key(0, 0x1e) :
+         c == '\''? key(0, 0x21)     : c == '(' ? key(0, 0x22)     : c == ')' ? key(0, 0x2d) :
+         c == '*' ? key(0, 0x32)     : c == '+' ? key(SHIFT, 0x2e) : c == ',' ? key(0, 0x10) :
+         c == '-' ? key(0, 0x23)     : c == '.' ? key(SHIFT, 0x36) : c == '/' ? key(SHIFT, 0x37) :
+         c == ':' ? key(0, 0x37)     : c == ';' ? key(0, 0x36)     : c == '<' ? key(0, 0x64) :
+         c == '=' ? key(0, 0x2e)     : c == '>' ? key(SHIFT, 0x64) : c == '?' ? key(SHIFT, 0x10) :
+         c == '@' ? key(ALTGR, 0x27) : c == '[' ? key(ALTGR, 0x22) : c == '\\'? key(ALTGR, 0x25) :
+         c == ']' ? key(ALTGR, 0x2d) : c == '^' ? key(ALTGR, 0x26) : c == '_' ? key(0, 0x25) :
+         c == '`' ? key(ALTGR, 0x24, 1) : c == '{' ? key(ALTGR, 0x21) : c == '|' ? key(ALTGR, 0x23) :
+         c == '}' ? key(ALTGR, 0x2e) : c == '~' ? key(ALTGR, 0x1f, 1) :
+         controlKey(c);
+}
+
+constexpr layout_key_t frKey(uint8_t c) {
+  return isLower(c) ? key(0, frLetter(c)) :
+         isUpper(c) ? key(SHIFT, frLetter(c - 'A' + 'a')) :
+         c >= '1' && c <= '9' ? key(SHIFT, 0x1e + c - '1') :
+         c == '0' ? key(SHIFT, 0x27) :
+         frSymbol(c);
+}
+
+// Expands f(0) to f(127)
+#define LAYOUT_ROW(f, r)  f(r + 0), f(r + 1), f(r + 2), f(r + 3), f(r + 4), f(r + 5), f(r + 6), f(r + 7)
+#define LAYOUT_TABLE(f)   LAYOUT_ROW(f, 0),  LAYOUT_ROW(f, 8),   LAYOUT_ROW(f, 16),  LAYOUT_ROW(f, 24),  \
+                          LAYOUT_ROW(f, 32), LAYOUT_ROW(f, 40),  LAYOUT_ROW(f, 48),  LAYOUT_ROW(f, 56),  \
+                          LAYOUT_ROW(f, 64), LAYOUT_ROW(f, 72),  LAYOUT_ROW(f, 80),  LAYOUT_ROW(f, 88),  \
+                          LAYOUT_ROW(f, 96), LAYOUT_ROW(f, 104), LAYOUT_ROW(f, 112), LAYOUT_ROW(f, 120)
+
+static constexpr layout_key_t layouts[LAYOUT_COUNT][128] = {
+  { LAYOUT_TABLE(usKey) },
+  { LAYOUT_TABLE(ukKey) },
+  { LAYOUT_TABLE(deKey) },
+  { LAYOUT_TABLE(frKey) }
+};
+
+static_assert(layouts[LAYOUT_US]['A'].usage == 0x04 && layouts[LAYOUT_US]['A'].modifier == SHIFT, "US layout is wrong");
+static_assert(layouts[LAYOUT_UK]['@'].usage == 0x34 && layouts[LAYOUT_UK]['a'].usage == 0x04, "UK layout is wrong");
+static_assert(layouts[LAYOUT_DE]['z'].usage == 0x1c && layouts[LAYOUT_DE]['y'].usage == 0x1d, "DE layout is wrong");
+static_assert(layouts[LAYOUT_FR]['1'].modifier == SHIFT && layouts[LAYOUT_FR]['a'].usage == 0x14, "FR layout is wrong");
+
+void keyboardLayoutSet(uint8_t layout) {
+  // Anything unset or unknown is US
+  currentLayout = layout < LAYOUT_COUNT ? layout : LAYOUT_US;
+}
+
+uint8_t keyboardLayoutGet() {
+  return currentLayout;
+}
+
+const char *keyboardLayoutName(uint8_t layout) {
+  return layout < LAYOUT_COUNT ? layoutNames[layout] : "?";
+}
+
+uint8_t keyboardLayoutKeys(char c, uint8_t *modifiers, uint8_t *usages, bool capsLock) {
+  if ((uint8_t) c >= 128)
+    return 0;
+
+  const layout_key_t *k = &layouts[currentLayout][(uint8_t) c];
+  if (!k->usage)
+    return 0;
+
+  modifiers[0] = k->modifier;
+  usages[0] = k->usage;
+  if (capsLock && (isLower(c) || isUpper(c)))
+    modifiers[0] ^= SHIFT;
+  if (!k->dead)
+    return 1;
+
+  modifiers[1] = 0;
+  usages[1] = 0x2c;
+  return 2;
+}
@@ -0,0 +1,36 @@
+#ifndef KeyboardLayout_h
+#define KeyboardLayout_h
+
+#include <stdint.h>
+
+/* ASCII to keystrokes for the host's keyboard layout
+ *
+ * A HID keyboard sends key positions, the host's layout decides what
+ * character each one types. Typing text needs the table for the layout
+ * the host is set to. The tables are generated by constexpr functions
+ * at compile time and live in flash. Dead keys (like ^ on a German
+ * layout) are followed by a space so they type the character itself */
+
+#define LAYOUT_US          0
+#define LAYOUT_UK          1
+#define LAYOUT_DE          2
+#define LAYOUT_FR          3
+#define LAYOUT_COUNT       4
+
+#define LAYOUT_MAX_KEYSTROKES 2   // Keystrokes for one character, a dead key and space
+
+typedef struct {
+  uint8_t modifier;
+  uint8_t usage;
+  uint8_t dead;       // Needs a space after it
+} layout_key_t;
+
+void keyboardLayoutSet(uint8_t layout);
+uint8_t keyboardLayoutGet();
+const char *keyboardLayoutName(uint8_t layout);
+/* Fills in the keystrokes to type c on the current layout, returns how
+ * many there are, 0 if the layout can't type it. With the host's Caps
+ * Lock on letters take the opposite shift so they still type c */
+uint8_t keyboardLayoutKeys(char c, uint8_t *modifiers, uint8_t *usages, bool capsLock = false);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef LightPacket_h
+#define LightPacket_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Binary light packet builder
+ *
+ * Packets are built as bytes in a caller provided buffer and the CRC is
+ * worked out over the bytes with a lookup table, the light protocol's hex
+ * text is only produced at the end for sending. This replaces building a
+ * String of hex and running the CRC over the text. 
+ *
+ * The CRC is CRC-16/XMODEM (polynomial 0x1021, initial value 0), sent most
+ * significant byte first after the packet. Light packets are a dozen or so
+ * bytes so one table lookup per byte is plenty, slicing by more than a 
+ * byte wouldn't pay for its bigger tables */
+
+uint16_t crc16Xmodem(const uint8_t *data, size_t len, uint16_t crc = 0);
+
+/* Both return the number of bytes/characters written, 0 if the input isn't
+ * valid hex or doesn't fit. toHex() NUL terminates */
+size_t hexToBytes(const char *hex, size_t hexLen, uint8_t *out, size_t outSize);
+size_t bytesToHex(const uint8_t *data, size_t len, char *out, size_t outSize);
+
+class LightPacket {
+  public:
+    LightPacket(uint8_t *buf, size_t size) : buf(buf), size(size), len(0), overflow(false) {}
+
+    void clear() { len = 0; overflow = false; }
+    void append(uint8_t value);
+    void append(const uint8_t *data, size_t count);
+    bool appendHex(const char *hex, size_t hexLen);
+    /* Append the CRC of everything so far */
+    void appendCrc();
+    /* The packet as hex text for the wire, returns its length or 0 if the
+     * packet overflowed or out is too small */
+    size_t toHex(char *out, size_t outSize) const;
+
+    const uint8_t *data() const { return buf; }
+    size_t length() const { return len; }
+    bool ok() const { return !overflow; }
+
+  private:
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include <Arduino.h>
+#include "LightPipeline.h"
+
+#define TARGET_IDLE    0    // Showing what the light reports
+#define TARGET_PENDING 1    // Waiting to be sent
+#define TARGET_SENT    2    // Sent, waiting for the light to confirm
+
+typedef struct {
+  int16_t min;
+  int16_t max;
+} param_range_t;
+
+// In the light's own units, CCT is in 100K and hue in 5 degree steps
+static const param_range_t ranges[LIGHT_PARAM_COUNT] = {
+  { 0, 1 },       // LIGHT_PARAM_ON_OFF
+  { 1, 12 },      // LIGHT_PARAM_CHANNEL
+  { 0, 100 },     // LIGHT_PARAM_BRIGHTNESS
+  { 32, 56 },     // LIGHT_PARAM_CCT
+  { 0, 72 },      // LIGHT_PARAM_HUE
+  { 0, 100 },     // LIGHT_PARAM_SATURATION
+};
+
+static int16_t targets[LIGHT_PARAM_COUNT];
+static uint8_t targetState[LIGHT_PARAM_COUNT];
+static bool awaitingStatus = false;
+static unsigned long lastSendMillis = 0;
+
+static int statusValue(const LightStatus *status, uint8_t param) {
+  switch (param) {
+    case LIGHT_PARAM_ON_OFF:     return status->on_off;
+    case LIGHT_PARAM_CHANNEL:    return status->channel;
+    case LIGHT_PARAM_BRIGHTNESS: return status->brightness;
+    case LIGHT_PARAM_CCT:        return status->cct;
+    case LIGHT_PARAM_HUE:        return status->hue;
+    case LIGHT_PARAM_SATURATION: return status->saturation;
+  }
+  return -1;
+}
+
+static void sendValue(uint8_t param, int value) {
+  switch (param) {
+    case LIGHT_PARAM_ON_OFF:     GVM.setOnOff(value); break;
+    case LIGHT_PARAM_CHANNEL:    GVM.setChannel(value); break;
+    case LIGHT_PARAM_BRIGHTNESS: GVM.setBrightness(value); break;
+    case LIGHT_PARAM_CCT:        GVM.setCct(value); break;
+    case LIGHT_PARAM_HUE:        GVM.setHue(value); break;
+    case LIGHT_PARAM_SATURATION: GVM.setSaturation(value); break;
+  }
+}
+
+void lightPipelineAdjust(light_param_t param, int change) {
+  if (param >= LIGHT_PARAM_COUNT)
+    return;
+
+  int value;
+  if (targetState[param] != TARGET_IDLE) {
+    value = targets[param];
+  } else {
+    LightStatus status = GVM.getLightStatus();
+    value = statusValue(&status, param);
+    // Nothing heard from the light yet, there's nothing to step from
+    if (value == -1)
+      return;
+  }
+
+  value += change;
+  if (value < ranges[param].min)
+    value = ranges[param].min;
+  if (value > ranges[param].max)
+    value = ranges[param].max;
+
+  targets[param] = value;
+  targetState[param] = TARGET_PENDING;
+}
+
+void lightPipelineFlush() {
+  unsigned long now = millis();
+
+  // A target that was never confirmed stops being shown
+  if (awaitingStatus && now - lastSendMillis >= LIGHT_TARGET_MILLIS) {
+    awaitingStatus = false;
+    for (uint8_t param = 0; param < LIGHT_PARAM_COUNT; param++) {
+      if (targetState[param] == TARGET_SENT)
+        targetState[param] = TARGET_IDLE;
+    }
+  }
+
+  if (awaitingStatus && now - lastSendMillis < LIGHT_FLUSH_MILLIS)
+    return;
+
+  bool sent = false;
+  for (uint8_t param = 0; param < LIGHT_PARAM_COUNT; param++) {
+    if (targetState[param] != TARGET_PENDING)
+      continue;
+    sendValue(param, targets[param]);
+    targetState[param] = TARGET_SENT;
+    sent = true;
+  }
+
+  if (sent) {
+    awaitingStatus = true;
+    lastSendMillis = now;
+  }
+}
+
+void lightPipelineOnStatus() {
+  // Sent targets are done with once the light reports back, even if it 
+  // settled on something else. Anything still pending goes out on the next flush
+  for (uint8_t param = 0; param < LIGHT_PARAM_COUNT; param++) {
+    if (targetState[param] == TARGET_SENT)
+      targetState[param] = TARGET_IDLE;
+  }
+  awaitingStatus = false;
+}
+
+void lightPipelineShowTargets(LightStatus *status) {
+  for (uint8_t param = 0; param < LIGHT_PARAM_COUNT; param++) {
+    if (targetState[param] == TARGET_IDLE)
+      continue;
+    switch (param) {
+      case LIGHT_PARAM_ON_OFF:     status->on_off = targets[param]; break;
+      case LIGHT_PARAM_CHANNEL:    status->channel = targets[param]; break;
+      case LIGHT_PARAM_BRIGHTNESS: status->brightness = targets[param]; break;
+      case LIGHT_PARAM_CCT:        status->cct = targets[param]; break;
+      case LIGHT_PARAM_HUE:        status->hue = targets[param]; break;
+      case LIGHT_PARAM_SATURATION: status->saturation = targets[param]; break;
+    }
+  }
+}
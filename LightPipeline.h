@@ -0,0 +1,38 @@
+#ifndef LightPipeline_h
+#define LightPipeline_h
+
+#include <stdint.h>
+#include "GvmLightControl.h"
+
+/* Coalescing light commands
+ *
+ * Adjustments don't go straight to the light, each parameter has a single
+ * pending target that later adjustments build on, the latest value wins.
+ * Targets are sent from lightPipelineFlush(), immediately if nothing is in
+ * flight, otherwise when the light's status update comes back or after
+ * LIGHT_FLUSH_MILLIS. Holding a button therefore sends the value the user
+ * ended up at, not every step on the way. Until the light confirms, 
+ * lightPipelineShowTargets() puts the targets into the status so the screen
+ * shows where the light is going. */
+
+typedef enum {
+  LIGHT_PARAM_ON_OFF = 0,
+  LIGHT_PARAM_CHANNEL,
+  LIGHT_PARAM_BRIGHTNESS,
+  LIGHT_PARAM_CCT,
+  LIGHT_PARAM_HUE,
+  LIGHT_PARAM_SATURATION,
+  LIGHT_PARAM_COUNT
+} light_param_t;
+
+#define LIGHT_FLUSH_MILLIS  150   // Longest wait for a status update before sending again
+#define LIGHT_TARGET_MILLIS 1000  // How long a sent target is shown without confirmation
+
+/* Change a parameter by change steps from its target */
+void lightPipelineAdjust(light_param_t param, int change);
+void lightPipelineFlush();
+/* Call when a status update arrives from the light */
+void lightPipelineOnStatus();
+void lightPipelineShowTargets(LightStatus *status);
+
+#endif
@@ -0,0 +1,205 @@
+#include <Arduino.h>
+
+#ifdef ESP32
+
+#include <esp_partition.h>
+#if __has_include(<esp32/rom/crc.h>)
+#include <esp32/rom/crc.h>
+#else
+#include <rom/crc.h>
+#endif
+#include "MacroLibrary.h"
+#include "MacroImage.h"
+
+static const esp_partition_t *banks[2] = { NULL, NULL };
+static int activeBank = -1;
+static uint32_t activeSequence = 0;
+static uint32_t activeLength = 0;
+static const uint8_t *image = NULL;
+static const macro_image_entry_t *entries = NULL;
+static spi_flash_mmap_handle_t mapHandle;
+static bool playing = false;           // The image is being read, a compile mustn't remap it
+
+/* Map a bank's image if its header and CRC are good */
+static bool mapBank(int bank, macro_image_header_t *header, const uint8_t **mapped, spi_flash_mmap_handle_t *handle) {
+  const esp_partition_t *part = banks[bank];
+
+  if (!part || esp_partition_read(part, 0, header, sizeof(*header)) != ESP_OK)
+    return false;
+
+  if (header->magic != MACRO_IMAGE_MAGIC || header->length < MACRO_IMAGE_DATA_OFFSET || header->length > part->size)
+    return false;
+
+  const void *ptr;
+  if (esp_partition_mmap(part, 0, header->length, SPI_FLASH_MMAP_DATA, &ptr, handle) != ESP_OK)
+    return false;
+
+  *mapped = (const uint8_t *) ptr;
+  uint32_t crc = crc32_le(0, *mapped + sizeof(*header), header->length - sizeof(*header));
+  if (crc != header->crc) {
+    Serial.printf("Macro image in %s has a bad CRC\n", part->label);
+    spi_flash_munmap(*handle);
+    return false;
+  }
+  return true;
+}
+
+static void useBank(int bank, const macro_image_header_t *header, const uint8_t *mapped, spi_flash_mmap_handle_t handle) {
+  if (image)
+    spi_flash_munmap(mapHandle);
+
+  image = mapped;
+  mapHandle = handle;
+  entries = (const macro_image_entry_t *) (image + sizeof(macro_image_header_t));
+  activeBank = bank;
+  activeSequence = header->sequence;
+  activeLength = header->length;
+}
+
+bool macroImageBegin() {
+  banks[0] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t) MACRO_IMAGE_SUBTYPE, MACRO_IMAGE_LABEL_A);
+  banks[1] = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t) MACRO_IMAGE_SUBTYPE, MACRO_IMAGE_LABEL_B);
+
+  if (!banks[0] || !banks[1]) {
+    Serial.println("No macro image partitions");
+    return false;
+  }
+
+  macro_image_header_t headers[2];
+  const uint8_t *mapped[2] = { NULL, NULL };
+  spi_flash_mmap_handle_t handles[2];
+  bool valid[2];
+
+  for (int bank = 0; bank < 2; bank++)
+    valid[bank] = mapBank(bank, &headers[bank], &mapped[bank], &handles[bank]);
+
+  // Newest good image wins, the other is unmapped
+  int use = -1;
+  if (valid[0] && valid[1])
+    use = (int32_t) (headers[1].sequence - headers[0].sequence) > 0 ? 1 : 0;
+  else if (valid[0] || valid[1])
+    use = valid[0] ? 0 : 1;
+
+  if (use < 0) {
+    Serial.println("No macro image");
+    return false;
+  }
+
+  if (valid[1 - use])
+    spi_flash_munmap(handles[1 - use]);
+  useBank(use, &headers[use], mapped[use], handles[use]);
+  Serial.printf("Macro image %u in %s, %u bytes\n", activeSequence, banks[use]->label, activeLength);
+  return true;
+}
+
+bool macroImagePlay(uint8_t id, send_key_t sendKey) {
+  if (!image || !id || !entries[id].offset)
+    return false;
+
+  // The keystrokes are read through the flash cache where they are
+  const uint8_t *keys = image + entries[id].offset;
+  uint32_t keystrokes = entries[id].keystrokes;
+
+  playing = true;
+  for (uint32_t i = 0; i < keystrokes; i++, keys += 2) {
+    if (keys[0] == MACRO_ESCAPE && i + 1 < keystrokes) {
+      sendMacroOp(keys[1], keys[2], keys[3], sendKey);
+      i++;
+      keys += 2;
+      continue;
+    }
+    sendKey(keys[0], keys[1], 0x0);
+  }
+  playing = false;
+  return true;
+}
+
+typedef struct {
+  const esp_partition_t *part;
+  uint32_t offset;
+  bool full;
+} image_writer_t;
+
+static bool writeChunk(const uint8_t *data, size_t len, void *arg) {
+  image_writer_t *writer = (image_writer_t *) arg;
+
+  if (writer->offset + len > writer->part->size) {
+    writer->full = true;
+    return false;
+  }
+  if (esp_partition_write(writer->part, writer->offset, data, len) != ESP_OK)
+    return false;
+  writer->offset += len;
+  return true;
+}
+
+bool macroImageCompile() {
+  if (!banks[0] || !banks[1]) {
+    Serial.println("No macro image partitions");
+    return false;
+  }
+
+  if (playing)
+    return false;
+
+  // Always write the bank that isn't in use
+  int bank = activeBank < 0 ? 0 : 1 - activeBank;
+  image_writer_t writer = { banks[bank], MACRO_IMAGE_DATA_OFFSET, false };
+  if (esp_partition_erase_range(writer.part, 0, writer.part->size) != ESP_OK) {
+    Serial.printf("Couldn't erase %s\n", writer.part->label);
+    return false;
+  }
+
+  uint16_t count = 0;
+  for (uint16_t id = 0; id < MACRO_IMAGE_IDS; id++) {
+    macro_image_entry_t entry = { 0, 0 };
+    macro_index_t index;
+    uint32_t start = writer.offset;
+    if (id && macroLibraryRead(id, &index, writeChunk, &writer)) {
+      entry.offset = start;
+      entry.keystrokes = index.keystrokes;
+      count++;
+    } else if (writer.full) {
+      Serial.printf("No room in the macro image for macro %d\n", id);
+      return false;
+    }
+
+    // Every entry is written so unused IDs read as 0 rather than erased flash
+    if (esp_partition_write(writer.part, sizeof(macro_image_header_t) + id * sizeof(entry), &entry, sizeof(entry)) != ESP_OK)
+      return false;
+  }
+
+  macro_image_header_t header = { MACRO_IMAGE_MAGIC, activeSequence + 1, writer.offset, 0 };
+  const void *ptr;
+  spi_flash_mmap_handle_t handle;
+  if (esp_partition_mmap(writer.part, 0, header.length, SPI_FLASH_MMAP_DATA, &ptr, &handle) != ESP_OK)
+    return false;
+  header.crc = crc32_le(0, (const uint8_t *) ptr + sizeof(header), header.length - sizeof(header));
+
+  // Writing the header makes the new image the current one
+  if (esp_partition_write(writer.part, 0, &header, sizeof(header)) != ESP_OK) {
+    spi_flash_munmap(handle);
+    return false;
+  }
+
+  useBank(bank, &header, (const uint8_t *) ptr, handle);
+  Serial.printf("Compiled %d macros into image %u in %s, %u bytes\n", count, activeSequence, writer.part->label, activeLength);
+  return true;
+}
+
+void macroImageInfo() {
+  if (!image) {
+    Serial.println("No macro image");
+    return;
+  }
+
+  uint16_t count = 0;
+  for (uint16_t id = 1; id < MACRO_IMAGE_IDS; id++) {
+    if (entries[id].offset)
+      count++;
+  }
+  Serial.printf("Macro image %u in %s, %d macros, %u of %u bytes\n", activeSequence, banks[activeBank]->label,
+                count, activeLength, banks[activeBank]->size);
+}
+
+#endif
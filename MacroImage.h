@@ -0,0 +1,47 @@
+#ifndef MacroImage_h
+#define MacroImage_h
+
+#include <stdint.h>
+#include "eeprom_config.h"
+
+/* Read only macro image, memory mapped from flash
+ *
+ * The macro library (MacroLibrary.h) is compiled into an image in one of
+ * two data partitions, macros_a and macros_b. The image with the newest
+ * sequence number is mapped with esp_partition_mmap() so playback reads the
+ * keystrokes straight through the flash cache, with no file system and no
+ * copy into RAM. Finding a macro is an index into a table of every ID so
+ * the time to the first keystroke doesn't depend on the size of the macro
+ * or how many there are.
+ *
+ * A new image is written to the other partition and its header, which
+ * holds a CRC of the rest, goes last. Until the header is written the old
+ * image stays current, so a reset part way through loses nothing */
+
+#define MACRO_IMAGE_SUBTYPE     0x40     // Data partition subtype in huge_app.csv
+#define MACRO_IMAGE_LABEL_A     "macros_a"
+#define MACRO_IMAGE_LABEL_B     "macros_b"
+#define MACRO_IMAGE_MAGIC       0x4D43494DUL   // "MICM"
+#define MACRO_IMAGE_IDS         256
+
+typedef struct {
+  uint32_t magic;
+  uint32_t sequence;        // Higher is newer
+  uint32_t length;          // Bytes in the image including this header
+  uint32_t crc;             // CRC32 of everything after the header
+} macro_image_header_t;
+
+typedef struct {
+  uint32_t offset;          // From the start of the image, 0 when the ID isn't in it
+  uint32_t keystrokes;
+} macro_image_entry_t;
+
+#define MACRO_IMAGE_DATA_OFFSET (sizeof(macro_image_header_t) + MACRO_IMAGE_IDS * sizeof(macro_image_entry_t))
+
+bool macroImageBegin();
+/* False if the image doesn't have the macro, so the caller can fall back to the library */
+bool macroImagePlay(uint8_t id, send_key_t sendKey);
+bool macroImageCompile();
+void macroImageInfo();
+
+#endif
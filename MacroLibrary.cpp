@@ -0,0 +1,327 @@
+#include <Arduino.h>
+
+#ifdef ESP32
+
+#include <FS.h>
+#include <SPIFFS.h>
+#include "KeyboardLayout.h"
+#include "SerialUtil.h"
+#include "MacroLibrary.h"
+#include "MacroImage.h"
+
+static bool mounted = false;
+// A library macro is playing, from the image or its file. Neither can
+// play another library macro
+static bool playing = false;
+static uint8_t chunk[MACRO_LIBRARY_CHUNK];
+
+static void macroPath(uint8_t id, char *path, size_t size) {
+  snprintf(path, size, MACRO_LIBRARY_DIR "/%u", id);
+}
+
+static bool readIndex(uint8_t id, macro_index_t *entry) {
+  File index = SPIFFS.open(MACRO_LIBRARY_INDEX, FILE_READ);
+  if (!index)
+    return false;
+
+  bool found = index.seek((id - 1) * sizeof(macro_index_t)) &&
+               index.read((uint8_t *) entry, sizeof(*entry)) == sizeof(*entry) &&
+               entry->id == id;
+  index.close();
+  return found;
+}
+
+static bool writeIndex(uint8_t id, const macro_index_t *entry) {
+  // "r+" updates in place, the index is created full size the first time
+  File index = SPIFFS.open(MACRO_LIBRARY_INDEX, "r+");
+  if (!index) {
+    index = SPIFFS.open(MACRO_LIBRARY_INDEX, FILE_WRITE);
+    if (!index)
+      return false;
+    macro_index_t empty;
+    memset(&empty, 0, sizeof(empty));
+    for (int i = 0; i < MACRO_LIBRARY_MAX_ID; i++)
+      index.write((const uint8_t *) &empty, sizeof(empty));
+  }
+
+  bool ok = index.seek((id - 1) * sizeof(macro_index_t)) &&
+            index.write((const uint8_t *) entry, sizeof(*entry)) == sizeof(*entry);
+  index.close();
+  return ok;
+}
+
+bool macroLibraryBegin() {
+  // Format the partition the first time round
+  mounted = SPIFFS.begin(true);
+  if (!mounted) {
+    Serial.println("Couldn't mount SPIFFS, no macro library");
+    return false;
+  }
+  Serial.printf("Macro library on SPIFFS, %u of %u bytes used\n", SPIFFS.usedBytes(), SPIFFS.totalBytes());
+  return true;
+}
+
+static bool playFile(uint8_t id, send_key_t sendKey) {
+  char path[24];
+  macro_index_t entry;
+
+  if (!mounted || !id || !readIndex(id, &entry)) {
+    Serial.printf("No library macro %d\n", id);
+    return false;
+  }
+
+  macroPath(id, path, sizeof(path));
+  File macro = SPIFFS.open(path, FILE_READ);
+  if (!macro)
+    return false;
+
+  Serial.printf("Play library macro %d '%s', %u keystrokes\n", id, entry.name, entry.keystrokes);
+
+  // Escapes take two keystrokes which can straddle a chunk boundary
+  bool escape = false;
+  uint8_t op = 0;
+  size_t len;
+  while ((len = macro.read(chunk, sizeof(chunk))) >= 2) {
+    for (size_t i = 0; i + 1 < len; i += 2) {
+      uint8_t modifier = chunk[i];
+      uint8_t code = chunk[i + 1];
+
+      if (escape) {
+        sendMacroOp(op, modifier, code, sendKey);
+        escape = false;
+      } else if (modifier == MACRO_ESCAPE) {
+        op = code;
+        escape = true;
+      } else {
+        sendKey(modifier, code, 0x0);
+      }
+    }
+  }
+
+  macro.close();
+  return true;
+}
+
+bool macroLibraryPlay(uint8_t id, send_key_t sendKey, bool fromImage) {
+  // Library macros can use the other escapes but not play library macros
+  if (playing) {
+    Serial.println("Library macros can't be nested");
+    return false;
+  }
+
+  playing = true;
+  bool played = (fromImage && macroImagePlay(id, sendKey)) || playFile(id, sendKey);
+  playing = false;
+  return played;
+}
+
+bool macroLibraryRead(uint8_t id, macro_index_t *entry, macro_chunk_t chunkCallback, void *arg) {
+  char path[24];
+
+  if (!mounted || !id || !readIndex(id, entry))
+    return false;
+
+  macroPath(id, path, sizeof(path));
+  File macro = SPIFFS.open(path, FILE_READ);
+  if (!macro)
+    return false;
+
+  bool ok = true;
+  size_t len;
+  while (ok && (len = macro.read(chunk, sizeof(chunk))) > 0)
+    ok = chunkCallback(chunk, len, arg);
+  macro.close();
+  return ok;
+}
+
+bool macroLibraryRemove(uint8_t id) {
+  char path[24];
+  macro_index_t entry;
+
+  if (!mounted || !id || !readIndex(id, &entry))
+    return false;
+
+  memset(&entry, 0, sizeof(entry));
+  writeIndex(id, &entry);
+  macroPath(id, path, sizeof(path));
+  return SPIFFS.remove(path);
+}
+
+void macroLibraryList() {
+  if (!mounted)
+    return;
+
+  File index = SPIFFS.open(MACRO_LIBRARY_INDEX, FILE_READ);
+  if (!index) {
+    Serial.println("Macro library is empty");
+    return;
+  }
+
+  macro_index_t entry;
+  while (index.read((uint8_t *) &entry, sizeof(entry)) == sizeof(entry)) {
+    if (entry.id)
+      Serial.printf("Library macro %d '%s': %u keystrokes\n", entry.id, entry.name, entry.keystrokes);
+  }
+  index.close();
+  Serial.printf("%u of %u bytes used\n", SPIFFS.usedBytes(), SPIFFS.totalBytes());
+}
+
+static int readName(char *name) {
+  char c;
+  uint8_t len = 0;
+
+  if (serialTimedSkipWhitespace(&c))
+    return -1;
+
+  while (serialTimedPeek() > ' ' && serialTimedPeek() != ';') {
+    c = serialInput->read();
+    if (len < MACRO_LIBRARY_NAME_MAX - 1)
+      name[len++] = c;
+  }
+  name[len] = '\0';
+  return len ? 0 : -1;
+}
+
+/* Stream keystrokes from serial into the macro's file a chunk at a time,
+ * as hex pairs like the 'u' command or as text. The upload goes to a
+ * temporary file that only replaces the macro once it has all arrived,
+ * a bad pair or a timeout leaves the macro and the index as they were */
+static int writeMacroFromSerial(uint8_t id, bool text) {
+  char path[24];
+  macro_index_t entry;
+  size_t used = 0;
+  char terminator;
+  bool ok = true;
+
+  memset(&entry, 0, sizeof(entry));
+  if (readName(entry.name)) {
+    Serial.println("Invalid name");
+    return -1;
+  }
+
+  File macro = SPIFFS.open(MACRO_LIBRARY_UPLOAD, FILE_WRITE);
+  if (!macro) {
+    Serial.println("Couldn't create macro file");
+    return -1;
+  }
+
+  // Skip the single space between the name and the text
+  if (text && serialTimedPeek() == ' ')
+    serialInput->read();
+
+  while (ok) {
+    uint8_t modifiers[LAYOUT_MAX_KEYSTROKES], codes[LAYOUT_MAX_KEYSTROKES];
+    uint8_t count = 1;
+    int c;
+
+    if (text) {
+      if ((c = serialTimedPeek()) == -1) {
+        ok = false;
+        break;
+      }
+      if (c == ';')
+        break;
+      serialInput->read();
+      // Typed on the host's layout, characters it can't type are skipped
+      count = keyboardLayoutKeys(c, modifiers, codes);
+    } else {
+      if (serialTimedSkipWhitespace(&terminator)) {
+        ok = false;
+        break;
+      }
+      if (terminator == ';')
+        break;
+      if (readModifierAndCode(&modifiers[0], &codes[0], &terminator)) {
+        ok = false;
+        break;
+      }
+    }
+
+    for (uint8_t i = 0; i < count && ok; i++) {
+      chunk[used++] = modifiers[i];
+      chunk[used++] = codes[i];
+      entry.keystrokes++;
+      if (used == sizeof(chunk)) {
+        ok = macro.write(chunk, used) == used;
+        used = 0;
+      }
+    }
+    // Each keystroke, and the flash write it may have cost, has its own
+    // budget so an upload of any length isn't cut short
+    serialCommandExtend();
+  }
+
+  if (ok) {
+    serialInput->read();
+    if (used)
+      ok = macro.write(chunk, used) == used;
+  }
+  macro.close();
+
+  if (!ok) {
+    SPIFFS.remove(MACRO_LIBRARY_UPLOAD);
+    Serial.printf("Library macro %d not saved, invalid or incomplete keystrokes\n", id);
+    return -1;
+  }
+
+  // SPIFFS won't rename over an existing file
+  macroPath(id, path, sizeof(path));
+  SPIFFS.remove(path);
+  entry.id = id;
+  if (!SPIFFS.rename(MACRO_LIBRARY_UPLOAD, path) || !writeIndex(id, &entry)) {
+    Serial.println("Couldn't update the index");
+    return -1;
+  }
+  Serial.printf("Saved library macro %d '%s', %u keystrokes\n", id, entry.name, entry.keystrokes);
+  return 0;
+}
+
+int readMacroLibraryCommandFromSerial(send_key_t sendKey) {
+  int op = serialTimedPeek();
+  uint8_t id = 0;
+  char terminator;
+
+  if (op == -1 || !mounted) {
+    Serial.println("No macro library command");
+    return -1;
+  }
+  serialInput->read();
+
+  if (op == 'l') {
+    macroLibraryList();
+    return 0;
+  }
+
+  if (op == 'c')
+    return macroImageCompile() ? 0 : -1;
+
+  if (op == 'i') {
+    macroImageInfo();
+    return 0;
+  }
+
+  if (serialTimedReadNum(&id, &terminator, false) || !id) {
+    Serial.println("Invalid macro ID");
+    return -1;
+  }
+
+  if ((op == 'p' || op == 'd') && terminator == ';')
+    serialInput->read();
+
+  switch (op) {
+    case 'p':
+      return macroLibraryPlay(id, sendKey) ? 0 : -1;
+    case 'd':
+      Serial.printf("Remove library macro %d: %d\n", id, macroLibraryRemove(id));
+      return 0;
+    case 'w':
+      return writeMacroFromSerial(id, false);
+    case 't':
+      return writeMacroFromSerial(id, true);
+  }
+
+  Serial.printf("Unknown macro library command '%c'\n", op);
+  return -1;
+}
+
+#endif
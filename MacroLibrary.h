@@ -0,0 +1,47 @@
+#ifndef MacroLibrary_h
+#define MacroLibrary_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include "eeprom_config.h"
+
+/* Macro library in the SPIFFS partition
+ *
+ * Named macros of any length, each in its own file of (modifier, code)
+ * keystroke pairs. The index is a file of fixed size records, one per ID,
+ * so finding a macro is a seek rather than a search. Playback streams a
+ * macro through a small buffer so it never has to fit in RAM.
+ *
+ * Inputs refer to a library macro with the keystroke pair 
+ * (MACRO_ESCAPE, MACRO_OP_LIBRARY) followed by (0, id) */
+
+#define MACRO_LIBRARY_DIR       "/macros"
+#define MACRO_LIBRARY_INDEX     MACRO_LIBRARY_DIR "/index"
+#define MACRO_LIBRARY_UPLOAD    MACRO_LIBRARY_DIR "/upload"   // A macro being written, until it's complete
+#define MACRO_LIBRARY_MAX_ID    255
+#define MACRO_LIBRARY_NAME_MAX  24
+#define MACRO_LIBRARY_CHUNK     128     // Bytes read from flash at a time during playback
+
+typedef struct {
+  uint8_t id;                       // 0 for an unused record
+  uint8_t reserved[3];
+  uint32_t keystrokes;
+  char name[MACRO_LIBRARY_NAME_MAX];
+} macro_index_t;
+
+/* Called with each chunk of a macro's keystrokes, returns false to stop */
+typedef bool (*macro_chunk_t)(const uint8_t *data, size_t len, void *arg);
+
+bool macroLibraryBegin();
+/* From the compiled image (MacroImage.h) if fromImage and it has the
+ * macro, otherwise from its file. Only one library macro plays at a time,
+ * whichever it comes from */
+bool macroLibraryPlay(uint8_t id, send_key_t sendKey, bool fromImage = false);
+bool macroLibraryRead(uint8_t id, macro_index_t *entry, macro_chunk_t chunkCallback, void *arg);
+bool macroLibraryRemove(uint8_t id);
+void macroLibraryList();
+
+/* Console 'L' commands, the letter after the L picks the operation */
+int readMacroLibraryCommandFromSerial(send_key_t sendKey);
+
+#endif
@@ -0,0 +1,108 @@
+#include <Arduino.h>
+#include "Mcp23017Source.h"
+
+// Registers with IOCON.BANK = 0, A and B ports interleaved so a
+// sequential read from GPIOA also returns GPIOB
+#define MCP23017_IODIRA   0x00
+#define MCP23017_IODIRB   0x01
+#define MCP23017_GPINTENA 0x04
+#define MCP23017_GPINTENB 0x05
+#define MCP23017_INTCONA  0x08
+#define MCP23017_INTCONB  0x09
+#define MCP23017_IOCON    0x0A
+#define MCP23017_GPPUA    0x0C
+#define MCP23017_GPPUB    0x0D
+#define MCP23017_GPIOA    0x12
+
+#define MCP23017_IOCON_MIRROR 0x40    // One INT line for both ports
+#define MCP23017_IOCON_ODR    0x04    // Open drain INT so chips can share the line
+
+// Bumped from the INT line ISR, each chip compares with what it last saw
+// so several chips can share a line
+static volatile uint32_t interruptCount[40];
+
+static void IRAM_ATTR onInterruptLine(void *arg) {
+  interruptCount[(intptr_t) arg]++;
+}
+
+bool WireExpanderBus::writeReg(uint8_t address, uint8_t reg, uint8_t value) {
+  wire->beginTransmission(address);
+  wire->write(reg);
+  wire->write(value);
+  return wire->endTransmission() == 0;
+}
+
+bool WireExpanderBus::readRegs(uint8_t address, uint8_t reg, uint8_t *buf, uint8_t len) {
+  wire->beginTransmission(address);
+  wire->write(reg);
+  if (wire->endTransmission(false) != 0)
+    return false;
+
+  if (wire->requestFrom(address, len) != len)
+    return false;
+  for (uint8_t i = 0; i < len; i++)
+    buf[i] = wire->read();
+  return true;
+}
+
+Mcp23017Source::Mcp23017Source() :
+  bus(NULL), address(0), intPin(MCP23017_NO_INT), primed(false), lastInterrupt(0) {
+}
+
+void Mcp23017Source::configure(ExpanderBus *bus, uint8_t address, int8_t intPin) {
+  this->bus = bus;
+  this->address = address;
+  this->intPin = intPin;
+}
+
+bool Mcp23017Source::begin() {
+  if (!bus)
+    return false;
+
+  // Every pin an input with a pull up, interrupt on any change
+  if (!bus->writeReg(address, MCP23017_IOCON, MCP23017_IOCON_MIRROR | MCP23017_IOCON_ODR) ||
+      !bus->writeReg(address, MCP23017_IODIRA, 0xff) ||
+      !bus->writeReg(address, MCP23017_IODIRB, 0xff) ||
+      !bus->writeReg(address, MCP23017_GPPUA, 0xff) ||
+      !bus->writeReg(address, MCP23017_GPPUB, 0xff) ||
+      !bus->writeReg(address, MCP23017_INTCONA, 0x00) ||
+      !bus->writeReg(address, MCP23017_INTCONB, 0x00) ||
+      !bus->writeReg(address, MCP23017_GPINTENA, 0xff) ||
+      !bus->writeReg(address, MCP23017_GPINTENB, 0xff)) {
+    Serial.printf("No MCP23017 at 0x%02x\n", address);
+    return false;
+  }
+
+  if (intPin >= 0) {
+    pinMode(intPin, INPUT_PULLUP);
+    attachInterruptArg(intPin, onInterruptLine, (void *) (intptr_t) intPin, FALLING);
+  }
+
+  Serial.printf("MCP23017 at 0x%02x, INT pin %d\n", address, intPin);
+  primed = false;
+  return true;
+}
+
+uint8_t Mcp23017Source::inputCount() {
+  return MCP23017_INPUTS;
+}
+
+bool Mcp23017Source::sample(uint32_t *levels) {
+  if (intPin >= 0 && primed) {
+    uint32_t count = interruptCount[intPin];
+    // INT stays low until the chip is read, so a low line covers an edge 
+    // that came in while another chip on the line was being read
+    if (count == lastInterrupt && digitalRead(intPin))
+      return false;
+    lastInterrupt = count;
+  }
+
+  // Reading GPIO clears the chip's interrupt
+  uint8_t ports[2];
+  if (!bus->readRegs(address, MCP23017_GPIOA, ports, sizeof(ports)))
+    return false;
+
+  primed = true;
+  *levels = 0xffff0000 | ((uint32_t) ports[1] << 8) | ports[0];
+  return true;
+}
@@ -0,0 +1,48 @@
+#ifndef Mcp23017Source_h
+#define Mcp23017Source_h
+
+#include <Wire.h>
+#include "InputSource.h"
+
+#define MCP23017_INPUTS    16
+#define MCP23017_NO_INT    -1
+
+/* Register access to the expander, separate from the source so a fake
+ * expander can stand in for the I2C bus */
+class ExpanderBus {
+  public:
+    virtual bool writeReg(uint8_t address, uint8_t reg, uint8_t value) = 0;
+    virtual bool readRegs(uint8_t address, uint8_t reg, uint8_t *buf, uint8_t len) = 0;
+};
+
+class WireExpanderBus : public ExpanderBus {
+  public:
+    WireExpanderBus(TwoWire *wire) : wire(wire) {}
+    bool writeReg(uint8_t address, uint8_t reg, uint8_t value);
+    bool readRegs(uint8_t address, uint8_t reg, uint8_t *buf, uint8_t len);
+
+  private:
+    TwoWire *wire;
+};
+
+/* All 16 pins of an MCP23017 as pulled up inputs. Both ports are read in
+ * one burst transaction, and only after the chip's INT line has fired. 
+ * Several chips can share one open drain INT line. Without an INT line 
+ * (MCP23017_NO_INT) the chip is read on every sample */
+class Mcp23017Source : public InputSource {
+  public:
+    Mcp23017Source();
+    void configure(ExpanderBus *bus, uint8_t address, int8_t intPin = MCP23017_NO_INT);
+    bool begin();
+    uint8_t inputCount();
+    bool sample(uint32_t *levels);
+
+  private:
+    ExpanderBus *bus;
+    uint8_t address;
+    int8_t intPin;
+    bool primed;
+    uint32_t lastInterrupt;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include "eeprom_config.h"
+#include "BleHidBackend.h"
+#include "Metrics.h"
+
+static_assert(sizeof(metrics_snapshot_t) <= BLE_METRICS_MAX_LEN, "Metrics don't fit the characteristic");
+
+std::atomic<uint32_t> metricCounters[METRIC_COUNT];
+std::atomic<uint32_t> metricInputMacros[INPUT_SLOTS];
+
+static TaskHandle_t tasks[METRIC_TASK_COUNT];
+
+// Loop timing is only written from loop(), readers may see a mix of two
+// passes which is fine for a gauge
+static uint32_t loopMinMicros = UINT32_MAX;
+static uint32_t loopMaxMicros = 0;
+static uint64_t loopTotalMicros = 0;
+static uint32_t loopCount = 0;
+
+static const char *counterNames[METRIC_COUNT] = {
+  "reports", "notify fail", "congestion", "macros", "edges", "debounced"
+};
+
+void metricsSetTask(metric_task_t task, void *handle) {
+  if (task < METRIC_TASK_COUNT)
+    tasks[task] = handle ? (TaskHandle_t) handle : xTaskGetCurrentTaskHandle();
+}
+
+void metricsLoopTime(uint32_t micros) {
+  if (micros < loopMinMicros)
+    loopMinMicros = micros;
+  if (micros > loopMaxMicros)
+    loopMaxMicros = micros;
+  loopTotalMicros += micros;
+  loopCount++;
+}
+
+void metricsSnapshot(metrics_snapshot_t *snapshot) {
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->version = METRICS_VERSION;
+  snapshot->uptimeMillis = millis();
+
+  for (int i = 0; i < METRIC_COUNT; i++)
+    snapshot->counters[i] = metricCounters[i].load(std::memory_order_relaxed);
+
+  uint32_t count = loopCount;
+  snapshot->loopMinMicros = count ? loopMinMicros : 0;
+  snapshot->loopAvgMicros = count ? loopTotalMicros / count : 0;
+  snapshot->loopMaxMicros = loopMaxMicros;
+
+  snapshot->freeHeap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  snapshot->largestFreeBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+
+  for (int i = 0; i < METRIC_TASK_COUNT; i++) {
+    if (tasks[i])
+      snapshot->stackHighWater[i] = uxTaskGetStackHighWaterMark(tasks[i]);
+  }
+}
+
+size_t metricsRead(uint8_t *buf, size_t max) {
+  metrics_snapshot_t snapshot;
+  metricsSnapshot(&snapshot);
+
+  size_t len = sizeof(snapshot) < max ? sizeof(snapshot) : max;
+  memcpy(buf, &snapshot, len);
+  return len;
+}
+
+void metricsPrint() {
+  metrics_snapshot_t snapshot;
+  metricsSnapshot(&snapshot);
+
+  for (int i = 0; i < METRIC_COUNT; i++)
+    Serial.printf("%s %u%s", counterNames[i], snapshot.counters[i], i + 1 < METRIC_COUNT ? ", " : "\n");
+
+  Serial.printf("loop min %u avg %u max %u us\n", snapshot.loopMinMicros, snapshot.loopAvgMicros, snapshot.loopMaxMicros);
+  Serial.printf("heap free %u largest %u, stack free loop %u ble %u console %u\n", snapshot.freeHeap,
+                snapshot.largestFreeBlock, snapshot.stackHighWater[METRIC_TASK_LOOP],
+                snapshot.stackHighWater[METRIC_TASK_BLE], snapshot.stackHighWater[METRIC_TASK_CONSOLE]);
+
+  bool any = false;
+  for (int input = 0; input < 256; input++) {
+    if (!IS_VALID_INPUT(input))
+      continue;
+    uint32_t macros = metricInputMacros[INPUT_SLOT(input)].load(std::memory_order_relaxed);
+    if (macros) {
+      Serial.printf("%s%d: %u", any ? ", " : "macros by input ", input, macros);
+      any = true;
+    }
+  }
+  if (any)
+    Serial.println();
+}
@@ -0,0 +1,75 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Runtime counters, gauges and task stack high water marks
+ *
+ * Counters are bumped from any task with a single relaxed atomic add, so
+ * they're cheap enough for the send and pin paths. Everything is read as
+ * a metrics_snapshot_t, printed by the 'M' console command and served
+ * as a read only GATT characteristic (BleHidBackend.h) for polling */
+
+typedef enum {
+  METRIC_REPORTS_SENT = 0,
+  METRIC_NOTIFY_FAILURES,      // A report couldn't be sent while connected
+  METRIC_CONGESTION,           // A send had to wait for the link
+  METRIC_MACROS_TRIGGERED,
+  METRIC_PIN_EDGES,            // Raw level changes seen on pins and expanders
+  METRIC_DEBOUNCED_EDGES,      // Changes that got through the debounce
+  METRIC_COUNT
+} metric_t;
+
+typedef enum {
+  METRIC_TASK_LOOP = 0,
+  METRIC_TASK_BLE,
+  METRIC_TASK_CONSOLE,         // Only with CONSOLE_UART_IDF
+  METRIC_TASK_COUNT
+} metric_task_t;
+
+#define METRICS_VERSION     2
+
+// What the characteristic returns, little endian
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t reserved[3];
+  uint32_t uptimeMillis;
+  uint32_t counters[METRIC_COUNT];
+  uint32_t loopMinMicros;
+  uint32_t loopAvgMicros;
+  uint32_t loopMaxMicros;
+  uint32_t freeHeap;
+  uint32_t largestFreeBlock;
+  uint32_t stackHighWater[METRIC_TASK_COUNT];   // Bytes never used
+} metrics_snapshot_t;
+
+extern std::atomic<uint32_t> metricCounters[METRIC_COUNT];
+// Indexed by INPUT_SLOT(), sized INPUT_SLOTS
+extern std::atomic<uint32_t> metricInputMacros[];
+
+static inline void metricAdd(metric_t metric, uint32_t n) {
+  metricCounters[metric].fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void metricInc(metric_t metric) {
+  metricCounters[metric].fetch_add(1, std::memory_order_relaxed);
+}
+
+/* A macro sent for an input, slot is INPUT_SLOT(input) */
+static inline void metricInputMacro(uint16_t slot) {
+  metricCounters[METRIC_MACROS_TRIGGERED].fetch_add(1, std::memory_order_relaxed);
+  metricInputMacros[slot].fetch_add(1, std::memory_order_relaxed);
+}
+
+/* Called by the task itself, or with the handle from xTaskCreate() */
+void metricsSetTask(metric_task_t task, void *handle);
+/* The time one pass of loop() took, only called from loop() */
+void metricsLoopTime(uint32_t micros);
+void metricsSnapshot(metrics_snapshot_t *snapshot);
+/* For the GATT characteristic, returns the bytes written */
+size_t metricsRead(uint8_t *buf, size_t max);
+void metricsPrint();
+
+#endif
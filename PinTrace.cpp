@@ -0,0 +1,300 @@
+#include <Arduino.h>
+#include "SerialUtil.h"
+#include "eeprom_config.h"
+#include "Metrics.h"
+#include "PinTrace.h"
+
+#define PIN_TRACE_HEX_CHUNK   128     // Hex characters per Iw command
+
+pin_trace_mode_t pinTraceMode = PIN_TRACE_IDLE;
+
+static uint8_t *trace = NULL;
+static uint32_t traceLen = 0;
+static uint32_t lastMicros;
+
+// Replay position, the next change is decoded ahead of its time
+static uint32_t replayStart;
+static uint32_t cursor;
+static uint32_t nextMicros;
+static uint8_t nextChange;
+static bool haveNext;
+static bool replayEnded;
+static uint32_t endedMicros;
+static uint32_t replayedChanges;
+static uint64_t replayPins;
+static uint64_t replayLevels;
+static uint32_t startDebounced;
+static uint32_t startReports;
+
+static void putMask(uint8_t *out, uint64_t mask) {
+  for (int i = 0; i < 8; i++)
+    out[i] = mask >> (i * 8);
+}
+
+static uint64_t getMask(const uint8_t *in) {
+  uint64_t mask = 0;
+  for (int i = 0; i < 8; i++)
+    mask |= (uint64_t) in[i] << (i * 8);
+  return mask;
+}
+
+/* Returns the bytes read, 0 if the varint runs off the end */
+static uint8_t getVarint(uint32_t offset, uint32_t *value) {
+  *value = 0;
+  for (uint8_t n = 0; n < 5 && offset + n < traceLen; n++) {
+    *value |= (uint32_t) (trace[offset + n] & 0x7f) << (n * 7);
+    if (!(trace[offset + n] & 0x80))
+      return n + 1;
+  }
+  return 0;
+}
+
+static bool allocTrace() {
+  if (!trace)
+    trace = (uint8_t *) malloc(PIN_TRACE_BYTES);
+  if (!trace)
+    Serial.printf("No memory for a %d byte pin trace\n", PIN_TRACE_BYTES);
+  return trace != NULL;
+}
+
+static void freeTrace() {
+  free(trace);
+  trace = NULL;
+  traceLen = 0;
+}
+
+static bool validTrace() {
+  return traceLen >= PIN_TRACE_HEADER && trace[0] == 'P' && trace[1] == 'T' &&
+         trace[2] == PIN_TRACE_VERSION;
+}
+
+bool pinTraceStartRecording() {
+  if (pinTraceMode != PIN_TRACE_IDLE || !allocTrace())
+    return false;
+
+  trace[0] = 'P';
+  trace[1] = 'T';
+  trace[2] = PIN_TRACE_VERSION;
+  putMask(&trace[3], (uint64_t) pinsToWatch << FIRST_INPUT_PIN);
+  putMask(&trace[11], (uint64_t) pinsLast << FIRST_INPUT_PIN);
+  traceLen = PIN_TRACE_HEADER;
+  lastMicros = micros();
+  pinTraceMode = PIN_TRACE_RECORDING;
+  Serial.println("Recording pin trace");
+  return true;
+}
+
+void pinTraceRecord(uint8_t pin, uint8_t level) {
+  uint32_t now = micros();
+  uint32_t delta = now - lastMicros;
+
+  // Room for the longest varint and the change
+  if (traceLen + 6 > PIN_TRACE_BYTES) {
+    pinTraceMode = PIN_TRACE_IDLE;
+    Serial.println("Pin trace full, recording stopped");
+    return;
+  }
+
+  while (delta >= 0x80) {
+    trace[traceLen++] = (delta & 0x7f) | 0x80;
+    delta >>= 7;
+  }
+  trace[traceLen++] = delta;
+  trace[traceLen++] = (pin << 1) | (level & 1);
+  lastMicros = now;
+}
+
+bool pinTraceStartReplay() {
+  if (pinTraceMode != PIN_TRACE_IDLE)
+    return false;
+  if (!trace || !validTrace()) {
+    Serial.println("No pin trace to replay");
+    return false;
+  }
+
+  replayPins = getMask(&trace[3]);
+  replayLevels = getMask(&trace[11]);
+  cursor = PIN_TRACE_HEADER;
+  nextMicros = 0;
+  haveNext = false;
+  replayEnded = false;
+  replayedChanges = 0;
+  startDebounced = metricCounters[METRIC_DEBOUNCED_EDGES].load(std::memory_order_relaxed);
+  startReports = metricCounters[METRIC_REPORTS_SENT].load(std::memory_order_relaxed);
+  replayStart = micros();
+  pinTraceMode = PIN_TRACE_REPLAYING;
+  Serial.println("Replaying pin trace");
+  return true;
+}
+
+static void finishReplay() {
+  pinTraceMode = PIN_TRACE_IDLE;
+  Serial.printf("Replayed %u changes in %lu ms, %u debounced edges, %u reports sent\n",
+                replayedChanges, (micros() - replayStart) / 1000,
+                metricCounters[METRIC_DEBOUNCED_EDGES].load(std::memory_order_relaxed) - startDebounced,
+                metricCounters[METRIC_REPORTS_SENT].load(std::memory_order_relaxed) - startReports);
+}
+
+void pinTraceAdvance() {
+  uint32_t now = micros() - replayStart;
+
+  while (!replayEnded) {
+    if (!haveNext) {
+      uint32_t delta;
+      uint8_t n = getVarint(cursor, &delta);
+      if (!n || cursor + n >= traceLen) {
+        replayEnded = true;
+        endedMicros = now;
+        break;
+      }
+      nextMicros += delta;
+      nextChange = trace[cursor + n];
+      cursor += n + 1;
+      haveNext = true;
+    }
+
+    if ((int32_t) (now - nextMicros) < 0)
+      break;
+
+    uint64_t bit = (uint64_t) 1 << ((nextChange >> 1) & 63);
+    replayLevels = (nextChange & 1) ? replayLevels | bit : replayLevels & ~bit;
+    replayedChanges++;
+    haveNext = false;
+  }
+
+  if (replayEnded && now - endedMicros >= PIN_TRACE_TAIL_MS * 1000UL)
+    finishReplay();
+}
+
+bool pinTraceReplays(uint8_t pin) {
+  return (replayPins >> pin) & 1;
+}
+
+uint8_t pinTraceLevel(uint8_t pin) {
+  return (replayLevels >> pin) & 1;
+}
+
+void pinTraceStop() {
+  if (pinTraceMode == PIN_TRACE_REPLAYING)
+    finishReplay();
+  pinTraceMode = PIN_TRACE_IDLE;
+}
+
+void pinTraceInfo() {
+  if (!trace || !validTrace()) {
+    Serial.printf("No pin trace, %u bytes\n", traceLen);
+    return;
+  }
+
+  uint32_t changes = 0, total = 0, offset = PIN_TRACE_HEADER;
+  while (offset < traceLen) {
+    uint32_t delta;
+    uint8_t n = getVarint(offset, &delta);
+    if (!n || offset + n >= traceLen)
+      break;
+    total += delta;
+    offset += n + 1;
+    changes++;
+  }
+  Serial.printf("Pin trace %u bytes, %u changes over %u ms, pins %08x%08x%s\n", traceLen, changes, total / 1000,
+                (uint32_t) (getMask(&trace[3]) >> 32), (uint32_t) getMask(&trace[3]),
+                offset < traceLen ? ", truncated" : "");
+}
+
+void pinTraceDump() {
+  Serial.printf("pintrace %u\n", traceLen);
+  for (uint32_t i = 0; i < traceLen; i++)
+    Serial.printf((i % 32 == 31 || i == traceLen - 1) ? "%02x\n" : "%02x", trace[i]);
+  Serial.println("end");
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Append hex; to an uploaded trace */
+static int readTraceChunk() {
+  char hex[PIN_TRACE_HEX_CHUNK];
+  uint8_t bytes[PIN_TRACE_HEX_CHUNK / 2];
+
+  serialTimedSkipWhitespace(NULL);
+  int len = serialTimedReadUntil(';', hex, sizeof(hex));
+  if (len == -2) {
+    Serial.printf("Up to %d hex digits at a time\n", PIN_TRACE_HEX_CHUNK);
+    return -1;
+  }
+  if (len < 0) {
+    Serial.println("Timeout reading hex");
+    return -1;
+  }
+  if (len % 2) {
+    Serial.println("Odd number of hex digits");
+    return -1;
+  }
+  if (traceLen + len / 2 > PIN_TRACE_BYTES) {
+    Serial.printf("Pin traces are up to %d bytes\n", PIN_TRACE_BYTES);
+    return -1;
+  }
+
+  // The whole chunk is checked before any of it is added to the trace
+  for (int i = 0; i < len; i += 2) {
+    int high = hexDigit(hex[i]), low = hexDigit(hex[i + 1]);
+    if (high < 0 || low < 0) {
+      Serial.println("Invalid hex");
+      return -1;
+    }
+    bytes[i / 2] = (high << 4) | low;
+  }
+
+  if (!allocTrace())
+    return -1;
+  memcpy(&trace[traceLen], bytes, len / 2);
+  traceLen += len / 2;
+  return 0;
+}
+
+int readPinTraceCommandFromSerial() {
+  int op = serialTimedPeek();
+
+  if (op == -1) {
+    Serial.println("No pin trace command");
+    return -1;
+  }
+  serialInput->read();
+
+  // Nothing changes the trace while it's in use
+  if (pinTraceMode != PIN_TRACE_IDLE && op != 'x' && op != 'i') {
+    Serial.println("Pin trace busy, Ix stops it");
+    return -1;
+  }
+
+  switch (op) {
+    case 'r':
+      return pinTraceStartRecording() ? 0 : -1;
+    case 'p':
+      return pinTraceStartReplay() ? 0 : -1;
+    case 'x':
+      pinTraceStop();
+      pinTraceInfo();
+      return 0;
+    case 'i':
+      pinTraceInfo();
+      return 0;
+    case 'd':
+      pinTraceDump();
+      return 0;
+    case 'c':
+      freeTrace();
+      return 0;
+    case 'w':
+      return readTraceChunk();
+  }
+
+  Serial.printf("Unknown pin trace command '%c'\n", op);
+  return -1;
+}
@@ -0,0 +1,73 @@
+#ifndef PinTrace_h
+#define PinTrace_h
+
+#include <stdint.h>
+
+/* Pin trace record and replay
+ *
+ * Recording keeps every raw level change checkPinChange() sees on the
+ * native pins, timed in microseconds, so the bounce and press patterns of
+ * real hardware can be saved and fed back in as a fixed benchmark for
+ * debounce, binding and gesture changes. Replaying takes the levels of
+ * the pins in the trace from it instead of digitalRead(), at the recorded
+ * pace, through the same path as real presses.
+ *
+ * The trace is binary, downloaded and uploaded over the console as hex
+ * with tools/pin_trace.py:
+ *
+ *   'P' 'T' version
+ *   watched pins, 8 bytes little endian, bit n is GPIO n
+ *   levels when recording started, the same way
+ *   then per change a varint of the microseconds since the one before
+ *   (or the start) and a byte of pin << 1 | level */
+
+#define PIN_TRACE_BYTES       8192
+#define PIN_TRACE_VERSION     1
+#define PIN_TRACE_HEADER      19
+#define PIN_TRACE_TAIL_MS     1000    // Replay holds the last levels this long for debounce to settle
+
+typedef enum {
+  PIN_TRACE_IDLE = 0,
+  PIN_TRACE_RECORDING,
+  PIN_TRACE_REPLAYING
+} pin_trace_mode_t;
+
+// Only touched from loop()
+extern pin_trace_mode_t pinTraceMode;
+
+void pinTraceRecord(uint8_t pin, uint8_t level);
+void pinTraceAdvance();
+uint8_t pinTraceLevel(uint8_t pin);
+bool pinTraceReplays(uint8_t pin);
+
+/* A raw level change, kept while recording */
+static inline void pinTraceChange(uint8_t pin, uint8_t level) {
+  if (pinTraceMode == PIN_TRACE_RECORDING)
+    pinTraceRecord(pin, level);
+}
+
+/* Once per pass over the pins, moves a replay on to the current time */
+static inline void pinTracePoll() {
+  if (pinTraceMode == PIN_TRACE_REPLAYING)
+    pinTraceAdvance();
+}
+
+/* True with the replayed level if a replay drives this pin */
+static inline bool pinTraceRead(uint8_t pin, uint8_t *level) {
+  if (pinTraceMode != PIN_TRACE_REPLAYING || !pinTraceReplays(pin))
+    return false;
+  *level = pinTraceLevel(pin);
+  return true;
+}
+
+bool pinTraceStartRecording();
+bool pinTraceStartReplay();
+void pinTraceStop();
+void pinTraceDump();
+void pinTraceInfo();
+
+/* Console 'I' commands: Ir records, Ip replays, Ix stops, Id dumps,
+ * Ii describes the trace, Ic clears it and Iw hex; appends to it */
+int readPinTraceCommandFromSerial();
+
+#endif
@@ -0,0 +1,246 @@
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include "SerialUtil.h"
+#include "Profiler.h"
+
+/* The interrupted task's registers are saved on its stack before the
+ * handler runs and the outermost interrupt leaves the TCB's first field,
+ * pxTopOfStack, pointing at them */
+#if __has_include(<freertos/xtensa_context.h>)
+#include <freertos/xtensa_context.h>
+#define PROFILE_HAS_PC 1
+#elif __has_include(<xtensa_context.h>)
+#include <xtensa_context.h>
+#define PROFILE_HAS_PC 1
+#endif
+
+typedef struct {
+  uint32_t micros;
+  uint32_t pc;
+  uint32_t task;                // The interrupted task's handle
+} profile_sample_t;
+
+typedef struct {
+  uint32_t micros;
+  uint32_t task;
+  uint8_t span;
+  uint8_t core;
+  uint8_t begin;
+} profile_span_event_t;
+
+typedef struct {
+  uint8_t core;
+  bool start;
+  TaskHandle_t caller;
+} timer_job_t;
+
+std::atomic<bool> profiling(false);
+
+// Each core's samples are only written by that core's timer interrupt
+static profile_sample_t *samples[portNUM_PROCESSORS];
+static volatile uint32_t sampleCounts[portNUM_PROCESSORS];
+// Spans are recorded from any task with only a relaxed check of profiling,
+// so a task could still be writing one after a capture stops. The buffer
+// is kept once allocated rather than freed from under it
+static profile_span_event_t *spanEvents = NULL;
+static std::atomic<uint32_t> spanCount(0);
+static hw_timer_t *timers[portNUM_PROCESSORS];
+static uint32_t sampleRate = 0;
+
+static const char *spanNames[SPAN_COUNT] = {
+  "checkPinsAndCallback", "directSendMsg", "handle_gatts_event", "update_screen_status", "serialEvent"
+};
+
+static IRAM_ATTR void takeSample(uint8_t core) {
+  uint32_t n = sampleCounts[core];
+  if (n >= PROFILE_SAMPLES)
+    return;
+
+  TaskHandle_t task = xTaskGetCurrentTaskHandleForCPU(core);
+  samples[core][n].micros = esp_timer_get_time();
+  samples[core][n].task = (uint32_t) (uintptr_t) task;
+#ifdef PROFILE_HAS_PC
+  const XtExcFrame *frame = *(XtExcFrame * const *) task;
+  samples[core][n].pc = frame->pc;
+#else
+  samples[core][n].pc = 0;
+#endif
+  sampleCounts[core] = n + 1;
+}
+
+static IRAM_ATTR void sampleCore0() {
+  takeSample(0);
+}
+
+static IRAM_ATTR void sampleCore1() {
+  takeSample(1);
+}
+
+/* Timer interrupts are allocated on, and have to be freed from, the core
+ * that attaches them so each core's timer is set up by a task pinned there */
+static void timerJob(void *arg) {
+  timer_job_t *job = (timer_job_t *) arg;
+  uint8_t core = job->core;
+
+  if (job->start) {
+    // 80MHz APB clock divided down to microseconds
+    timers[core] = timerBegin(PROFILE_FIRST_TIMER + core, 80, true);
+    // Level triggered, the core doesn't support edge timer interrupts
+    timerAttachInterrupt(timers[core], core ? sampleCore1 : sampleCore0, false);
+    timerAlarmWrite(timers[core], 1000000UL / sampleRate, true);
+    timerAlarmEnable(timers[core]);
+  } else if (timers[core]) {
+    timerAlarmDisable(timers[core]);
+    timerDetachInterrupt(timers[core]);
+    timerEnd(timers[core]);
+    timers[core] = NULL;
+  }
+
+  xTaskNotifyGive(job->caller);
+  vTaskDelete(NULL);
+}
+
+static void runTimerJob(uint8_t core, bool start) {
+  timer_job_t job = { core, start, xTaskGetCurrentTaskHandle() };
+  if (xTaskCreatePinnedToCore(timerJob, "profiler", 2048, &job, configMAX_PRIORITIES - 1, NULL, core) == pdPASS)
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+/* Only the samples, their timers are stopped so nothing writes them */
+static void freeBuffers() {
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    heap_caps_free(samples[core]);
+    samples[core] = NULL;
+  }
+}
+
+/* Names for the task handles in the capture, of the tasks still running */
+static void printTaskNames() {
+#if configUSE_TRACE_FACILITY
+  UBaseType_t count = uxTaskGetNumberOfTasks() + 4;
+  TaskStatus_t *tasks = (TaskStatus_t *) malloc(count * sizeof(TaskStatus_t));
+  if (!tasks)
+    return;
+  count = uxTaskGetSystemState(tasks, count, NULL);
+  for (UBaseType_t i = 0; i < count; i++)
+    Serial.printf("T %08x %s\n", (uint32_t) (uintptr_t) tasks[i].xHandle, tasks[i].pcTaskName);
+  free(tasks);
+#endif
+}
+
+void profileRecordSpan(profile_span_t span, bool begin) {
+  uint32_t n = spanCount.fetch_add(1, std::memory_order_relaxed);
+  if (n >= PROFILE_SPAN_EVENTS)
+    return;
+
+  spanEvents[n].micros = esp_timer_get_time();
+  spanEvents[n].task = (uint32_t) (uintptr_t) xTaskGetCurrentTaskHandle();
+  spanEvents[n].span = span;
+  spanEvents[n].core = xPortGetCoreID();
+  spanEvents[n].begin = begin;
+}
+
+bool profileStart(uint32_t rateHz) {
+  profileStop();
+  if (!rateHz || rateHz > 1000000UL)
+    return false;
+
+  // The interrupts write these so they have to be internal RAM
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    if (!samples[core])
+      samples[core] = (profile_sample_t *) heap_caps_malloc(PROFILE_SAMPLES * sizeof(profile_sample_t),
+                                                            MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    sampleCounts[core] = 0;
+  }
+  if (!spanEvents)
+    spanEvents = (profile_span_event_t *) heap_caps_malloc(PROFILE_SPAN_EVENTS * sizeof(profile_span_event_t),
+                                                           MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    if (!samples[core] || !spanEvents) {
+      Serial.println("Not enough memory to profile");
+      freeBuffers();
+      return false;
+    }
+  }
+
+  sampleRate = rateHz;
+  spanCount.store(0, std::memory_order_relaxed);
+  profiling.store(true, std::memory_order_release);
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    runTimerJob(core, true);
+
+  Serial.printf("Profiling at %u Hz, %d samples per core\n", sampleRate, PROFILE_SAMPLES);
+  return true;
+}
+
+void profileStop() {
+  if (!profiling.load(std::memory_order_acquire))
+    return;
+
+  profiling.store(false, std::memory_order_release);
+  for (int core = 0; core < portNUM_PROCESSORS; core++)
+    runTimerJob(core, false);
+}
+
+void profileDump() {
+  profileStop();
+  if (!samples[0]) {
+    Serial.println("No profile, start one with Ps");
+    return;
+  }
+  // Let a span that was being recorded as the capture stopped finish
+  vTaskDelay(1);
+
+  Serial.printf("profile %u %d\n", sampleRate, portNUM_PROCESSORS);
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    for (uint32_t i = 0; i < sampleCounts[core]; i++)
+      Serial.printf("S %d %08x %u %08x\n", core, samples[core][i].task, samples[core][i].micros,
+                    samples[core][i].pc);
+  }
+
+  uint32_t spans = spanCount.load(std::memory_order_relaxed);
+  if (spans > PROFILE_SPAN_EVENTS)
+    spans = PROFILE_SPAN_EVENTS;
+  for (uint32_t i = 0; i < spans; i++) {
+    profile_span_event_t *event = &spanEvents[i];
+    Serial.printf("%c %d %08x %u %s\n", event->begin ? 'B' : 'E', event->core, event->task, event->micros,
+                  spanNames[event->span]);
+  }
+  printTaskNames();
+  Serial.println("end");
+
+  freeBuffers();
+}
+
+int readProfilerCommandFromSerial() {
+  int op = serialTimedPeek();
+  uint8_t rate;
+  char terminator;
+
+  if (op == -1) {
+    Serial.println("No profiler command");
+    return -1;
+  }
+  serialInput->read();
+
+  switch (op) {
+    case 's':
+      if (serialTimedReadNum(&rate, &terminator, false) || terminator != ';' || !rate) {
+        Serial.println("Invalid rate, hundreds of Hz");
+        return -1;
+      }
+      serialInput->read();
+      return profileStart(rate * 100UL) ? 0 : -1;
+    case 'x':
+      profileStop();
+      Serial.println("Profiling stopped");
+      return 0;
+    case 'd':
+      profileDump();
+      return 0;
+  }
+
+  Serial.printf("Unknown profiler command '%c'\n", op);
+  return -1;
+}
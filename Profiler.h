@@ -0,0 +1,59 @@
+#ifndef Profiler_h
+#define Profiler_h
+
+#include <atomic>
+#include <stdint.h>
+
+/* Sampling profiler
+ *
+ * A hardware timer on each core interrupts at the sampling rate and takes
+ * the PC of the task it interrupted into a RAM buffer, alongside begin and
+ * end marks for spans of interest. Nothing is recorded until a capture is
+ * started from the console, then it runs until the buffers fill or it's
+ * stopped. 'Pd' dumps the capture as text for tools/profile_trace.py to
+ * turn into Chrome trace events or folded stacks for a flame graph:
+ *
+ *   profile <rate Hz> <cores>
+ *   S <core> <task> <micros> <pc>      a sample of the task running
+ *   B <core> <task> <micros> <span>    a span began
+ *   E <core> <task> <micros> <span>    a span ended
+ *   T <task> <name>                    a task still running at the dump
+ *   end */
+
+#define PROFILE_SAMPLES       2048    // Per core
+#define PROFILE_SPAN_EVENTS   1024
+#define PROFILE_FIRST_TIMER   2       // Hardware timers used, one per core from this one
+
+typedef enum {
+  SPAN_CHECK_PINS = 0,
+  SPAN_SEND_MSG,
+  SPAN_GATTS_EVENT,
+  SPAN_SCREEN_STATUS,
+  SPAN_SERIAL,
+  SPAN_COUNT
+} profile_span_t;
+
+extern std::atomic<bool> profiling;
+
+void profileRecordSpan(profile_span_t span, bool begin);
+
+/* Only a relaxed load unless a capture is running */
+static inline void profileBegin(profile_span_t span) {
+  if (profiling.load(std::memory_order_relaxed))
+    profileRecordSpan(span, true);
+}
+
+static inline void profileEnd(profile_span_t span) {
+  if (profiling.load(std::memory_order_relaxed))
+    profileRecordSpan(span, false);
+}
+
+/* Start a capture sampling at rateHz, false if the buffers can't be allocated */
+bool profileStart(uint32_t rateHz);
+void profileStop();
+/* Stop, print the capture and free the sample buffers */
+void profileDump();
+/* Ps <hundreds of Hz>; starts, Px stops, Pd dumps */
+int readProfilerCommandFromSerial();
+
+#endif
@@ -0,0 +1,93 @@
+#include <Arduino.h>
+#include <driver/pcnt.h>
+#include "RotaryEncoder.h"
+
+typedef struct {
+  bool active;
+  uint8_t countsPerDetent;
+  int16_t lastCount;      // Hardware count at the last read
+  int16_t partial;        // Counts towards the next detent
+} encoder_state_t;
+
+static encoder_state_t encoders[ROTARY_ENCODER_MAX];
+
+bool rotaryEncoderBegin(uint8_t encoder, uint8_t pinA, uint8_t pinB, uint8_t countsPerDetent) {
+  if (encoder >= ROTARY_ENCODER_MAX || !countsPerDetent) {
+    Serial.printf("Invalid rotary encoder %d\n", encoder);
+    return false;
+  }
+
+  pcnt_unit_t unit = (pcnt_unit_t) (PCNT_UNIT_0 + encoder);
+  pcnt_config_t config;
+
+  // Channel 0 counts edges on A in the direction given by B, channel 1 
+  // edges on B in the direction given by A, together that's full x4 decoding
+  memset(&config, 0, sizeof(config));
+  config.unit           = unit;
+  config.channel        = PCNT_CHANNEL_0;
+  config.pulse_gpio_num = pinA;
+  config.ctrl_gpio_num  = pinB;
+  config.pos_mode       = PCNT_COUNT_DEC;
+  config.neg_mode       = PCNT_COUNT_INC;
+  config.lctrl_mode     = PCNT_MODE_REVERSE;
+  config.hctrl_mode     = PCNT_MODE_KEEP;
+  config.counter_h_lim  = ROTARY_ENCODER_COUNTER_LIMIT;
+  config.counter_l_lim  = -ROTARY_ENCODER_COUNTER_LIMIT;
+  if (pcnt_unit_config(&config) != ESP_OK) {
+    Serial.printf("Failed to set up pulse counter for encoder %d\n", encoder);
+    return false;
+  }
+
+  config.channel        = PCNT_CHANNEL_1;
+  config.pulse_gpio_num = pinB;
+  config.ctrl_gpio_num  = pinA;
+  config.pos_mode       = PCNT_COUNT_INC;
+  config.neg_mode       = PCNT_COUNT_DEC;
+  pcnt_unit_config(&config);
+
+  if (pinA < 34)
+    gpio_pullup_en((gpio_num_t) pinA);
+  if (pinB < 34)
+    gpio_pullup_en((gpio_num_t) pinB);
+
+  pcnt_set_filter_value(unit, ROTARY_ENCODER_FILTER_APB_CYCLES);
+  pcnt_filter_enable(unit);
+
+  pcnt_counter_pause(unit);
+  pcnt_counter_clear(unit);
+  pcnt_counter_resume(unit);
+
+  encoders[encoder].active = true;
+  encoders[encoder].countsPerDetent = countsPerDetent;
+  encoders[encoder].lastCount = 0;
+  encoders[encoder].partial = 0;
+
+  Serial.printf("Rotary encoder %d on pins %d and %d\n", encoder, pinA, pinB);
+  return true;
+}
+
+int rotaryEncoderReadDetents(uint8_t encoder) {
+  if (encoder >= ROTARY_ENCODER_MAX || !encoders[encoder].active)
+    return 0;
+
+  encoder_state_t *state = &encoders[encoder];
+  int16_t count;
+  if (pcnt_get_counter_value((pcnt_unit_t) (PCNT_UNIT_0 + encoder), &count) != ESP_OK)
+    return 0;
+
+  // The counter goes back to 0 at either limit, so counts are modulo the
+  // limit and as long as it's read at least every few thousand counts the
+  // shortest way round is the right one. The counter is never cleared
+  // here so no edges are lost between reading and clearing.
+  int delta = count - state->lastCount;
+  if (delta > ROTARY_ENCODER_COUNTER_LIMIT / 2)
+    delta -= ROTARY_ENCODER_COUNTER_LIMIT;
+  else if (delta < -ROTARY_ENCODER_COUNTER_LIMIT / 2)
+    delta += ROTARY_ENCODER_COUNTER_LIMIT;
+  state->lastCount = count;
+
+  int counts = state->partial + delta;
+  int detents = counts / state->countsPerDetent;
+  state->partial = counts - detents * state->countsPerDetent;
+  return detents;
+}
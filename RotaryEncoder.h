@@ -0,0 +1,26 @@
+#ifndef RotaryEncoder_h
+#define RotaryEncoder_h
+
+#include <stdint.h>
+
+/* Quadrature rotary encoders decoded by the ESP32 pulse counter (PCNT)
+ *
+ * Both edges of both signals are counted in hardware, so turning the knob
+ * costs no CPU at all. The count is read whenever the caller gets round to
+ * it, everything that happened since the last read comes back as one
+ * delta in detents, so a fast spin is a single large delta. 
+ *
+ * A and B need pull ups, the internal ones are enabled. Pins 34-39 
+ * have none and need external resistors */
+
+#define ROTARY_ENCODER_MAX                2
+#define ROTARY_ENCODER_COUNTS_PER_DETENT  4      // Edges per click on most mechanical encoders
+#define ROTARY_ENCODER_FILTER_APB_CYCLES  1000   // Ignore pulses shorter than this (12.5us at 80MHz)
+#define ROTARY_ENCODER_COUNTER_LIMIT      10000  // The hardware counter wraps to 0 at +/- this
+
+bool rotaryEncoderBegin(uint8_t encoder, uint8_t pinA, uint8_t pinB,
+                        uint8_t countsPerDetent = ROTARY_ENCODER_COUNTS_PER_DETENT);
+/* Detents turned since the last call, positive is clockwise */
+int rotaryEncoderReadDetents(uint8_t encoder);
+
+#endif
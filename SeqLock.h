@@ -0,0 +1,40 @@
+#ifndef SeqLock_h
+#define SeqLock_h
+
+#include <atomic>
+
+/* Single writer sequence lock. The writer never blocks and readers on
+ * any task or core retry until they get a copy that wasn't torn by a
+ * concurrent write. Only for small plain data that is cheap to copy */
+template <typename T>
+class SeqLock {
+  public:
+    SeqLock() : seq(0), value() {}
+
+    /* Must only be called from one task */
+    void write(const T &newValue) {
+      uint32_t s = seq.load(std::memory_order_relaxed);
+      seq.store(s + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      value = newValue;
+      seq.store(s + 2, std::memory_order_release);
+    }
+
+    T read() const {
+      T copy;
+      uint32_t before, after;
+      do {
+        before = seq.load(std::memory_order_acquire);
+        copy = value;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = seq.load(std::memory_order_relaxed);
+      } while ((before & 1) || before != after);
+      return copy;
+    }
+
+  private:
+    std::atomic<uint32_t> seq;
+    T value;
+};
+
+#endif
@@ -1,17 +1,74 @@
 #include <Arduino.h>
+#include <sys/param.h>
+#include "ConsoleUart.h"
 #include "SerialUtil.h"
 
+Stream *serialInput = &Serial;
+unsigned long (*serialMillis)() = millis;
+#ifdef CONSOLE_UART_IDF
+bool (*serialWait)(unsigned long ms) = consoleUartWait;
+#else
+bool (*serialWait)(unsigned long ms) = NULL;
+#endif
+static unsigned long commandStartMillis;
+static bool commandExpired = false;
+static bool discarding = false;
+
+void serialCommandBegin() {
+  commandStartMillis = serialMillis();
+  commandExpired = false;
+}
+
+/* A new budget for the next part of a bulk upload */
+void serialCommandExtend() {
+  commandStartMillis = serialMillis();
+}
+
+bool serialCommandExpired() {
+  return commandExpired;
+}
+
+unsigned long serialCommandStartMillis() {
+  return commandStartMillis;
+}
+
+void serialCommandEnd() {
+  if (!commandExpired)
+    return;
+  commandExpired = false;
+  Serial.printf("Command over its %d ms budget, abandoned, dropping input up to ';'\n", SERIAL_COMMAND_BUDGET_MS);
+  discarding = true;
+  serialDiscarding();
+}
+
+/* Only drops what has arrived, the rest is dropped on later calls */
+bool serialDiscarding() {
+  while (discarding && serialInput->available()) {
+    if (serialInput->read() == ';')
+      discarding = false;
+  }
+  return discarding;
+}
+
+/* Waits up to SERIAL_TIMEOUT_MS for a byte, but gives up as soon as the
+ * command has had its SERIAL_COMMAND_BUDGET_MS, so a byte trickled in
+ * just inside each timeout can't hold loop() for ever */
 int serialTimedPeek() {
-  int c;
-  unsigned long _startMillis;
+  unsigned long _startMillis, now;
 
-  _startMillis = millis();
+  now = _startMillis = serialMillis();
   do {
-    if (Serial.available()) {
-      c = Serial.peek();
-      return c;
+    unsigned long spent = now - commandStartMillis;
+    if (spent >= SERIAL_COMMAND_BUDGET_MS) {
+      commandExpired = true;
+      break;
     }
-  } while(millis() - _startMillis < SERIAL_TIMEOUT_MS);
+    if (serialInput->available())
+      return serialInput->peek();
+    if (serialWait)
+      serialWait(MIN(SERIAL_TIMEOUT_MS - (now - _startMillis), SERIAL_COMMAND_BUDGET_MS - spent));
+    now = serialMillis();
+  } while(now - _startMillis < SERIAL_TIMEOUT_MS);
   return -1;     // -1 indicates timeout
 }
 
@@ -21,7 +78,7 @@ int serialTimedSkipWhitespace(char *terminator) {
     if (nextChar == -1)
       return -1;
     else if (nextChar == ' ' || nextChar == '\t')
-      Serial.read();
+      serialInput->read();
     else {
       if (terminator)
         *terminator = nextChar;
@@ -61,7 +118,7 @@ int serialTimedReadNum(uint8_t *out, char *terminator, bool hex) {
       return 0;
     }
 
-    Serial.read();
+    serialInput->read();
 
     *out *= hex ? 16 : 10;
     *out += charVal;
@@ -69,6 +126,24 @@ int serialTimedReadNum(uint8_t *out, char *terminator, bool hex) {
   }
 }
 
+int serialTimedReadUntil(char terminator, char *buffer, size_t len) {
+  size_t n = 0;
+  bool overflow = false;
+
+  while (true) {
+    int c = serialTimedPeek();
+    if (c == -1)
+      return -1;
+    serialInput->read();
+    if (c == terminator)
+      return overflow ? -2 : n;
+    if (n < len)
+      buffer[n++] = c;
+    else
+      overflow = true;
+  }
+}
+
 void serialPrintHex(long num) {
   if (num < 16)
     Serial.print("0");
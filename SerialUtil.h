@@ -1,11 +1,40 @@
 #ifndef SerialUtil_h
 #define SerialUtil_h
 
+#include <Arduino.h>
+
 #define SERIAL_TIMEOUT_MS 500
+// Longest one console command can keep loop() waiting, however its bytes
+// arrive. Each command starts with serialCommandBegin(), bulk uploads
+// restart it with serialCommandExtend() after each keystroke they take
+// in. A command that runs out is abandoned, serialCommandEnd() reports
+// it and the rest of it up to its ';' is dropped rather than run as
+// commands
+#define SERIAL_COMMAND_BUDGET_MS 1000
+
+// What the timed reads read from and their clock, normally Serial and
+// millis(), swapped by the parser harness (ConsoleWcet.h)
+extern Stream *serialInput;
+extern unsigned long (*serialMillis)();
+// Blocks until a byte arrives or ms pass, so a timed read sleeps rather
+// than spinning on available(). NULL to poll, as the harness does
+extern bool (*serialWait)(unsigned long ms);
+
+void serialCommandBegin();
+void serialCommandExtend();
+void serialCommandEnd();
+bool serialCommandExpired();
+unsigned long serialCommandStartMillis();
+/* True while an abandoned command is still being dropped */
+bool serialDiscarding();
 
 int serialTimedPeek();
 int serialTimedSkipWhitespace(char *terminator);
 int serialTimedReadNum(uint8_t *out, char *terminator, bool hex);
+/* Read up to len bytes before terminator, which is read but not stored.
+ * Returns how many were stored, -1 if the terminator didn't arrive in
+ * time or -2 if there were more than len, those are dropped */
+int serialTimedReadUntil(char terminator, char *buffer, size_t len);
 void serialPrintHex(long num);
 
 #endif
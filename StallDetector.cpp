@@ -0,0 +1,262 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "StallDetector.h"
+
+#if __has_include(<esp_debug_helpers.h>) && __has_include(<freertos/xtensa_context.h>)
+#include <esp_debug_helpers.h>
+#include <esp_ipc.h>
+#include <freertos/xtensa_context.h>
+#define STALL_BACKTRACE 1
+#endif
+
+static std::atomic<uint32_t> states[STALL_TASK_COUNT];
+// The task last seen in each stage, so the watchdog knows whose stack to walk
+static std::atomic<TaskHandle_t> handles[STALL_TASK_COUNT];
+static uint8_t budgetMillis = STALL_BUDGET_MS;
+static TaskHandle_t loopTask = NULL;
+static esp_timer_handle_t watchdogTimer = NULL;
+
+// The last state the watchdog recorded for each task, only used by the watchdog
+static uint32_t watchedStates[STALL_TASK_COUNT];
+
+// Written by the tasks as their stages end and by the watchdog
+static stall_record_t records[STALL_RECORDS];
+static uint32_t recordCount = 0;
+static portMUX_TYPE recordMux = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *taskNames[STALL_TASK_COUNT] = { "loop", "ble", "console" };
+static const char *stageNames[STAGE_COUNT] = {
+  "idle", "check pins", "light messages", "screen idle", "M5 update", "buttons", "encoder",
+  "light flush", "serial", "light wait", "screen status", "send string", "ble begin", "ble event"
+};
+
+static uint32_t stageBudget(stall_stage_t stage) {
+  return stage == STAGE_LIGHT_WAIT ? STALL_WAIT_BUDGET_MS : budgetMillis;
+}
+
+static uint32_t stateElapsed(uint32_t state, uint32_t now) {
+  return (now - STALL_STATE_MILLIS(state)) & 0xffffff;
+}
+
+/* The record for a stage that started at atMillis, called with recordMux held */
+static stall_record_t *findRecord(uint8_t task, uint32_t atMillis, uint8_t ended) {
+  uint32_t first = recordCount > STALL_RECORDS ? recordCount - STALL_RECORDS : 0;
+  for (uint32_t i = first; i < recordCount; i++) {
+    stall_record_t *record = &records[i % STALL_RECORDS];
+    if (record->ended == ended && record->task == task && record->atMillis == atMillis)
+      return record;
+  }
+  return NULL;
+}
+
+/* The record the watchdog made for a stage that was still running */
+static stall_record_t *findRunning(uint8_t task, uint32_t atMillis) {
+  return findRecord(task, atMillis, 0);
+}
+
+typedef struct {
+  TaskHandle_t task;
+  stall_record_t *record;
+} backtrace_job_t;
+
+static uint32_t framePc(uint32_t pc) {
+  // The top bits are the call's window size
+  if (pc & 0x80000000)
+    pc = (pc & 0x3fffffff) | 0x40000000;
+  return pc;
+}
+
+/* Walks a task that isn't running from the frame it saved when it was
+ * switched out, the PC it stopped at and then return addresses as
+ * addr2line wants them */
+static void walkTask(void *arg) {
+#ifdef STALL_BACKTRACE
+  backtrace_job_t *job = (backtrace_job_t *) arg;
+  stall_record_t *record = job->record;
+  // The saved frame's address is the first word of the task's TCB
+  const XtExcFrame *saved = *(XtExcFrame * const *) job->task;
+  esp_backtrace_frame_t frame;
+
+  // Preempted tasks save an interrupt frame, ones that blocked a shorter
+  // one with no exit handler
+  if (saved->exit) {
+    frame.pc = saved->pc;
+    frame.sp = saved->a1;
+    frame.next_pc = saved->a0;
+  } else {
+    const XtSolFrame *solicited = (const XtSolFrame *) saved;
+    frame.pc = solicited->pc;
+    frame.sp = solicited->a1;
+    frame.next_pc = solicited->a0;
+  }
+
+  record->backtrace[record->depth++] = framePc(frame.pc);
+  while (record->depth < STALL_BACKTRACE_DEPTH && frame.next_pc &&
+         esp_backtrace_get_next_frame(&frame) && frame.pc)
+    record->backtrace[record->depth++] = framePc(frame.pc) - 3;
+#endif
+}
+
+/* Where a stalled task is now. A task running on the other core has no
+ * saved frame yet, so the walk runs there from the IPC task, which
+ * switches the stalled task out first */
+static void captureBacktrace(TaskHandle_t task, stall_record_t *record) {
+  record->depth = 0;
+#ifdef STALL_BACKTRACE
+  if (!task)
+    return;
+
+  backtrace_job_t job = { task, record };
+  BaseType_t core = xTaskGetAffinity(task);
+  if (core == tskNO_AFFINITY)
+    core = eTaskGetState(task) == eRunning ? !xPortGetCoreID() : xPortGetCoreID();
+  if (core == xPortGetCoreID())
+    walkTask(&job);
+  else
+    esp_ipc_call_blocking(core, walkTask, &job);
+#endif
+}
+
+/* The task has finished the stage in state, record it if it was over budget */
+static void endStage(stall_task_t task, uint32_t state, uint32_t now) {
+  stall_stage_t stage = STALL_STATE_STAGE(state);
+  uint32_t took = stateElapsed(state, now);
+  if (stage == STAGE_IDLE || took <= stageBudget(stage))
+    return;
+
+  // Finish the watchdog's record if it saw this stage running, it keeps
+  // the backtrace from then. By now the task has moved on from the stall
+  portENTER_CRITICAL(&recordMux);
+  stall_record_t *record = findRunning(task, now - took);
+  if (!record) {
+    record = &records[recordCount++ % STALL_RECORDS];
+    record->atMillis = now - took;
+    record->task = task;
+    record->stage = stage;
+    record->depth = 0;
+  }
+  record->durationMillis = took;
+  record->ended = 1;
+  portEXIT_CRITICAL(&recordMux);
+}
+
+/* Runs on the esp_timer task, catches stages still running over budget */
+static void checkStalls(void *arg) {
+  uint32_t now = millis();
+
+  for (int task = 0; task < STALL_TASK_COUNT; task++) {
+    uint32_t state = states[task].load(std::memory_order_relaxed);
+    stall_stage_t stage = STALL_STATE_STAGE(state);
+    uint32_t took = stateElapsed(state, now);
+    if (stage == STAGE_IDLE || took <= stageBudget(stage))
+      continue;
+
+    if (watchedStates[task] == state) {
+      portENTER_CRITICAL(&recordMux);
+      stall_record_t *running = findRunning(task, now - took);
+      if (running)
+        running->durationMillis = took;
+      portEXIT_CRITICAL(&recordMux);
+      continue;
+    }
+
+    // A new stall, take the backtrace while the task is still in it. The
+    // walk can wait on the other core so it's done outside the lock
+    stall_record_t record;
+    record.atMillis = now - took;
+    record.durationMillis = took;
+    record.task = task;
+    record.stage = stage;
+    record.ended = 0;
+    captureBacktrace(handles[task].load(std::memory_order_relaxed), &record);
+    watchedStates[task] = state;
+
+    portENTER_CRITICAL(&recordMux);
+    // The stage may have ended during the walk and recorded itself
+    stall_record_t *ended = findRecord(task, record.atMillis, 1);
+    if (ended) {
+      ended->depth = record.depth;
+      memcpy(ended->backtrace, record.backtrace, sizeof(record.backtrace));
+    } else {
+      records[recordCount++ % STALL_RECORDS] = record;
+    }
+    portEXIT_CRITICAL(&recordMux);
+  }
+}
+
+void stallBegin() {
+  loopTask = xTaskGetCurrentTaskHandle();
+
+  if (!watchdogTimer) {
+    esp_timer_create_args_t timerArgs;
+    memset(&timerArgs, 0, sizeof(timerArgs));
+    timerArgs.callback = checkStalls;
+    timerArgs.name = "stalls";
+    esp_timer_create(&timerArgs, &watchdogTimer);
+    esp_timer_start_periodic(watchdogTimer, STALL_CHECK_MS * 1000UL);
+  }
+  Serial.printf("Stall budget %d ms\n", budgetMillis);
+}
+
+void stallSetBudget(uint8_t budget) {
+  // Unset is the default
+  budgetMillis = budget ? budget : STALL_BUDGET_MS;
+}
+
+uint8_t stallGetBudget() {
+  return budgetMillis;
+}
+
+void stallStage(stall_task_t task, stall_stage_t stage) {
+  uint32_t now = millis();
+  uint32_t state = states[task].load(std::memory_order_relaxed);
+  handles[task].store(xTaskGetCurrentTaskHandle(), std::memory_order_relaxed);
+  states[task].store(STALL_STATE(stage, now), std::memory_order_relaxed);
+  endStage(task, state, now);
+}
+
+uint32_t stallEnter(stall_task_t task, stall_stage_t stage) {
+  uint32_t state = states[task].load(std::memory_order_relaxed);
+  handles[task].store(xTaskGetCurrentTaskHandle(), std::memory_order_relaxed);
+  states[task].store(STALL_STATE(stage, millis()), std::memory_order_relaxed);
+  return state;
+}
+
+void stallLeave(stall_task_t task, uint32_t saved) {
+  uint32_t now = millis();
+  uint32_t state = states[task].load(std::memory_order_relaxed);
+  // The outer stage carries on from now, the time inside was the inner stage's
+  states[task].store(STALL_STATE(STALL_STATE_STAGE(saved), now), std::memory_order_relaxed);
+  endStage(task, state, now);
+}
+
+stall_task_t stallCurrentTask() {
+  TaskHandle_t current = xTaskGetCurrentTaskHandle();
+  if (current == loopTask)
+    return STALL_TASK_LOOP;
+  // The console task marks its first stage before it runs any command
+  if (current == handles[STALL_TASK_CONSOLE].load(std::memory_order_relaxed))
+    return STALL_TASK_CONSOLE;
+  return STALL_TASK_BLE;
+}
+
+void stallPrint() {
+  stall_record_t copy[STALL_RECORDS];
+  uint32_t count;
+
+  portENTER_CRITICAL(&recordMux);
+  memcpy(copy, records, sizeof(copy));
+  count = recordCount;
+  portEXIT_CRITICAL(&recordMux);
+
+  Serial.printf("Stall budget %d ms, %u stalls\n", budgetMillis, count);
+  uint32_t first = count > STALL_RECORDS ? count - STALL_RECORDS : 0;
+  for (uint32_t i = first; i < count; i++) {
+    stall_record_t *record = &copy[i % STALL_RECORDS];
+    Serial.printf("%s %s %u ms at %u%s", taskNames[record->task], stageNames[record->stage],
+                  record->durationMillis, record->atMillis, record->ended ? "" : " still running");
+    for (uint8_t d = 0; d < record->depth; d++)
+      Serial.printf(" 0x%08x", record->backtrace[d]);
+    Serial.println();
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef StallDetector_h
+#define StallDetector_h
+
+#include <atomic>
+#include <stdint.h>
+
+/* Finds where loop() or the BLE task stalled
+ *
+ * Each task marks the stage it's in, a single relaxed store of the stage
+ * and the millisecond it started. A stage that runs longer than the budget
+ * is recorded in a small ring with how long it took. An esp_timer watchdog
+ * finds stages still running past the budget, so a hang that never ends
+ * shows up too, and walks the stalled task's stack for a backtrace of
+ * where it was stuck. The ring is printed by the 't' console command */
+
+#ifndef STALL_BUDGET_MS
+#define STALL_BUDGET_MS        50     // Default, 'T ms;' on the console changes it
+#endif
+#define STALL_WAIT_BUDGET_MS   1000   // Waiting for light messages is allowed to take longer
+#define STALL_CHECK_MS         10     // Watchdog period
+#define STALL_RECORDS          8
+#define STALL_BACKTRACE_DEPTH  8
+
+typedef enum {
+  STALL_TASK_LOOP = 0,
+  STALL_TASK_BLE,                     // The stack's task running our event callbacks
+  STALL_TASK_CONSOLE,                 // Console commands with CONSOLE_UART_IDF
+  STALL_TASK_COUNT
+} stall_task_t;
+
+typedef enum {
+  STAGE_IDLE = 0,
+  STAGE_CHECK_PINS,
+  STAGE_LIGHT_MESSAGES,
+  STAGE_SCREEN_IDLE,
+  STAGE_M5_UPDATE,
+  STAGE_BUTTONS,
+  STAGE_ENCODER,
+  STAGE_LIGHT_FLUSH,
+  STAGE_SERIAL,
+  STAGE_LIGHT_WAIT,
+  STAGE_SCREEN_STATUS,
+  STAGE_SEND_STRING,
+  STAGE_BLE_BEGIN,
+  STAGE_BLE_EVENT,
+  STAGE_COUNT
+} stall_stage_t;
+
+// Stage in the top byte, the low 24 bits of millis() when it started
+#define STALL_STATE(stage, millis)   (((uint32_t) (stage) << 24) | ((millis) & 0xffffff))
+#define STALL_STATE_STAGE(state)     ((stall_stage_t) ((state) >> 24))
+#define STALL_STATE_MILLIS(state)    ((state) & 0xffffff)
+
+typedef struct {
+  uint32_t atMillis;                  // When the stage started
+  uint32_t durationMillis;            // So far if it hadn't ended when the watchdog saw it
+  uint8_t task;
+  uint8_t stage;
+  uint8_t ended;
+  uint8_t depth;
+  uint32_t backtrace[STALL_BACKTRACE_DEPTH];
+} stall_record_t;
+
+/* Start the watchdog, called from setup() so the calling task is loop()'s */
+void stallBegin();
+void stallSetBudget(uint8_t budgetMillis);    // 0 for the default
+uint8_t stallGetBudget();
+
+/* Move a task on to its next stage, ending the one it was in */
+void stallStage(stall_task_t task, stall_stage_t stage);
+/* Run a stage inside another, stallLeave() puts back what stallEnter() returns */
+uint32_t stallEnter(stall_task_t task, stall_stage_t stage);
+void stallLeave(stall_task_t task, uint32_t saved);
+/* loop()'s task, the console task or otherwise the BLE task, for code
+ * called from more than one */
+stall_task_t stallCurrentTask();
+
+void stallPrint();
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef TextBuffer_h
+#define TextBuffer_h
+
+#include <Print.h>
+
+/* Fixed size text buffer that can be printed to like a StreamString
+ * without touching the heap, output past the end is dropped */
+template <size_t SIZE>
+class TextBuffer : public Print {
+  public:
+    TextBuffer() : len(0) {
+      buf[0] = '\0';
+    }
+
+    size_t write(uint8_t c) {
+      if (len >= SIZE - 1)
+        return 0;
+      buf[len++] = c;
+      buf[len] = '\0';
+      return 1;
+    }
+
+    const char *c_str() const {
+      return buf;
+    }
+
+    size_t length() const {
+      return len;
+    }
+
+    void clear() {
+      len = 0;
+      buf[0] = '\0';
+    }
+
+  private:
+    char buf[SIZE];
+    size_t len;
+};
+
+#endif
@@ -0,0 +1,100 @@
+#include <string.h>
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel() : tick(0), tickMillis(0) {
+  memset(slots, 0, sizeof(slots));
+}
+
+void TimerWheel::begin(unsigned long nowMillis) {
+  tickMillis = nowMillis;
+}
+
+void TimerWheel::link(WheelTimer *timer, WheelTimer **head) {
+  timer->list = head;
+  timer->prev = NULL;
+  timer->next = *head;
+  if (*head)
+    (*head)->prev = timer;
+  *head = timer;
+}
+
+void TimerWheel::unlink(WheelTimer *timer) {
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    *timer->list = timer->next;
+  if (timer->next)
+    timer->next->prev = timer->prev;
+  timer->next = timer->prev = NULL;
+  timer->list = NULL;
+  timer->armed = false;
+}
+
+/* Move a slot's timers to a private list, timers on it can still be
+ * cancelled or re-armed while it's being worked through */
+void TimerWheel::detach(WheelTimer **head, WheelTimer **list) {
+  *list = *head;
+  *head = NULL;
+  for (WheelTimer *timer = *list; timer; timer = timer->next)
+    timer->list = list;
+}
+
+void TimerWheel::insert(WheelTimer *timer) {
+  uint32_t delta = timer->expires - tick;
+
+  if (delta > TIMER_WHEEL_MAX_TICKS) {
+    timer->expires = tick + TIMER_WHEEL_MAX_TICKS;
+    delta = TIMER_WHEEL_MAX_TICKS;
+  }
+
+  if (delta < TIMER_WHEEL_SLOTS)
+    link(timer, &slots[0][timer->expires & TIMER_WHEEL_MASK]);
+  else
+    link(timer, &slots[1][(timer->expires >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK]);
+  timer->armed = true;
+}
+
+void TimerWheel::schedule(WheelTimer *timer, uint32_t delayMillis) {
+  if (timer->armed)
+    unlink(timer);
+
+  uint32_t ticks = (delayMillis + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  timer->expires = tick + (ticks ? ticks : 1);
+  insert(timer);
+}
+
+void TimerWheel::cancel(WheelTimer *timer) {
+  if (timer->armed)
+    unlink(timer);
+}
+
+void TimerWheel::advance(unsigned long nowMillis) {
+  WheelTimer *list;
+
+  while (nowMillis - tickMillis >= TIMER_WHEEL_TICK_MS) {
+    tickMillis += TIMER_WHEEL_TICK_MS;
+    tick++;
+
+    // Starting a new lap of the first level, bring the next block of 
+    // timers down from the second level
+    if (!(tick & TIMER_WHEEL_MASK)) {
+      detach(&slots[1][(tick >> TIMER_WHEEL_BITS) & TIMER_WHEEL_MASK], &list);
+      while (list) {
+        WheelTimer *timer = list;
+        unlink(timer);
+        insert(timer);
+      }
+    }
+
+    // Callbacks are free to re-arm their own timer or cancel others
+    detach(&slots[0][tick & TIMER_WHEEL_MASK], &list);
+    while (list) {
+      WheelTimer *timer = list;
+      unlink(timer);
+      if (timer->expires != tick)
+        insert(timer);
+      else
+        timer->callback(timer);
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef TimerWheel_h
+#define TimerWheel_h
+
+#include <stdint.h>
+
+/* Hierarchical timer wheel
+ *
+ * Two levels of 64 slots, the first a slot per tick and the second a slot
+ * per 64 ticks, so with 5ms ticks timers can be up to ~20 seconds out. 
+ * Scheduling and cancelling are O(1), and advancing a tick only looks at
+ * the timers due in that tick plus, every 64 ticks, the timers moving down
+ * from the second level. The cost doesn't grow with the number of armed 
+ * timers. Timers are owned by the caller, nothing is allocated. */
+
+#define TIMER_WHEEL_TICK_MS  5
+#define TIMER_WHEEL_BITS     6
+#define TIMER_WHEEL_SLOTS    (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK     (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_TICKS (TIMER_WHEEL_SLOTS * TIMER_WHEEL_SLOTS - 1)
+
+struct WheelTimer;
+typedef void (*wheel_callback_t)(WheelTimer *timer);
+
+struct WheelTimer {
+  WheelTimer *next;
+  WheelTimer *prev;
+  WheelTimer **list;          // Head of the list it's on
+  uint32_t expires;           // Tick the timer is due
+  wheel_callback_t callback;
+  void *arg;
+  bool armed;
+};
+
+class TimerWheel {
+  public:
+    TimerWheel();
+    void begin(unsigned long nowMillis);
+    /* Arm (or re-arm) a timer delayMillis from now, rounded up to a tick */
+    void schedule(WheelTimer *timer, uint32_t delayMillis);
+    void cancel(WheelTimer *timer);
+    /* Run the timers that are due, call often */
+    void advance(unsigned long nowMillis);
+
+  private:
+    WheelTimer *slots[2][TIMER_WHEEL_SLOTS];
+    uint32_t tick;
+    unsigned long tickMillis;
+
+    void insert(WheelTimer *timer);
+    void link(WheelTimer *timer, WheelTimer **head);
+    void unlink(WheelTimer *timer);
+    void detach(WheelTimer **head, WheelTimer **list);
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include <Arduino.h>
+#include "SerialUtil.h"
+#include "HostProfiles.h"
+#include "TypingRate.h"
+
+int readTypingRateCommandFromSerial(calibrate_typing_t calibrate) {
+  int op = serialTimedPeek();
+  uint8_t gap;
+  char terminator;
+
+  if (op == -1) {
+    Serial.println("No typing rate command");
+    return -1;
+  }
+  serialInput->read();
+
+  if (op == 'p') {
+    Serial.printf("Typing gap %d ms\n", hostProfileTypingGap());
+    return hostProfileTypingGap();
+  }
+  if (op != 'c' && op != 's') {
+    Serial.printf("Unknown typing rate command '%c'\n", op);
+    return -1;
+  }
+
+  if (op == 's') {
+    if (serialTimedReadNum(&gap, &terminator, false) || terminator != ';' || gap > TYPING_GAP_MAX_MS) {
+      Serial.printf("Invalid gap, up to %d ms or 0 for the default\n", TYPING_GAP_MAX_MS);
+      return -1;
+    }
+    serialInput->read();
+  }
+
+  // The gap is kept in the host's profile
+  if (hostProfileConnected() == HOST_NONE) {
+    Serial.println("No connected host with a profile, Ha adds one");
+    return -1;
+  }
+
+  if (op == 'c') {
+    int measured = calibrate();
+    if (measured < 0)
+      return -1;
+    gap = measured;
+  }
+
+  if (!hostProfileSetTypingGap(gap))
+    return -1;
+  Serial.printf("Typing gap %d ms\n", hostProfileTypingGap());
+  return hostProfileTypingGap();
+}
@@ -0,0 +1,30 @@
+#ifndef TypingRate_h
+#define TypingRate_h
+
+#include <stdint.h>
+
+/* Per host typing rate
+ *
+ * Some hosts drop keys when reports come too quickly for their input
+ * stack (remote desktops in particular) however well the link keeps up.
+ * Calibration times how long the host takes to echo a Caps Lock press as
+ * an LED output report, first idle and then straight after bursts of
+ * lone Shift and Control presses at shorter and longer gaps. The shortest
+ * gap the host echoes after without a backlog is its safe rate, saved in
+ * the host's profile (HostProfiles.h) and used for key reports whenever
+ * it's connected */
+
+#define TYPING_GAP_DEFAULT_MS     3       // Between key reports for hosts that aren't calibrated
+#define TYPING_GAP_MAX_MS         50
+#define TYPING_ECHO_TIMEOUT_MS    500     // Longest to wait for the LED echo
+#define TYPING_PROBE_REPORTS      40      // Reports in each burst, alternating Shift and Control
+#define TYPING_BACKLOG_MS         10      // Echo slower than idle by more than this is a backlog
+
+/* Measure the connected host, returns the gap in ms or -1 */
+typedef int (*calibrate_typing_t)();
+
+/* Console 'D' commands: Dc calibrates the connected host, Ds ms; sets its
+ * gap (0 for the default) and Dp prints it. Returns the host's gap or -1 */
+int readTypingRateCommandFromSerial(calibrate_typing_t calibrate);
+
+#endif
@@ -3,10 +3,32 @@
 
 #include "SerialUtil.h":
 #include "eeprom_config.h"
+#if MAX_MATRIX_KEYS
+#include "KeyMatrix.h"
+#endif
+#include "Bindings.h"
+#include "Gestures.h"
+#include "MacroLibrary.h"
+#include "MacroImage.h"
+#include "KeyboardLayout.h"
+#ifdef ESP32
+#include "Metrics.h"
+#endif
+#include "StallDetector.h"
+#include "Profiler.h"
+#include "PinTrace.h"
+#ifdef ESP32
+#include "HostProfiles.h"
+#endif
+
+static_assert(SETTINGS_OFFSET + SETTINGS_SIZE <= EEPROM_SIZE,
+              "Input macros don't fit in the EEPROM");
 
 WATCH_TYPE pinsToWatch = 0; 
 WATCH_TYPE pinsLast = 0;
 
+static input_debounce_t pinDebounce;
+
 void initEeprom() {
   // Initialize the EEPROM library, only needed for the ESP32 compatibility library 
 #ifdef ESP32
@@ -15,7 +37,7 @@ void initEeprom() {
 #endif
 }
 
-inline void updateEeprom(uint16_t address, uint8_t value) {
+void updateEeprom(uint16_t address, uint8_t value) {
 #ifdef ESP32
   if (EEPROM.read(address) != value) 
     EEPROM.write(address, value);
@@ -51,11 +73,70 @@ void formatEeprom() {
     updateEeprom(eepromOffset + 1, 0);
   }
 
+  for (uint8_t key = 0; key < MAX_MATRIX_KEYS; key++) {
+    uint16_t eepromOffset = EEPROM_OFFSET(MATRIX_INPUT(key));
+    updateEeprom(eepromOffset, 0);
+    updateEeprom(eepromOffset + 1, 0);
+  }
+
+  for (uint8_t n = 0; n < MAX_EXPANDER_INPUTS; n++) {
+    uint16_t eepromOffset = EEPROM_OFFSET(EXPANDER_INPUT(n));
+    updateEeprom(eepromOffset, 0);
+    updateEeprom(eepromOffset + 1, 0);
+  }
+
+  for (uint8_t n = 0; n < MAX_ENCODER_INPUTS; n++) {
+    uint16_t eepromOffset = EEPROM_OFFSET(ENCODER_FIRST_INPUT + n);
+    updateEeprom(eepromOffset, 0);
+    updateEeprom(eepromOffset + 1, 0);
+  }
+
+  for (uint8_t n = 0; n < MAX_POOL_MACROS; n++) {
+    uint16_t eepromOffset = EEPROM_OFFSET(POOL_FIRST_INPUT + n);
+    updateEeprom(eepromOffset, 0);
+    updateEeprom(eepromOffset + 1, 0);
+  }
+
+  // Bindings, gestures and settings
+  for (uint16_t offset = 0; offset < MAX_BINDINGS * BINDING_SIZE + MAX_GESTURES * GESTURE_SIZE + SETTINGS_SIZE; offset++)
+    updateEeprom(BINDINGS_OFFSET + offset, 0);
+
 #ifdef ESP32
   EEPROM.commit();
 #endif
 }
 
+/* Print the keystrokes configured for an input, returns false if there are none */
+static bool printInputKeys(uint8_t input) {
+  uint16_t eepromOffset = EEPROM_OFFSET(input);
+
+  if (!EEPROM.read(eepromOffset + 1))
+    return false;
+
+  for (uint8_t keystrokeIdx = 0; keystrokeIdx < MAX_KEYSTROKES; keystrokeIdx++) {
+    uint8_t modifier = EEPROM.read(eepromOffset + (keystrokeIdx * 2));
+    uint8_t code     = EEPROM.read(eepromOffset + (keystrokeIdx * 2) + 1);
+    
+    if (!code)
+      break;
+      
+    if (keystrokeIdx > 0)
+      Serial.print(" ");
+      
+    if (modifier < 16) 
+      Serial.print("0");
+    Serial.print(modifier, HEX);
+    
+    Serial.print(" ");
+    
+    if (code < 16) 
+      Serial.print("0");
+    Serial.print(code, HEX);
+  }
+  Serial.println("");
+  return true;
+}
+
 void readAndProcessConfig() {
   initEeprom();
   
@@ -67,57 +148,115 @@ void readAndProcessConfig() {
   pinsToWatch = 0;
     
   for (uint8_t pin = FIRST_INPUT_PIN; pin <= LAST_INPUT_PIN; pin++) {
-    uint16_t eepromOffset = EEPROM_OFFSET(pin);
-
     Serial.print("Pin ");
     Serial.print(pin);
     Serial.print(": ");
     
-    if (!EEPROM.read(eepromOffset + 1)) {
+    if (!printInputKeys(pin)) {
       Serial.println("off");
       continue;
     }
 
-    for (uint8_t keystrokeIdx = 0; keystrokeIdx < MAX_KEYSTROKES; keystrokeIdx++) {
-      uint8_t modifier = EEPROM.read(eepromOffset + (keystrokeIdx * 2));
-      uint8_t code     = EEPROM.read(eepromOffset + (keystrokeIdx * 2) + 1);
-      
-      if (!code)
-        break;
-        
-      if (keystrokeIdx > 0)
-        Serial.print(" ");
-        
-      if (modifier < 16) 
-        Serial.print("0");
-      Serial.print(modifier, HEX);
-      
-      Serial.print(" ");
-      
-      if (code < 16) 
-        Serial.print("0");
-      Serial.print(code, HEX);
-    }
-    Serial.println("");
-
     Serial.printf("Setting pin %d to pull up\n", pin);
     pinMode(pin, INPUT_PULLUP);    
     pinsToWatch |= (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
     pinsLast    |= (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
   }  
 
+#if MAX_BINDINGS
+  bindingsLoad();
+  bindingsPrint();
+
+  // Pins only used in chords or as layer keys need watching too
+  for (WATCH_TYPE bound = bindingsPins() & ~pinsToWatch; bound; bound &= bound - 1) {
+    uint8_t pin = FIRST_INPUT_PIN + __builtin_ctzll(bound);
+    if (pin > LAST_INPUT_PIN)
+      break;
+    Serial.printf("Setting bound pin %d to pull up\n", pin);
+    pinMode(pin, INPUT_PULLUP);
+    pinsToWatch |= (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
+    pinsLast    |= (WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN);
+  }
+#endif
+
   Serial.printf("Pins to watch %llx\n", pinsToWatch);
+  pinDebounce.raw = pinDebounce.debounced = pinsLast;
+
+  // Only list the matrix keys that have something configured
+  for (uint8_t key = 0; key < MAX_MATRIX_KEYS; key++) {
+    if (!EEPROM.read(EEPROM_OFFSET(MATRIX_INPUT(key)) + 1))
+      continue;
+    Serial.print("Matrix key ");
+    Serial.print(key);
+    Serial.print(" (input ");
+    Serial.print(MATRIX_INPUT(key));
+    Serial.print("): ");
+    printInputKeys(MATRIX_INPUT(key));
+  }
+
+  for (uint8_t n = 0; n < MAX_EXPANDER_INPUTS; n++) {
+    if (!EEPROM.read(EEPROM_OFFSET(EXPANDER_INPUT(n)) + 1))
+      continue;
+    Serial.print("Expander ");
+    Serial.print(n / EXPANDER_CHIP_INPUTS);
+    Serial.print(" input ");
+    Serial.print(n % EXPANDER_CHIP_INPUTS);
+    Serial.print(" (input ");
+    Serial.print(EXPANDER_INPUT(n));
+    Serial.print("): ");
+    printInputKeys(EXPANDER_INPUT(n));
+  }
+
+  for (uint8_t n = 0; n < MAX_ENCODER_INPUTS; n++) {
+    if (!EEPROM.read(EEPROM_OFFSET(ENCODER_FIRST_INPUT + n) + 1))
+      continue;
+    Serial.print("Encoder ");
+    Serial.print(n / 2);
+    Serial.print(n & 1 ? " anticlockwise" : " clockwise");
+    Serial.print(" (input ");
+    Serial.print(ENCODER_FIRST_INPUT + n);
+    Serial.print("): ");
+    printInputKeys(ENCODER_FIRST_INPUT + n);
+  }
+
+  for (uint8_t n = 0; n < MAX_POOL_MACROS; n++) {
+    if (!EEPROM.read(EEPROM_OFFSET(POOL_FIRST_INPUT + n) + 1))
+      continue;
+    Serial.print("Pool macro ");
+    Serial.print(POOL_FIRST_INPUT + n);
+    Serial.print(": ");
+    printInputKeys(POOL_FIRST_INPUT + n);
+  }
+
+#if MAX_GESTURES
+  gesturesLoad();
+  gesturesPrint();
+#endif
+
+#ifdef ESP32
+  // A host profile's own layout wins over the configured one
+  hostProfilesApply();
+#else
+  keyboardLayoutSet(EEPROM.read(SETTING_LAYOUT));
+#endif
+  Serial.printf("Keyboard layout %s\n", keyboardLayoutName(keyboardLayoutGet()));
+  stallSetBudget(EEPROM.read(SETTING_STALL_BUDGET));
 }
 
 uint8_t checkPinChange(uint8_t pin, uint8_t *newValue) {
-  uint8_t pinRead = digitalRead(pin);
+  uint8_t pinRead;
+  if (!pinTraceRead(pin, &pinRead))
+    pinRead = digitalRead(pin);
   WATCH_TYPE pinNew = (WATCH_TYPE) pinRead << (pin - FIRST_INPUT_PIN);
   WATCH_TYPE pinOld = pinsLast & ((WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN));
 
   pinsLast = (pinsLast & (~((WATCH_TYPE) 1 << (pin - FIRST_INPUT_PIN)))) | pinNew;
   *newValue = pinRead; 
 
-  return pinNew != pinOld;
+  if (pinNew == pinOld)
+    return 0;
+  pinTraceChange(pin, pinRead);
+  return 1;
 } 
 
 void updateKey(uint8_t pin, uint8_t stroke, uint8_t modifier, uint8_t code) {
@@ -152,61 +291,123 @@ int readModifierAndCode(uint8_t *modifier_p, uint8_t *code_p, char *terminator_p
   return 0;
 }
 
-int readPinConfigUpdateFromSerial() {
-  uint8_t pin;
+/* Parse pin keystrokes...; into keys without saving anything, returns
+ * how many keystrokes were read or -1 */
+int readPinConfigFromSerial(uint8_t *pin, uint8_t keys[][2]) {
   int rc;
   char terminator;
   
-  if ((rc = serialTimedReadNum(&pin, &terminator, false)) || terminator != ' ') {
+  if ((rc = serialTimedReadNum(pin, &terminator, false)) || terminator != ' ') {
     Serial.println("Invalid pin"); 
     return -1; 
   }
 
-  if (pin < 0 || pin < FIRST_INPUT_PIN || pin > LAST_INPUT_PIN) {
+  if (!IS_VALID_INPUT(*pin)) {
     Serial.print("Invalid input pin ");
-    Serial.print(pin);
+    Serial.print(*pin);
     Serial.println("");
     return -1;
   }
 
-  Serial.print("Updating pin ");
-  Serial.println(pin);
-
   uint8_t keystrokeIdx = 0;
   while (keystrokeIdx < MAX_KEYSTROKES - 1) {
-    uint8_t modifier, keycode;
-
     rc = serialTimedSkipWhitespace(&terminator);
     if (rc) {
       Serial.println("Timeout reading key");
       return -1;
     } else if (terminator == ';') {
-      Serial.read();
+      serialInput->read();
       break;      
     }
 
-    rc = readModifierAndCode(&modifier, &keycode, &terminator);
+    // A byte that isn't a keystroke is left unread, so stop rather than
+    // read it again
+    if (readModifierAndCode(&keys[keystrokeIdx][0], &keys[keystrokeIdx][1], &terminator))
+      return -1;
 
     Serial.print("Read modifier ");
-    serialPrintHex(modifier);
+    serialPrintHex(keys[keystrokeIdx][0]);
     Serial.print(" ");
 
     Serial.print("keycode ");
-    serialPrintHex(keycode);
+    serialPrintHex(keys[keystrokeIdx][1]);
     Serial.println();
 
-    updateKey(pin, keystrokeIdx, modifier, keycode);
+    // A budget per keystroke, so they can be typed by hand
+    serialCommandExtend();
     keystrokeIdx++;   
   }  
 
-  if (keystrokeIdx < MAX_KEYSTROKES - 1)
-    updateKey(pin, keystrokeIdx, 0, 0);  
+  return keystrokeIdx;
+}
+
+int readPinConfigUpdateFromSerial() {
+  uint8_t pin;
+  uint8_t keys[MAX_KEYSTROKES - 1][2];
+
+  // The whole command is read before any of it is saved
+  int count = readPinConfigFromSerial(&pin, keys);
+  if (count < 0)
+    return -1;
+
+  Serial.print("Updating pin ");
+  Serial.println(pin);
+
+  for (uint8_t keystrokeIdx = 0; keystrokeIdx < count; keystrokeIdx++)
+    updateKey(pin, keystrokeIdx, keys[keystrokeIdx][0], keys[keystrokeIdx][1]);
+
+  if (count < MAX_KEYSTROKES - 1)
+    updateKey(pin, count, 0, 0);  
 
   Serial.println("Updated keycode, reloaded config");
   readAndProcessConfig();
   return 0;
 }
 
+/* Set the host's keyboard layout for typing text: layout; */
+int readLayoutUpdateFromSerial() {
+  uint8_t layout;
+  char terminator;
+
+  if (serialTimedReadNum(&layout, &terminator, false) || terminator != ';' || layout >= LAYOUT_COUNT) {
+    Serial.println("Invalid layout, 0 US, 1 UK, 2 DE, 3 FR");
+    return -1;
+  }
+  serialInput->read();
+
+  updateEeprom(SETTING_LAYOUT, layout);
+#ifdef ESP32
+  EEPROM.commit();
+#endif
+#ifdef ESP32
+  hostProfilesApply();
+#else
+  keyboardLayoutSet(layout);
+#endif
+  Serial.printf("Keyboard layout %s\n", keyboardLayoutName(keyboardLayoutGet()));
+  return 0;
+}
+
+/* Set how long a stage can run before it's a stall: ms; 0 for the default */
+int readStallBudgetUpdateFromSerial() {
+  uint8_t budget;
+  char terminator;
+
+  if (serialTimedReadNum(&budget, &terminator, false) || terminator != ';') {
+    Serial.println("Invalid stall budget, 1 to 255 ms or 0 for the default");
+    return -1;
+  }
+  serialInput->read();
+
+  updateEeprom(SETTING_STALL_BUDGET, budget);
+#ifdef ESP32
+  EEPROM.commit();
+#endif
+  stallSetBudget(budget);
+  Serial.printf("Stall budget %d ms\n", stallGetBudget());
+  return 0;
+}
+
 int readSerialKeysAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
   uint8_t pin;
   int rc;
@@ -220,11 +421,13 @@ int readSerialKeysAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uin
       Serial.println("Timeout reading key");
       return -1;
     } else if (terminator == ';') {
-      Serial.read();
+      serialInput->read();
       break;      
     }
 
-    rc = readModifierAndCode(&modifier, &keycode, &terminator);
+    // Otherwise the same bad byte would be peeked for ever
+    if (readModifierAndCode(&modifier, &keycode, &terminator))
+      return -1;
 
     Serial.print("Read modifier ");
     serialPrintHex(modifier);
@@ -240,38 +443,131 @@ int readSerialKeysAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uin
   return 0;
 }
 
-void checkPinsAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
-  for (uint8_t pin = FIRST_INPUT_PIN; pin <= LAST_INPUT_PIN; pin++) {
-    if (!WATCH_PIN(pin))
-      continue;
+static macro_op_t macroOpHandler = NULL;
+
+void setMacroOpHandler(macro_op_t handler) {
+  macroOpHandler = handler;
+}
 
-    uint8_t pinChanged, pinValue;
-    pinChanged = checkPinChange(pin, &pinValue);
+/* Operations behind a MACRO_ESCAPE keystroke, the library is played here
+ * and anything else is up to the handler */
+void sendMacroOp(uint8_t op, uint8_t argModifier, uint8_t argCode, send_key_t sendKey) {
+  switch (op) {
+#ifdef ESP32
+    case MACRO_OP_LIBRARY:
+      // The compiled image if it has the macro, otherwise its file
+      macroLibraryPlay(argCode, sendKey, true);
+      break;
+#endif
+    default:
+      if (!macroOpHandler || !macroOpHandler(op, argModifier, argCode))
+        Serial.printf("Unknown macro operation %d\n", op);
+  }
+}
 
-    if (!pinChanged)
+static void sendInputKeys(uint8_t input, void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
+#ifdef ESP32
+  if (EEPROM.read(EEPROM_OFFSET(input) + 1))
+    metricInputMacro(INPUT_SLOT(input));
+  // The connected host's profile can play another input's keystrokes
+  input = hostProfileInput(input);
+#endif
+  for (uint8_t keystrokeIdx = 0; keystrokeIdx < MAX_KEYSTROKES; keystrokeIdx++) {
+    uint8_t modifier = GET_KEY_MODIFIER(input, keystrokeIdx);
+    uint8_t code     = GET_KEY_CODE(input, keystrokeIdx);
+
+    if (!code)
+      break;
+
+    if (modifier == MACRO_ESCAPE && keystrokeIdx + 1 < MAX_KEYSTROKES) {
+      keystrokeIdx++;
+      uint8_t argModifier = GET_KEY_MODIFIER(input, keystrokeIdx);
+      uint8_t argCode     = GET_KEY_CODE(input, keystrokeIdx);
+      sendMacroOp(code, argModifier, argCode, sendKey);
       continue;
+    }
 
-    Serial.print("Pin ");
-    Serial.print(pin);
-    Serial.print(" change: ");
-    Serial.println(pinValue);
+    Serial.print("Send key ");
+    serialPrintHex(modifier);
+    Serial.print(" ");
+    serialPrintHex(code);
+    Serial.println("");
 
-    if (!pinValue) {
-      for (uint8_t keystrokeIdx = 0; keystrokeIdx < MAX_KEYSTROKES; keystrokeIdx++) {
-        uint8_t modifier = GET_KEY_MODIFIER(pin, keystrokeIdx);
-        uint8_t code     = GET_KEY_CODE(pin, keystrokeIdx);
+    sendKey(modifier, code, 0x0);
+  }
+}
 
-        if (!code)
-          break;
+/* Send an input's keystrokes count times, returns false if the input has
+ * nothing configured */
+bool sendInputRepeated(uint8_t input, uint8_t count, void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
+  if (!IS_VALID_INPUT(input) || !EEPROM.read(EEPROM_OFFSET(input) + 1))
+    return false;
 
-        Serial.print("Send key ");
-        serialPrintHex(modifier);
-        Serial.print(" ");
-        serialPrintHex(code);
-        Serial.println("");
+  while (count--)
+    sendInputKeys(input, sendKey);
+  return true;
+}
 
-        sendKey(modifier, code, 0x0);
-      }
-    }
+/* Common trigger path for every kind of input, value is the pin 
+ * level so 0 means pressed */
+void processInputChange(uint8_t input, uint8_t value, void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
+  Serial.print("Pin ");
+  Serial.print(input);
+  Serial.print(" change: ");
+  Serial.println(value);
+
+#if MAX_GESTURES
+  if (gesturesInputChange(input, value, sendKey))
+    return;
+#endif
+
+  if (!value)
+    sendInputKeys(input, sendKey);
+}
+
+void checkPinsAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2)) {
+  profileBegin(SPAN_CHECK_PINS);
+  unsigned long now = millis();
+
+  pinTracePoll();
+  for (uint8_t pin = FIRST_INPUT_PIN; pin <= LAST_INPUT_PIN; pin++) {
+    if (!WATCH_PIN(pin))
+      continue;
+
+    uint8_t pinValue;
+    checkPinChange(pin, &pinValue);
   }  
+
+  WATCH_TYPE changed = debounceInputs(&pinDebounce, pinsLast, now) & pinsToWatch;
+  while (changed) {
+    uint8_t bit = __builtin_ctzll(changed);
+    changed &= changed - 1;
+#if MAX_BINDINGS
+    // Chords and layers look at every held pin, not one pin at a time
+    bindingsPinChange(FIRST_INPUT_PIN + bit, (pinDebounce.debounced >> bit) & 1,
+                      ~pinDebounce.debounced & pinsToWatch, sendKey);
+#else
+    processInputChange(FIRST_INPUT_PIN + bit, (pinDebounce.debounced >> bit) & 1, sendKey);
+#endif
+  }
+#if MAX_BINDINGS
+  bindingsPoll(sendKey);
+#endif
+#if MAX_GESTURES
+  gesturesPoll(sendKey);
+#endif
+
+#if MAX_EXPANDER_CHIPS
+  pollInputSources(now, processInputChange, sendKey);
+#endif
+
+#if MAX_MATRIX_KEYS
+  // Matrix keys are scanned and debounced in the background
+  key_event_t event;
+  while (keyMatrixNextEvent(&event)) {
+    if (event.key < MAX_MATRIX_KEYS)
+      processInputChange(MATRIX_INPUT(event.key), !event.pressed, sendKey);
+  }
+#endif
+  profileEnd(SPAN_CHECK_PINS);
 }
@@ -10,8 +10,10 @@
 #define EEPROM_HEADER_SIZE 2
 
 #if !defined(E2END) && defined(ESP32)
-/* The ESP32 EEPROM compatibility library doesn't have a strict size, similate 3k bytes */
-#define E2END ((3 * 1024) - 1)
+/* The ESP32 EEPROM compatibility library doesn't have a strict size, similate 12k bytes
+ * (enough for the direct pins, a full key matrix, expanders, encoders and the
+ * chord and layer bindings with their macros) */
+#define E2END ((12 * 1024) - 1)
 #endif
 
 #define EEPROM_SIZE      (E2END + 1)
@@ -39,29 +41,151 @@ extern WATCH_TYPE pinsLast;
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+// Keys on a row/column matrix (KeyMatrix.h) are inputs numbered from 
+// MATRIX_FIRST_INPUT, above any real pin
+#define MATRIX_FIRST_INPUT 64
+#ifdef ESP32
+#define MAX_MATRIX_KEYS    48
+#else
+#define MAX_MATRIX_KEYS    0
+#endif
+
+// Inputs on I2C port expanders (Mcp23017Source.h) follow the matrix keys, 
+// 16 per chip
+#define EXPANDER_FIRST_INPUT (MATRIX_FIRST_INPUT + MAX_MATRIX_KEYS)
+#define EXPANDER_CHIP_INPUTS 16
+#ifdef ESP32
+#define MAX_EXPANDER_CHIPS   2
+#else
+#define MAX_EXPANDER_CHIPS   0
+#endif
+#define MAX_EXPANDER_INPUTS  (MAX_EXPANDER_CHIPS * EXPANDER_CHIP_INPUTS)
+
+// Rotary encoders (RotaryEncoder.h) follow the expander inputs, with an 
+// input for each direction so each can have its own macro
+#define ENCODER_FIRST_INPUT  (EXPANDER_FIRST_INPUT + MAX_EXPANDER_INPUTS)
+#ifdef ESP32
+#define MAX_ENCODERS         2
+#else
+#define MAX_ENCODERS         0
+#endif
+#define MAX_ENCODER_INPUTS   (MAX_ENCODERS * 2)
+
+// Macros that aren't tied to an input, for chords and layers (Bindings.h) to
+// send. They're configured with 'u' like the inputs
+#define POOL_FIRST_INPUT     (ENCODER_FIRST_INPUT + MAX_ENCODER_INPUTS)
+#ifdef ESP32
+#define MAX_POOL_MACROS      48
+#define MAX_BINDINGS         32
+#else
+#define MAX_POOL_MACROS      0
+#define MAX_BINDINGS         0
+#endif
+
+#ifdef ESP32
+#define MAX_GESTURES         32
+#else
+#define MAX_GESTURES         0
+#endif
+
+// Bindings, gestures (Gestures.h) and then the settings are stored after 
+// the macro slots, as many slots' worth as they need
+#define BINDING_SIZE         10
+#define GESTURE_SIZE         4
+#define SETTINGS_SIZE        16
+#define BINDING_SLOTS        ((MAX_BINDINGS * BINDING_SIZE + MAX_GESTURES * GESTURE_SIZE + SETTINGS_SIZE + (MAX_KEYSTROKES * 2) - 1) / (MAX_KEYSTROKES * 2))
+
+// A pin or expander input must read the same level for this long before a change is acted on
+#define INPUT_DEBOUNCE_MS    5
+
+#define MACRO_SLOTS      ((EEPROM_SIZE - EEPROM_HEADER_SIZE) / (MAX_KEYSTROKES * 2))
+
 // The maximum number of pins that can be watched is based on the size of
-// the EEPROM storage area or the maximum number of bits in the watch mask 
+// the EEPROM storage area left after the matrix keys, expander and encoder inputs,
+// pool macros and bindings or the maximum number of bits in the watch mask 
 // variable (WATCH_TYPE)
-#define MAX_INPUT_PINS   MIN(MIN((((EEPROM_SIZE - EEPROM_HEADER_SIZE) / (MAX_KEYSTROKES * 2))|0), sizeof(pinsToWatch) * 8), LAST_PIN - FIRST_INPUT_PIN + 1)
+#define MAX_INPUT_PINS   MIN(MIN(((MACRO_SLOTS - MAX_MATRIX_KEYS - MAX_EXPANDER_INPUTS - MAX_ENCODER_INPUTS - MAX_POOL_MACROS - BINDING_SLOTS)|0), sizeof(pinsToWatch) * 8), LAST_PIN - FIRST_INPUT_PIN + 1)
 
 #define LAST_INPUT_PIN   (FIRST_INPUT_PIN + MAX_INPUT_PINS - 1)
 
+#define MATRIX_INPUT(key)        (MATRIX_FIRST_INPUT + (key))
+#define EXPANDER_INPUT(n)        (EXPANDER_FIRST_INPUT + (n))
+#define ENCODER_INPUT(enc, ccw)  (ENCODER_FIRST_INPUT + (enc) * 2 + ((ccw) ? 1 : 0))
+#define IS_PIN_INPUT(input)      ((input) >= FIRST_INPUT_PIN && (input) <= LAST_INPUT_PIN)
+#define IS_MATRIX_INPUT(input)   ((input) >= MATRIX_FIRST_INPUT && (input) < MATRIX_FIRST_INPUT + MAX_MATRIX_KEYS)
+#define IS_EXPANDER_INPUT(input) ((input) >= EXPANDER_FIRST_INPUT && (input) < EXPANDER_FIRST_INPUT + MAX_EXPANDER_INPUTS)
+#define IS_ENCODER_INPUT(input)  ((input) >= ENCODER_FIRST_INPUT && (input) < ENCODER_FIRST_INPUT + MAX_ENCODER_INPUTS)
+#define IS_POOL_INPUT(input)     ((input) >= POOL_FIRST_INPUT && (input) < POOL_FIRST_INPUT + MAX_POOL_MACROS)
+#define IS_VALID_INPUT(input)    (IS_PIN_INPUT(input) || IS_MATRIX_INPUT(input) || IS_EXPANDER_INPUT(input) || \
+                                  IS_ENCODER_INPUT(input) || IS_POOL_INPUT(input))
+
+// Each input has a slot of MAX_KEYSTROKES keystrokes, pins first then matrix keys,
+// expander inputs, encoders and the pool
+#define INPUT_SLOTS            (MAX_INPUT_PINS + MAX_MATRIX_KEYS + MAX_EXPANDER_INPUTS + MAX_ENCODER_INPUTS + MAX_POOL_MACROS)
+#define INPUT_SLOT(input)      (IS_POOL_INPUT(input) ? MAX_INPUT_PINS + MAX_MATRIX_KEYS + MAX_EXPANDER_INPUTS + MAX_ENCODER_INPUTS + (input) - POOL_FIRST_INPUT : \
+                                IS_ENCODER_INPUT(input) ? MAX_INPUT_PINS + MAX_MATRIX_KEYS + MAX_EXPANDER_INPUTS + (input) - ENCODER_FIRST_INPUT : \
+                                IS_EXPANDER_INPUT(input) ? MAX_INPUT_PINS + MAX_MATRIX_KEYS + (input) - EXPANDER_FIRST_INPUT : \
+                                IS_MATRIX_INPUT(input) ? MAX_INPUT_PINS + (input) - MATRIX_FIRST_INPUT : (input) - FIRST_INPUT_PIN)
+
 #ifndef ESP32
 #define DEFAULT_INPUT_PIN 7
 #define DEFAULT_INPUT_STRING "Hello World!"
 #endif
 
-#define EEPROM_OFFSET(pin)           (2 + ((pin - FIRST_INPUT_PIN) * (MAX_KEYSTROKES * 2)))
+// A keystroke with this modifier is an escape, its code is the operation 
+// and the next keystroke is its argument
+#define MACRO_ESCAPE                 0xFF
+#define MACRO_OP_LIBRARY             1      // Argument code is a macro library ID
+#define MACRO_OP_CONSUMER            2      // Argument is a consumer control usage, modifier the high byte
+#define MACRO_OP_MOUSE_MOVE          3      // Argument modifier and code are signed X and Y motion
+#define MACRO_OP_MOUSE_WHEEL         4      // Argument code is signed wheel motion
+#define MACRO_OP_MOUSE_CLICK         5      // Argument code is the buttons to click
+#define MACRO_OP_HOST                6      // Argument code is a host profile to switch to (HostProfiles.h)
+
+#define EEPROM_OFFSET(input)         (EEPROM_HEADER_SIZE + (INPUT_SLOT(input) * (MAX_KEYSTROKES * 2)))
+#define BINDINGS_OFFSET              (EEPROM_HEADER_SIZE + (INPUT_SLOTS * (MAX_KEYSTROKES * 2)))
+#define GESTURES_OFFSET              (BINDINGS_OFFSET + MAX_BINDINGS * BINDING_SIZE)
+#define SETTINGS_OFFSET              (GESTURES_OFFSET + MAX_GESTURES * GESTURE_SIZE)
+#define SETTING_LAYOUT               (SETTINGS_OFFSET + 0)    // Keyboard layout for typing text (KeyboardLayout.h)
+#define SETTING_STALL_BUDGET         (SETTINGS_OFFSET + 1)    // Stall detector budget in ms (StallDetector.h)
 #define WATCH_PIN(pin)               ((pinsToWatch >> (pin - FIRST_INPUT_PIN)) & 1)
 #define GET_KEY_MODIFIER(pin, keyNo) EEPROM.read(EEPROM_OFFSET(pin) + (keyNo * 2));
 #define GET_KEY_CODE(pin, keyNo)     EEPROM.read(EEPROM_OFFSET(pin) + (keyNo * 2) + 1);
 
+/* Debounce state for up to a WATCH_TYPE's worth of inputs, shared by the
+ * native pins and every input source */
+typedef struct {
+  WATCH_TYPE raw;                                     // Last sampled levels
+  WATCH_TYPE debounced;                               // Levels stable for INPUT_DEBOUNCE_MS
+  unsigned long changedMillis[sizeof(WATCH_TYPE) * 8];  // When each raw level last changed
+} input_debounce_t;
+
+class InputSource;
+
+typedef void (*send_key_t)(uint8_t modifier, uint8_t key, uint8_t key2);
+// Handles the macro operations that aren't keystrokes, returns false for an unknown operation
+typedef bool (*macro_op_t)(uint8_t op, uint8_t argModifier, uint8_t argCode);
+// An input's debounced level changed, 1 = released
+typedef void (*input_change_t)(uint8_t input, uint8_t value, send_key_t sendKey);
+
 void formatEeprom();
 void readAndProcessConfig();
 uint8_t checkPinChange(uint8_t pin, uint8_t *newValue);
 void updateKey(uint8_t pin, uint8_t stroke, uint8_t modifier, uint8_t code);
+void updateEeprom(uint16_t address, uint8_t value);
+int readPinConfigFromSerial(uint8_t *pin, uint8_t keys[][2]);
 int readPinConfigUpdateFromSerial();
+int readLayoutUpdateFromSerial();
+int readStallBudgetUpdateFromSerial();
 int readSerialKeysAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2));
+void processInputChange(uint8_t input, uint8_t value, void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2));
+WATCH_TYPE debounceInputs(input_debounce_t *state, WATCH_TYPE raw, unsigned long now);
+bool addInputSource(InputSource *source, uint8_t firstInput);
+void pollInputSources(unsigned long now, input_change_t change, send_key_t sendKey);
+int readModifierAndCode(uint8_t *modifier_p, uint8_t *code_p, char *terminator_p);
+void sendMacroOp(uint8_t op, uint8_t argModifier, uint8_t argCode, send_key_t sendKey);
+void setMacroOpHandler(macro_op_t handler);
+bool sendInputRepeated(uint8_t input, uint8_t count, void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2));
 void checkPinsAndCallback(void (*sendKey)(uint8_t modifier, uint8_t key, uint8_t key2));
 
 #endif 
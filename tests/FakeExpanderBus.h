@@ -0,0 +1,132 @@
+#ifndef FakeExpanderBus_h
+#define FakeExpanderBus_h
+
+#include <Arduino.h>
+#include "Mcp23017Source.h"
+
+#define FAKE_EXPANDER_CHIPS  4
+#define FAKE_EXPANDER_REGS   0x16
+
+#define FAKE_GPINTENA 0x04
+#define FAKE_INTFA    0x0E
+#define FAKE_INTCAPA  0x10
+#define FAKE_GPIOA    0x12
+#define FAKE_GPIOB    0x13
+
+/* MCP23017s on a shared bus and INT line. The test scripts the level of
+ * each chip's 16 inputs, a change sets the chip's INTF bits and captures
+ * the levels in INTCAP, and pulls the INT line low, running its interrupt
+ * handler on a falling edge. Reading GPIO or INTCAP clears the chip's
+ * interrupt, and the line goes high again once no chip on it is holding
+ * it low. Chips that weren't added don't acknowledge, like an empty
+ * address */
+class FakeExpanderBus : public ExpanderBus {
+  public:
+    FakeExpanderBus(int8_t intPin) : intPin(intPin), chipCount(0), reads(0) {
+      memset(chips, 0, sizeof(chips));
+    }
+
+    void addChip(uint8_t address) {
+      fake_chip_t *chip = &chips[chipCount++];
+      chip->address = address;
+      // Inputs with pull ups and nothing pressed
+      chip->regs[FAKE_GPIOA] = chip->regs[FAKE_GPIOB] = 0xff;
+    }
+
+    /* Script the level of a chip's inputs, 1 = released. Changes on pins
+     * with GPINTEN set raise the chip's interrupt */
+    void setInputs(uint8_t address, uint16_t levels) {
+      fake_chip_t *chip = find(address);
+      uint16_t old = gpio(chip);
+      if (levels == old)
+        return;
+
+      chip->regs[FAKE_GPIOA] = levels & 0xff;
+      chip->regs[FAKE_GPIOB] = levels >> 8;
+
+      // Only pins with their interrupt enabled flag a change
+      uint16_t flagged = (old ^ levels) & (chip->regs[FAKE_GPINTENA] | (chip->regs[FAKE_GPINTENA + 1] << 8));
+      if (!flagged)
+        return;
+      chip->regs[FAKE_INTFA] |= flagged & 0xff;
+      chip->regs[FAKE_INTFA + 1] |= flagged >> 8;
+      if (!chip->pending) {
+        chip->regs[FAKE_INTCAPA] = levels & 0xff;
+        chip->regs[FAKE_INTCAPA + 1] = levels >> 8;
+      }
+      chip->pending = true;
+      updateLine();
+    }
+
+    /* Bus transactions that read registers, to check reads are skipped */
+    uint32_t readCount() {
+      return reads;
+    }
+
+    uint8_t reg(uint8_t address, uint8_t reg) {
+      return find(address)->regs[reg];
+    }
+
+    bool writeReg(uint8_t address, uint8_t reg, uint8_t value) {
+      fake_chip_t *chip = find(address);
+      if (!chip || reg >= FAKE_EXPANDER_REGS)
+        return false;
+      chip->regs[reg] = value;
+      return true;
+    }
+
+    bool readRegs(uint8_t address, uint8_t reg, uint8_t *buf, uint8_t len) {
+      fake_chip_t *chip = find(address);
+      if (!chip || reg + len > FAKE_EXPANDER_REGS)
+        return false;
+      reads++;
+      memcpy(buf, &chip->regs[reg], len);
+
+      // Reading either port of GPIO or INTCAP clears the interrupt
+      if (reg <= FAKE_GPIOB && reg + len > FAKE_INTCAPA) {
+        chip->regs[FAKE_INTFA] = chip->regs[FAKE_INTFA + 1] = 0;
+        chip->pending = false;
+        updateLine();
+      }
+      return true;
+    }
+
+  private:
+    typedef struct {
+      uint8_t address;
+      uint8_t regs[FAKE_EXPANDER_REGS];
+      bool pending;
+    } fake_chip_t;
+
+    fake_chip_t *find(uint8_t address) {
+      for (uint8_t i = 0; i < chipCount; i++)
+        if (chips[i].address == address)
+          return &chips[i];
+      return NULL;
+    }
+
+    static uint16_t gpio(fake_chip_t *chip) {
+      return chip->regs[FAKE_GPIOA] | (chip->regs[FAKE_GPIOB] << 8);
+    }
+
+    /* Open drain, low while any chip has an interrupt pending */
+    void updateLine() {
+      if (intPin < 0)
+        return;
+      uint8_t level = HIGH;
+      for (uint8_t i = 0; i < chipCount; i++)
+        if (chips[i].pending)
+          level = LOW;
+      uint8_t old = stubPinLevels[intPin];
+      stubPinLevels[intPin] = level;
+      if (old == HIGH && level == LOW)
+        stubInterrupt(intPin);
+    }
+
+    int8_t intPin;
+    fake_chip_t chips[FAKE_EXPANDER_CHIPS];
+    uint8_t chipCount;
+    uint32_t reads;
+};
+
+#endif
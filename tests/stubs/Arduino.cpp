@@ -0,0 +1,34 @@
+#include <stdarg.h>
+#include "Arduino.h"
+
+StubSerial Serial;
+uint8_t stubPinLevels[STUB_PINS];
+static void (*handlers[STUB_PINS])(void *);
+static void *handlerArgs[STUB_PINS];
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (mode == INPUT_PULLUP)
+    stubPinLevels[pin] = HIGH;
+}
+
+int digitalRead(uint8_t pin) {
+  return stubPinLevels[pin];
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode) {
+  handlers[pin] = handler;
+  handlerArgs[pin] = arg;
+}
+
+void stubInterrupt(uint8_t pin) {
+  if (handlers[pin])
+    handlers[pin](handlerArgs[pin]);
+}
+
+int StubSerial::printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
@@ -0,0 +1,35 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/* Just enough of the Arduino core for the host tests. Pin levels and
+ * interrupt handlers are kept in tables the tests drive */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define IRAM_ATTR
+#define INPUT_PULLUP 0x05
+#define FALLING      0x02
+#define HIGH         1
+#define LOW          0
+#define STUB_PINS    40
+
+extern uint8_t stubPinLevels[STUB_PINS];
+
+void pinMode(uint8_t pin, uint8_t mode);
+int digitalRead(uint8_t pin);
+void attachInterruptArg(uint8_t pin, void (*handler)(void *), void *arg, int mode);
+/* Runs the pin's handler as its interrupt would */
+void stubInterrupt(uint8_t pin);
+
+class StubSerial {
+  public:
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+    void println(const char *text) { ::printf("%s\n", text); }
+};
+
+extern StubSerial Serial;
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef EEPROM_h
+#define EEPROM_h
+
+/* eeprom_config.h includes this, nothing the tests build reads the EEPROM */
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef Wire_h
+#define Wire_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* WireExpanderBus compiles against this, the tests use a fake bus */
+class TwoWire {
+  public:
+    void beginTransmission(uint8_t address) {}
+    size_t write(uint8_t value) { return 1; }
+    uint8_t endTransmission(bool stop = true) { return 2; }
+    uint8_t requestFrom(uint8_t address, uint8_t len) { return 0; }
+    int read() { return -1; }
+};
+
+#endif
@@ -0,0 +1,207 @@
+/* Host tests for the MCP23017 input source and the input source pool,
+ * run against FakeExpanderBus. Build and run with make -C tests */
+
+#include <Arduino.h>
+#include "eeprom_config.h"
+#include "InputSource.h"
+#include "Mcp23017Source.h"
+#include "Metrics.h"
+#include "FakeExpanderBus.h"
+
+#define INT_PIN_DIRECT   5      // Sources sampled by the tests themselves
+#define INT_PIN_POOL     4      // The source in the pool
+#define MAX_EVENTS       16
+
+std::atomic<uint32_t> metricCounters[METRIC_COUNT];
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      printf("%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while (0)
+
+typedef struct {
+  uint8_t input;
+  uint8_t value;
+} input_event_t;
+
+static input_event_t events[MAX_EVENTS];
+static int eventCount = 0;
+
+static void recordChange(uint8_t input, uint8_t value, send_key_t sendKey) {
+  if (eventCount < MAX_EVENTS)
+    events[eventCount++] = { input, value };
+}
+
+static void pollFor(unsigned long from, unsigned long to) {
+  for (unsigned long now = from; now <= to; now++)
+    pollInputSources(now, recordChange, NULL);
+}
+
+static void testBegin() {
+  FakeExpanderBus bus(MCP23017_NO_INT);
+  Mcp23017Source source, missing;
+
+  bus.addChip(0x20);
+  source.configure(&bus, 0x20);
+  CHECK(source.begin());
+  CHECK(bus.reg(0x20, 0x00) == 0xff && bus.reg(0x20, 0x01) == 0xff);   // IODIR, all inputs
+  CHECK(bus.reg(0x20, 0x0C) == 0xff && bus.reg(0x20, 0x0D) == 0xff);   // GPPU, pulled up
+  CHECK(bus.reg(0x20, 0x04) == 0xff && bus.reg(0x20, 0x05) == 0xff);   // GPINTEN
+  CHECK(bus.reg(0x20, 0x0A) == 0x44);                                  // IOCON MIRROR | ODR
+
+  // Nothing answers at 0x27
+  missing.configure(&bus, 0x27);
+  CHECK(!missing.begin());
+  CHECK(!addInputSource(&missing, EXPANDER_FIRST_INPUT));
+}
+
+static void testPolled() {
+  FakeExpanderBus bus(MCP23017_NO_INT);
+  Mcp23017Source source;
+  uint32_t levels = 0;
+
+  bus.addChip(0x20);
+  source.configure(&bus, 0x20);
+  CHECK(source.begin());
+
+  // Without an INT line every sample reads both ports
+  for (int i = 0; i < 3; i++) {
+    uint32_t reads = bus.readCount();
+    CHECK(source.sample(&levels));
+    CHECK(bus.readCount() == reads + 1);
+    CHECK(levels == 0xffffffff);
+  }
+
+  bus.setInputs(0x20, 0x7ffe);
+  CHECK(source.sample(&levels));
+  CHECK(levels == 0xffff7ffe);
+}
+
+static void testInterrupt() {
+  FakeExpanderBus bus(INT_PIN_DIRECT);
+  Mcp23017Source first, second;
+  uint32_t levels = 0;
+
+  bus.addChip(0x21);
+  bus.addChip(0x22);
+  first.configure(&bus, 0x21, INT_PIN_DIRECT);
+  second.configure(&bus, 0x22, INT_PIN_DIRECT);
+  CHECK(first.begin() && second.begin());
+
+  // The first sample always reads, after that only an interrupt does
+  CHECK(first.sample(&levels) && second.sample(&levels));
+  uint32_t reads = bus.readCount();
+  CHECK(!first.sample(&levels) && !second.sample(&levels));
+  CHECK(bus.readCount() == reads);
+
+  // One edge on the shared line, both chips read and the INTF is cleared
+  bus.setInputs(0x21, 0xfffd);
+  CHECK(bus.reg(0x21, FAKE_INTFA) == 0x02);
+  CHECK(digitalRead(INT_PIN_DIRECT) == LOW);
+  CHECK(first.sample(&levels));
+  CHECK(levels == 0xfffffffd);
+  CHECK(bus.reg(0x21, FAKE_INTFA) == 0);
+  CHECK(second.sample(&levels));
+  CHECK(levels == 0xffffffff);
+  CHECK(digitalRead(INT_PIN_DIRECT) == HIGH);
+  CHECK(!first.sample(&levels) && !second.sample(&levels));
+
+  // The second chip changes while the first still holds the line low, so
+  // there's no edge. It's still read as the line stays low until it is
+  bus.setInputs(0x21, 0xffff);
+  CHECK(second.sample(&levels));
+  bus.setInputs(0x22, 0xbfff);
+  CHECK(first.sample(&levels));
+  CHECK(levels == 0xffffffff);
+  CHECK(digitalRead(INT_PIN_DIRECT) == LOW);
+  reads = bus.readCount();
+  CHECK(second.sample(&levels));
+  CHECK(levels == 0xffffbfff);
+  CHECK(bus.readCount() == reads + 1);
+  CHECK(digitalRead(INT_PIN_DIRECT) == HIGH);
+}
+
+static void testPool() {
+  FakeExpanderBus polledBus(MCP23017_NO_INT), intBus(INT_PIN_POOL);
+  static Mcp23017Source polled, interrupt;
+  const uint8_t polledFirst = EXPANDER_FIRST_INPUT;
+  const uint8_t intFirst = EXPANDER_FIRST_INPUT + EXPANDER_CHIP_INPUTS;
+
+  polledBus.addChip(0x20);
+  intBus.addChip(0x21);
+  polled.configure(&polledBus, 0x20);
+  interrupt.configure(&intBus, 0x21, INT_PIN_POOL);
+  CHECK(addInputSource(&polled, polledFirst));
+  CHECK(addInputSource(&interrupt, intFirst));
+
+  // A press only counts once it has held for INPUT_DEBOUNCE_MS
+  eventCount = 0;
+  polledBus.setInputs(0x20, 0xfff7);
+  pollFor(0, INPUT_DEBOUNCE_MS - 1);
+  CHECK(eventCount == 0);
+  pollFor(INPUT_DEBOUNCE_MS, INPUT_DEBOUNCE_MS);
+  CHECK(eventCount == 1);
+  CHECK(events[0].input == polledFirst + 3 && events[0].value == 0);
+
+  // A release that bounces back within the debounce time is dropped
+  unsigned long now = 100;
+  polledBus.setInputs(0x20, 0xffff);
+  pollFor(now, now + INPUT_DEBOUNCE_MS - 2);
+  polledBus.setInputs(0x20, 0xfff7);
+  pollFor(now + INPUT_DEBOUNCE_MS - 1, now + 4 * INPUT_DEBOUNCE_MS);
+  CHECK(eventCount == 1);
+
+  // The interrupt driven chip is only read at the edge, its debounce
+  // keeps running on the levels it read
+  now = 200;
+  uint32_t reads = intBus.readCount();
+  pollFor(now, now + 10);
+  CHECK(intBus.readCount() == reads);
+  now += 20;
+  intBus.setInputs(0x21, 0xfdff);
+  pollFor(now, now);
+  CHECK(intBus.readCount() == reads + 1);
+  CHECK(eventCount == 1);
+  pollFor(now + 1, now + INPUT_DEBOUNCE_MS);
+  CHECK(intBus.readCount() == reads + 1);
+  CHECK(eventCount == 2);
+  CHECK(events[1].input == intFirst + 9 && events[1].value == 0);
+
+  // Both chips release together
+  now = 300;
+  polledBus.setInputs(0x20, 0xffff);
+  intBus.setInputs(0x21, 0xffff);
+  pollFor(now, now + INPUT_DEBOUNCE_MS);
+  CHECK(eventCount == 4);
+  CHECK(events[2].input == polledFirst + 3 && events[2].value == 1);
+  CHECK(events[3].input == intFirst + 9 && events[3].value == 1);
+
+  CHECK(metricCounters[METRIC_DEBOUNCED_EDGES] == 4);
+  // The press, both edges of the bounce, the interrupt chip's press and
+  // both releases
+  CHECK(metricCounters[METRIC_PIN_EDGES] == 6);
+
+  // The pool is full
+  Mcp23017Source extra;
+  polledBus.addChip(0x23);
+  extra.configure(&polledBus, 0x23);
+  CHECK(!addInputSource(&extra, intFirst + EXPANDER_CHIP_INPUTS));
+}
+
+int main() {
+  testBegin();
+  testPolled();
+  testInterrupt();
+  testPool();
+
+  if (failures) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All input tests passed\n");
+  return 0;
+}
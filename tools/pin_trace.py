@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Save, inspect and upload pin traces ('I' on the console, PinTrace.h)
+
+  pin_trace.py extract log.txt trace.bin     the last 'Id' dump in a serial log
+  pin_trace.py show trace.bin                every change and each pin's bounce
+  pin_trace.py upload trace.bin > cmds.txt   console commands to load it back
+
+Send the upload commands to the console then 'Ip' replays the trace. A
+directory of saved traces is the benchmark corpus, replay each one before
+and after a debounce, binding or gesture change and compare the summary
+line the replay prints.
+"""
+
+import argparse
+import sys
+
+VERSION = 1
+HEADER = 19
+CHUNK = 64    # Bytes per Iw command, 128 hex digits
+
+
+def extract(lines):
+    data, inside = None, False
+    for line in lines:
+        fields = line.split()
+        if len(fields) == 2 and fields[0] == "pintrace":
+            inside, chunks = True, []
+        elif inside and fields == ["end"]:
+            inside, data = False, bytes.fromhex("".join(chunks))
+        elif inside and fields:
+            chunks.append(fields[0])
+    return data
+
+
+def mask_pins(data):
+    mask = int.from_bytes(data, "little")
+    return [pin for pin in range(64) if mask >> pin & 1]
+
+
+def decode(data):
+    if len(data) < HEADER or data[:2] != b"PT" or data[2] != VERSION:
+        sys.exit("Not a version %d pin trace" % VERSION)
+
+    changes, micros, offset = [], 0, HEADER
+    while offset < len(data):
+        delta, shift = 0, 0
+        while offset < len(data):
+            byte = data[offset]
+            offset += 1
+            delta |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                break
+        if offset >= len(data):
+            break
+        micros += delta
+        changes.append((micros, data[offset] >> 1, data[offset] & 1))
+        offset += 1
+
+    initial = int.from_bytes(data[11:19], "little")
+    return mask_pins(data[3:11]), initial, changes
+
+
+def show(data):
+    pins, initial, changes = decode(data)
+    print("Pins %s, %d changes over %.1f ms" % (" ".join(map(str, pins)), len(changes),
+                                                 changes[-1][0] / 1000 if changes else 0))
+    print("Started %s" % " ".join("%d %s" % (pin, "high" if initial >> pin & 1 else "low") for pin in pins))
+
+    # Changes closer together than the 5ms debounce are bounce
+    last, bounces = {}, {}
+    for micros, pin, level in changes:
+        print("%10d us  pin %2d  %s" % (micros, pin, "high" if level else "low"))
+        if pin in last and micros - last[pin] < 5000:
+            bounces.setdefault(pin, []).append(micros - last[pin])
+        last[pin] = micros
+
+    for pin, gaps in sorted(bounces.items()):
+        print("pin %2d  %d bounces, %d to %d us apart" % (pin, len(gaps), min(gaps), max(gaps)))
+
+
+def upload(data):
+    decode(data)
+    print("Ic")
+    for i in range(0, len(data), CHUNK):
+        print("Iw %s;" % data[i:i + CHUNK].hex())
+    print("Ii")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest="command", required=True)
+    extract_cmd = commands.add_parser("extract", help="save the last dump in a serial log")
+    extract_cmd.add_argument("log", help="serial log, - for stdin")
+    extract_cmd.add_argument("trace")
+    commands.add_parser("show", help="print a trace").add_argument("trace")
+    commands.add_parser("upload", help="console commands that load a trace").add_argument("trace")
+    args = parser.parse_args()
+
+    if args.command == "extract":
+        log = sys.stdin if args.log == "-" else open(args.log, errors="replace")
+        data = extract(log)
+        if data is None:
+            sys.exit("No pin trace dump found")
+        decode(data)
+        with open(args.trace, "wb") as out:
+            out.write(data)
+        return
+
+    with open(args.trace, "rb") as f:
+        data = f.read()
+    if args.command == "show":
+        show(data)
+    else:
+        upload(data)
+
+
+if __name__ == "__main__":
+    main()
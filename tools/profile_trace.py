@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Convert a profiler dump ('Pd' on the console) to Chrome trace events or folded stacks
+
+The dump is read from a serial log, anything outside the profile ... end
+lines is skipped. Sample PCs are turned into function names with addr2line
+when the app's ELF is given.
+
+  profile_trace.py log.txt --elf build/app.elf > trace.json     (chrome://tracing or Perfetto)
+  profile_trace.py log.txt --elf build/app.elf --folded | flamegraph.pl > profile.svg
+
+Each task is a thread in the trace, named from the dump's task list when
+it was still running then. Folded stacks are the task, the spans open in
+that task when the sample was taken, then the sampled function.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+from collections import Counter
+
+
+def read_dump(lines):
+    samples = []   # (core, task, micros, pc)
+    spans = []     # (core, task, micros, begin, name)
+    tasks = {}     # task: name
+    rate = 0
+    inside = False
+
+    for line in lines:
+        fields = line.split()
+        if not fields:
+            continue
+        if fields[0] == "profile" and len(fields) == 3:
+            inside = True
+            rate = int(fields[1])
+            samples, spans, tasks = [], [], {}
+        elif not inside:
+            continue
+        elif fields[0] == "end":
+            inside = False
+        elif fields[0] == "S" and len(fields) == 5:
+            samples.append((int(fields[1]), int(fields[2], 16), int(fields[3]), int(fields[4], 16)))
+        elif fields[0] in ("B", "E") and len(fields) == 5:
+            spans.append((int(fields[1]), int(fields[2], 16), int(fields[3]), fields[0] == "B", fields[4]))
+        elif fields[0] == "T" and len(fields) >= 3:
+            tasks[int(fields[1], 16)] = " ".join(fields[2:])
+
+    return rate, samples, spans, tasks
+
+
+def task_name(task, tasks):
+    return tasks.get(task, "task %08x" % task)
+
+
+def symbolize(pcs, elf, addr2line):
+    names = {pc: "0x%08x" % pc for pc in pcs}
+    if not elf or not pcs:
+        return names
+
+    ordered = sorted(pcs)
+    out = subprocess.run([addr2line, "-f", "-C", "-e", elf] + ["0x%08x" % pc for pc in ordered],
+                         check=True, capture_output=True, text=True).stdout.splitlines()
+    # Two lines per address, the function then file:line
+    for pc, function in zip(ordered, out[0::2]):
+        if function != "??":
+            names[pc] = function
+    return names
+
+
+def chrome_trace(samples, spans, tasks, names):
+    events = []
+    for task in sorted({s[1] for s in samples} | {s[1] for s in spans}):
+        events.append({"ph": "M", "name": "thread_name", "pid": 0, "tid": task,
+                       "args": {"name": task_name(task, tasks)}})
+    for core, task, micros, begin, name in spans:
+        events.append({"ph": "B" if begin else "E", "name": name, "pid": 0, "tid": task, "ts": micros,
+                       "args": {"core": core}})
+    for core, task, micros, pc in samples:
+        events.append({"ph": "i", "s": "t", "name": names[pc], "pid": 0, "tid": task, "ts": micros,
+                       "args": {"pc": "0x%08x" % pc, "core": core}})
+    events.sort(key=lambda e: e.get("ts", -1))
+    return json.dumps({"traceEvents": events, "displayTimeUnit": "ms"}, indent=1)
+
+
+def folded_stacks(samples, spans, tasks, names):
+    events = sorted([(micros, 1, task, begin, name) for _, task, micros, begin, name in spans] +
+                    [(micros, 2, task, None, pc) for _, task, micros, pc in samples])
+    open_spans = {}
+    counts = Counter()
+
+    for micros, kind, task, begin, what in events:
+        stack = open_spans.setdefault(task, [])
+        if kind == 2:
+            counts[";".join([task_name(task, tasks)] + stack + [names[what]])] += 1
+        elif begin:
+            stack.append(what)
+        elif what in stack:
+            # Ends the innermost span with that name, a dump can start mid span
+            del stack[len(stack) - 1 - stack[::-1].index(what)]
+
+    return "\n".join("%s %d" % (stack, count) for stack, count in sorted(counts.items()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("log", help="serial log with the dump, - for stdin")
+    parser.add_argument("--elf", help="the app's ELF for function names")
+    parser.add_argument("--addr2line", default="xtensa-esp32-elf-addr2line")
+    parser.add_argument("--folded", action="store_true", help="folded stacks instead of Chrome trace JSON")
+    args = parser.parse_args()
+
+    log = sys.stdin if args.log == "-" else open(args.log, errors="replace")
+    rate, samples, spans, tasks = read_dump(log)
+    if not rate:
+        sys.exit("No profile dump found")
+
+    names = symbolize({pc for _, _, _, pc in samples}, args.elf, args.addr2line)
+    if args.folded:
+        print(folded_stacks(samples, spans, tasks, names))
+    else:
+        print(chrome_trace(samples, spans, tasks, names))
+
+
+if __name__ == "__main__":
+    main()